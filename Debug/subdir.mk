@@ -5,21 +5,63 @@
 # Add inputs and outputs from these tool invocations to the build variables 
 C_SRCS += \
 ../Md5.c \
+../archive.c \
+../batch.c \
+../bufpool.c \
+../directio.c \
+../filemap.c \
 ../idea.c \
+../idea_simd.c \
 ../main.c \
-../sha256.c 
+../manifest.c \
+../md5_simd.c \
+../patharena.c \
+../pipeline.c \
+../sha256.c \
+../threadpool.c \
+../tuning.c \
+../uring.c \
+../walker.c 
 
 OBJS += \
 ./Md5.o \
+./archive.o \
+./batch.o \
+./bufpool.o \
+./directio.o \
+./filemap.o \
 ./idea.o \
+./idea_simd.o \
 ./main.o \
-./sha256.o 
+./manifest.o \
+./md5_simd.o \
+./patharena.o \
+./pipeline.o \
+./sha256.o \
+./threadpool.o \
+./tuning.o \
+./uring.o \
+./walker.o 
 
 C_DEPS += \
 ./Md5.d \
+./archive.d \
+./batch.d \
+./bufpool.d \
+./directio.d \
+./filemap.d \
 ./idea.d \
+./idea_simd.d \
 ./main.d \
-./sha256.d 
+./manifest.d \
+./md5_simd.d \
+./patharena.d \
+./pipeline.d \
+./sha256.d \
+./threadpool.d \
+./tuning.d \
+./uring.d \
+./walker.d 
 
 
 # Each subdirectory must supply rules for building sources it contributes
@@ -34,10 +34,12 @@
 /* -- include the following line if the md5.h header file is separate -- */
 #include "Md5.h"
 
+#include <string.h>
+
 /* forward declaration */
-static void Transform ();
+static void Transform (UINT4 *buf, const unsigned char *in, size_t nbBlocks);
 
-static unsigned char PADDING[64] = {
+static const unsigned char PADDING[64] = {
   0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
@@ -48,11 +50,13 @@ static unsigned char PADDING[64] = {
   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
 };
 
-/* F, G and H are basic MD5 functions: selection, majority, parity */
-#define F(x, y, z) (((x) & (y)) | ((~x) & (z)))
-#define G(x, y, z) (((x) & (z)) | ((y) & (~z)))
+/* F, G and H are basic MD5 functions: selection, majority, parity.
+   F and G are written with one operation less than the reference forms
+   ((x & y) | (~x & z)) and ((x & z) | (y & ~z)), which they equal. */
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
 #define H(x, y, z) ((x) ^ (y) ^ (z))
-#define I(x, y, z) ((y) ^ ((x) | (~z))) 
+#define I(x, y, z) ((y) ^ ((x) | (~z)))
 
 /* ROTATE_LEFT rotates x left n bits */
 #define ROTATE_LEFT(x, n) (((x) << (n)) | ((x) >> (32-(n))))
@@ -80,10 +84,16 @@ static unsigned char PADDING[64] = {
    (a) += (b); \
   }
 
-void MD5Init (mdContext)
-MD5_CTX *mdContext;
+/* MD5 words are little-endian: on a little-endian machine they are read
+   straight from the input, whatever its alignment */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ \
+    || defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define MD5_LITTLE_ENDIAN
+#endif
+
+void MD5Init (MD5_CTX *mdContext)
 {
-  mdContext->i[0] = mdContext->i[1] = (UINT4)0;
+  mdContext->count = (UINT8)0;
 
   /* Load magic initialization constants.
    */
@@ -93,180 +103,206 @@ MD5_CTX *mdContext;
   mdContext->buf[3] = (UINT4)0x10325476;
 }
 
-void MD5Update (mdContext, inBuf, inLen)
-MD5_CTX *mdContext;
-unsigned char *inBuf;
-unsigned int inLen;
+/* Whole blocks are hashed from inBuf directly; only the bytes that do
+   not fill a block are kept in mdContext->in until the next call */
+void MD5Update (MD5_CTX *mdContext, const unsigned char *inBuf, UINT8 inLen)
 {
-  UINT4 in[16];
-  int mdi;
-  unsigned int i, ii;
+  unsigned int mdi, n;
+  UINT8 nbBlocks;
 
   /* compute number of bytes mod 64 */
-  mdi = (int)((mdContext->i[0] >> 3) & 0x3F);
-
-  /* update number of bits */
-  if ((mdContext->i[0] + ((UINT4)inLen << 3)) < mdContext->i[0])
-    mdContext->i[1]++;
-  mdContext->i[0] += ((UINT4)inLen << 3);
-  mdContext->i[1] += ((UINT4)inLen >> 29);
-
-  while (inLen--) {
-    /* add new character to buffer, increment mdi */
-    mdContext->in[mdi++] = *inBuf++;
-
-    /* transform if necessary */
-    if (mdi == 0x40) {
-      for (i = 0, ii = 0; i < 16; i++, ii += 4)
-        in[i] = (((UINT4)mdContext->in[ii+3]) << 24) |
-                (((UINT4)mdContext->in[ii+2]) << 16) |
-                (((UINT4)mdContext->in[ii+1]) << 8) |
-                ((UINT4)mdContext->in[ii]);
-      Transform (mdContext->buf, in);
-      mdi = 0;
+  mdi = (unsigned int)(mdContext->count & 0x3F);
+
+  /* update number of bytes */
+  mdContext->count += inLen;
+
+  /* complete the pending block first */
+  if (mdi) {
+    n = 64 - mdi;
+    if (inLen < n) {
+      memcpy (mdContext->in + mdi, inBuf, (size_t)inLen);
+      return;
     }
+    memcpy (mdContext->in + mdi, inBuf, n);
+    Transform (mdContext->buf, mdContext->in, 1);
+    inBuf += n;
+    inLen -= n;
   }
+
+  nbBlocks = inLen / 64;
+  if (nbBlocks) {
+    Transform (mdContext->buf, inBuf, (size_t)nbBlocks);
+    inBuf += nbBlocks * 64;
+    inLen -= nbBlocks * 64;
+  }
+
+  if (inLen)
+    memcpy (mdContext->in, inBuf, (size_t)inLen);
 }
 
-void MD5Final (mdContext)
-MD5_CTX *mdContext;
+void MD5Final (MD5_CTX *mdContext)
 {
-  UINT4 in[16];
-  int mdi;
-  unsigned int i, ii;
-  unsigned int padLen;
+  unsigned char bits[8];
+  UINT8 nbBits = mdContext->count << 3;
+  unsigned int mdi, padLen, i;
 
-  /* save number of bits */
-  in[14] = mdContext->i[0];
-  in[15] = mdContext->i[1];
+  /* save number of bits, least significant byte first */
+  for (i = 0; i < 8; i++)
+    bits[i] = (unsigned char)((nbBits >> (8 * i)) & 0xFF);
 
   /* compute number of bytes mod 64 */
-  mdi = (int)((mdContext->i[0] >> 3) & 0x3F);
+  mdi = (unsigned int)(mdContext->count & 0x3F);
 
-  /* pad out to 56 mod 64 */
+  /* pad out to 56 mod 64, then append length in bits and transform */
   padLen = (mdi < 56) ? (56 - mdi) : (120 - mdi);
   MD5Update (mdContext, PADDING, padLen);
-
-  /* append length in bits and transform */
-  for (i = 0, ii = 0; i < 14; i++, ii += 4)
-    in[i] = (((UINT4)mdContext->in[ii+3]) << 24) |
-            (((UINT4)mdContext->in[ii+2]) << 16) |
-            (((UINT4)mdContext->in[ii+1]) << 8) |
-            ((UINT4)mdContext->in[ii]);
-  Transform (mdContext->buf, in);
+  MD5Update (mdContext, bits, 8);
 
   /* store buffer in digest */
-  for (i = 0, ii = 0; i < 4; i++, ii += 4) {
-    mdContext->digest[ii] = (unsigned char)(mdContext->buf[i] & 0xFF);
-    mdContext->digest[ii+1] =
+  for (i = 0; i < 4; i++) {
+    mdContext->digest[4*i] = (unsigned char)(mdContext->buf[i] & 0xFF);
+    mdContext->digest[4*i+1] =
       (unsigned char)((mdContext->buf[i] >> 8) & 0xFF);
-    mdContext->digest[ii+2] =
+    mdContext->digest[4*i+2] =
       (unsigned char)((mdContext->buf[i] >> 16) & 0xFF);
-    mdContext->digest[ii+3] =
+    mdContext->digest[4*i+3] =
       (unsigned char)((mdContext->buf[i] >> 24) & 0xFF);
   }
 }
 
-/* Basic MD5 step. Transform buf based on in.
+#ifdef MD5_LITTLE_ENDIAN
+static inline UINT4 LoadWord (const unsigned char *p)
+{
+  UINT4 v;
+  memcpy (&v, p, 4);
+  return v;
+}
+#endif
+
+/* Basic MD5 step. Transform buf based on nbBlocks blocks of in,
+   keeping the state in registers from one block to the next.
  */
-static void Transform (buf, in)
-UINT4 *buf;
-UINT4 *in;
+static void Transform (UINT4 *buf, const unsigned char *in, size_t nbBlocks)
 {
   UINT4 a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+  UINT4 aa, bb, cc, dd;
+#ifdef MD5_LITTLE_ENDIAN
+#define X(i) LoadWord (in + 4*(i))
+#else
+  UINT4 x[16];
+  unsigned int i;
+#define X(i) x[i]
+#endif
+
+  for ( ; nbBlocks > 0; nbBlocks--, in += 64) {
+#ifndef MD5_LITTLE_ENDIAN
+    for (i = 0; i < 16; i++)
+      x[i] = (((UINT4)in[4*i+3]) << 24) |
+             (((UINT4)in[4*i+2]) << 16) |
+             (((UINT4)in[4*i+1]) << 8) |
+             ((UINT4)in[4*i]);
+#endif
+    aa = a; bb = b; cc = c; dd = d;
 
   /* Round 1 */
 #define S11 7
 #define S12 12
 #define S13 17
 #define S14 22
-  FF ( a, b, c, d, in[ 0], S11, 3614090360); /* 1 */
-  FF ( d, a, b, c, in[ 1], S12, 3905402710); /* 2 */
-  FF ( c, d, a, b, in[ 2], S13,  606105819); /* 3 */
-  FF ( b, c, d, a, in[ 3], S14, 3250441966); /* 4 */
-  FF ( a, b, c, d, in[ 4], S11, 4118548399); /* 5 */
-  FF ( d, a, b, c, in[ 5], S12, 1200080426); /* 6 */
-  FF ( c, d, a, b, in[ 6], S13, 2821735955); /* 7 */
-  FF ( b, c, d, a, in[ 7], S14, 4249261313); /* 8 */
-  FF ( a, b, c, d, in[ 8], S11, 1770035416); /* 9 */
-  FF ( d, a, b, c, in[ 9], S12, 2336552879); /* 10 */
-  FF ( c, d, a, b, in[10], S13, 4294925233); /* 11 */
-  FF ( b, c, d, a, in[11], S14, 2304563134); /* 12 */
-  FF ( a, b, c, d, in[12], S11, 1804603682); /* 13 */
-  FF ( d, a, b, c, in[13], S12, 4254626195); /* 14 */
-  FF ( c, d, a, b, in[14], S13, 2792965006); /* 15 */
-  FF ( b, c, d, a, in[15], S14, 1236535329); /* 16 */
+  FF ( a, b, c, d, X(0), S11, 3614090360u); /* 1 */
+  FF ( d, a, b, c, X(1), S12, 3905402710u); /* 2 */
+  FF ( c, d, a, b, X(2), S13,  606105819u); /* 3 */
+  FF ( b, c, d, a, X(3), S14, 3250441966u); /* 4 */
+  FF ( a, b, c, d, X(4), S11, 4118548399u); /* 5 */
+  FF ( d, a, b, c, X(5), S12, 1200080426u); /* 6 */
+  FF ( c, d, a, b, X(6), S13, 2821735955u); /* 7 */
+  FF ( b, c, d, a, X(7), S14, 4249261313u); /* 8 */
+  FF ( a, b, c, d, X(8), S11, 1770035416u); /* 9 */
+  FF ( d, a, b, c, X(9), S12, 2336552879u); /* 10 */
+  FF ( c, d, a, b, X(10), S13, 4294925233u); /* 11 */
+  FF ( b, c, d, a, X(11), S14, 2304563134u); /* 12 */
+  FF ( a, b, c, d, X(12), S11, 1804603682u); /* 13 */
+  FF ( d, a, b, c, X(13), S12, 4254626195u); /* 14 */
+  FF ( c, d, a, b, X(14), S13, 2792965006u); /* 15 */
+  FF ( b, c, d, a, X(15), S14, 1236535329u); /* 16 */
 
   /* Round 2 */
 #define S21 5
 #define S22 9
 #define S23 14
 #define S24 20
-  GG ( a, b, c, d, in[ 1], S21, 4129170786); /* 17 */
-  GG ( d, a, b, c, in[ 6], S22, 3225465664); /* 18 */
-  GG ( c, d, a, b, in[11], S23,  643717713); /* 19 */
-  GG ( b, c, d, a, in[ 0], S24, 3921069994); /* 20 */
-  GG ( a, b, c, d, in[ 5], S21, 3593408605); /* 21 */
-  GG ( d, a, b, c, in[10], S22,   38016083); /* 22 */
-  GG ( c, d, a, b, in[15], S23, 3634488961); /* 23 */
-  GG ( b, c, d, a, in[ 4], S24, 3889429448); /* 24 */
-  GG ( a, b, c, d, in[ 9], S21,  568446438); /* 25 */
-  GG ( d, a, b, c, in[14], S22, 3275163606); /* 26 */
-  GG ( c, d, a, b, in[ 3], S23, 4107603335); /* 27 */
-  GG ( b, c, d, a, in[ 8], S24, 1163531501); /* 28 */
-  GG ( a, b, c, d, in[13], S21, 2850285829); /* 29 */
-  GG ( d, a, b, c, in[ 2], S22, 4243563512); /* 30 */
-  GG ( c, d, a, b, in[ 7], S23, 1735328473); /* 31 */
-  GG ( b, c, d, a, in[12], S24, 2368359562); /* 32 */
+  GG ( a, b, c, d, X(1), S21, 4129170786u); /* 17 */
+  GG ( d, a, b, c, X(6), S22, 3225465664u); /* 18 */
+  GG ( c, d, a, b, X(11), S23,  643717713u); /* 19 */
+  GG ( b, c, d, a, X(0), S24, 3921069994u); /* 20 */
+  GG ( a, b, c, d, X(5), S21, 3593408605u); /* 21 */
+  GG ( d, a, b, c, X(10), S22,   38016083u); /* 22 */
+  GG ( c, d, a, b, X(15), S23, 3634488961u); /* 23 */
+  GG ( b, c, d, a, X(4), S24, 3889429448u); /* 24 */
+  GG ( a, b, c, d, X(9), S21,  568446438u); /* 25 */
+  GG ( d, a, b, c, X(14), S22, 3275163606u); /* 26 */
+  GG ( c, d, a, b, X(3), S23, 4107603335u); /* 27 */
+  GG ( b, c, d, a, X(8), S24, 1163531501u); /* 28 */
+  GG ( a, b, c, d, X(13), S21, 2850285829u); /* 29 */
+  GG ( d, a, b, c, X(2), S22, 4243563512u); /* 30 */
+  GG ( c, d, a, b, X(7), S23, 1735328473u); /* 31 */
+  GG ( b, c, d, a, X(12), S24, 2368359562u); /* 32 */
 
   /* Round 3 */
 #define S31 4
 #define S32 11
 #define S33 16
 #define S34 23
-  HH ( a, b, c, d, in[ 5], S31, 4294588738); /* 33 */
-  HH ( d, a, b, c, in[ 8], S32, 2272392833); /* 34 */
-  HH ( c, d, a, b, in[11], S33, 1839030562); /* 35 */
-  HH ( b, c, d, a, in[14], S34, 4259657740); /* 36 */
-  HH ( a, b, c, d, in[ 1], S31, 2763975236); /* 37 */
-  HH ( d, a, b, c, in[ 4], S32, 1272893353); /* 38 */
-  HH ( c, d, a, b, in[ 7], S33, 4139469664); /* 39 */
-  HH ( b, c, d, a, in[10], S34, 3200236656); /* 40 */
-  HH ( a, b, c, d, in[13], S31,  681279174); /* 41 */
-  HH ( d, a, b, c, in[ 0], S32, 3936430074); /* 42 */
-  HH ( c, d, a, b, in[ 3], S33, 3572445317); /* 43 */
-  HH ( b, c, d, a, in[ 6], S34,   76029189); /* 44 */
-  HH ( a, b, c, d, in[ 9], S31, 3654602809); /* 45 */
-  HH ( d, a, b, c, in[12], S32, 3873151461); /* 46 */
-  HH ( c, d, a, b, in[15], S33,  530742520); /* 47 */
-  HH ( b, c, d, a, in[ 2], S34, 3299628645); /* 48 */
+  HH ( a, b, c, d, X(5), S31, 4294588738u); /* 33 */
+  HH ( d, a, b, c, X(8), S32, 2272392833u); /* 34 */
+  HH ( c, d, a, b, X(11), S33, 1839030562u); /* 35 */
+  HH ( b, c, d, a, X(14), S34, 4259657740u); /* 36 */
+  HH ( a, b, c, d, X(1), S31, 2763975236u); /* 37 */
+  HH ( d, a, b, c, X(4), S32, 1272893353u); /* 38 */
+  HH ( c, d, a, b, X(7), S33, 4139469664u); /* 39 */
+  HH ( b, c, d, a, X(10), S34, 3200236656u); /* 40 */
+  HH ( a, b, c, d, X(13), S31,  681279174u); /* 41 */
+  HH ( d, a, b, c, X(0), S32, 3936430074u); /* 42 */
+  HH ( c, d, a, b, X(3), S33, 3572445317u); /* 43 */
+  HH ( b, c, d, a, X(6), S34,   76029189u); /* 44 */
+  HH ( a, b, c, d, X(9), S31, 3654602809u); /* 45 */
+  HH ( d, a, b, c, X(12), S32, 3873151461u); /* 46 */
+  HH ( c, d, a, b, X(15), S33,  530742520u); /* 47 */
+  HH ( b, c, d, a, X(2), S34, 3299628645u); /* 48 */
 
   /* Round 4 */
 #define S41 6
 #define S42 10
 #define S43 15
 #define S44 21
-  II ( a, b, c, d, in[ 0], S41, 4096336452); /* 49 */
-  II ( d, a, b, c, in[ 7], S42, 1126891415); /* 50 */
-  II ( c, d, a, b, in[14], S43, 2878612391); /* 51 */
-  II ( b, c, d, a, in[ 5], S44, 4237533241); /* 52 */
-  II ( a, b, c, d, in[12], S41, 1700485571); /* 53 */
-  II ( d, a, b, c, in[ 3], S42, 2399980690); /* 54 */
-  II ( c, d, a, b, in[10], S43, 4293915773); /* 55 */
-  II ( b, c, d, a, in[ 1], S44, 2240044497); /* 56 */
-  II ( a, b, c, d, in[ 8], S41, 1873313359); /* 57 */
-  II ( d, a, b, c, in[15], S42, 4264355552); /* 58 */
-  II ( c, d, a, b, in[ 6], S43, 2734768916); /* 59 */
-  II ( b, c, d, a, in[13], S44, 1309151649); /* 60 */
-  II ( a, b, c, d, in[ 4], S41, 4149444226); /* 61 */
-  II ( d, a, b, c, in[11], S42, 3174756917); /* 62 */
-  II ( c, d, a, b, in[ 2], S43,  718787259); /* 63 */
-  II ( b, c, d, a, in[ 9], S44, 3951481745); /* 64 */
-
-  buf[0] += a;
-  buf[1] += b;
-  buf[2] += c;
-  buf[3] += d;
+  II ( a, b, c, d, X(0), S41, 4096336452u); /* 49 */
+  II ( d, a, b, c, X(7), S42, 1126891415u); /* 50 */
+  II ( c, d, a, b, X(14), S43, 2878612391u); /* 51 */
+  II ( b, c, d, a, X(5), S44, 4237533241u); /* 52 */
+  II ( a, b, c, d, X(12), S41, 1700485571u); /* 53 */
+  II ( d, a, b, c, X(3), S42, 2399980690u); /* 54 */
+  II ( c, d, a, b, X(10), S43, 4293915773u); /* 55 */
+  II ( b, c, d, a, X(1), S44, 2240044497u); /* 56 */
+  II ( a, b, c, d, X(8), S41, 1873313359u); /* 57 */
+  II ( d, a, b, c, X(15), S42, 4264355552u); /* 58 */
+  II ( c, d, a, b, X(6), S43, 2734768916u); /* 59 */
+  II ( b, c, d, a, X(13), S44, 1309151649u); /* 60 */
+  II ( a, b, c, d, X(4), S41, 4149444226u); /* 61 */
+  II ( d, a, b, c, X(11), S42, 3174756917u); /* 62 */
+  II ( c, d, a, b, X(2), S43,  718787259u); /* 63 */
+  II ( b, c, d, a, X(9), S44, 3951481745u); /* 64 */
+
+    a += aa;
+    b += bb;
+    c += cc;
+    d += dd;
+  }
+
+  buf[0] = a;
+  buf[1] = b;
+  buf[2] = c;
+  buf[3] = d;
+#undef X
 }
 
 /*
@@ -312,8 +348,7 @@ UINT4 *in;
    Order is from low-order byte to high-order byte of digest.
    Each byte is printed with high-order hexadecimal digit first.
  */
-static void MDPrint (mdContext)
-MD5_CTX *mdContext;
+static void MDPrint (MD5_CTX *mdContext)
 {
   int i;
 
@@ -334,7 +369,7 @@ static long TEST_BYTES = (long)TEST_BLOCK_SIZE * (long)TEST_BLOCKS;
    Measures wall time required to digest TEST_BLOCKS * TEST_BLOCK_SIZE
    characters.
  */
-static void MDTimeTrial ()
+static void MDTimeTrial (void)
 {
   MD5_CTX mdContext;
   time_t endTime, startTime;
@@ -370,14 +405,13 @@ static void MDTimeTrial ()
    Prints out message digest, a space, the string (in quotes) and a
    carriage return.
  */
-static void MDString (inString)
-char *inString;
+static void MDString (const char *inString)
 {
   MD5_CTX mdContext;
   unsigned int len = strlen (inString);
 
   MD5Init (&mdContext);
-  MD5Update (&mdContext, inString, len);
+  MD5Update (&mdContext, (const unsigned char *)inString, len);
   MD5Final (&mdContext);
   MDPrint (&mdContext);
   printf (" \"%s\"\n\n", inString);
@@ -387,8 +421,7 @@ char *inString;
    Prints out message digest, a space, the file name, and a carriage
    return.
  */
-static void MDFile (filename)
-char *filename;
+static void MDFile (const char *filename)
 {
   FILE *inFile = fopen (filename, "rb");
   MD5_CTX mdContext;
@@ -412,7 +445,7 @@ char *filename;
 /* Writes the message digest of the data from stdin onto stdout,
    followed by a carriage return.
  */
-static void MDFilter ()
+static void MDFilter (void)
 {
   MD5_CTX mdContext;
   int bytes;
@@ -428,7 +461,7 @@ static void MDFilter ()
 
 /* Runs a standard suite of test data.
  */
-static void MDTestSuite ()
+static void MDTestSuite (void)
 {
   printf ("MD5 test suite results:\n\n");
   MDString ("");
@@ -446,9 +479,7 @@ static void MDTestSuite ()
 }
 
 
-void main (argc, argv)
-int argc;
-char *argv[];
+int main (int argc, char *argv[])
 {
   int i;
 
@@ -470,6 +501,8 @@ char *argv[];
       else if (strcmp (argv[i], "-x") == 0)
         MDTestSuite ();
       else MDFile (argv[i]);
+
+  return 0;
 }
 
 /*
@@ -40,20 +40,24 @@
  **********************************************************************
  */
 
-/* typedef a 32 bit type */
-typedef unsigned long int UINT4;
+#include <stddef.h>
+#include <stdint.h>
+
+/* typedef a 32 bit type and a 64 bit type */
+typedef uint32_t UINT4;
+typedef uint64_t UINT8;
 
 /* Data structure for MD5 (Message Digest) computation */
 typedef struct {
-  UINT4 i[2];                   /* number of _bits_ handled mod 2^64 */
   UINT4 buf[4];                                    /* scratch buffer */
-  unsigned char in[64];                              /* input buffer */
+  UINT8 count;                 /* number of _bytes_ handled mod 2^64 */
+  unsigned char in[64];              /* input buffer, partial block */
   unsigned char digest[16];     /* actual digest after MD5Final call */
 } MD5_CTX;
 
-void MD5Init ();
-void MD5Update ();
-void MD5Final ();
+void MD5Init (MD5_CTX *mdContext);
+void MD5Update (MD5_CTX *mdContext, const unsigned char *inBuf, UINT8 inLen);
+void MD5Final (MD5_CTX *mdContext);
 
 
 #endif /* MD5_H_ */
@@ -0,0 +1,463 @@
+/**** LICENSE INFORMATION ****
+IDEA - archive.c
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Millions of small files cost more to create, close and flush one by one than to
+ * encrypt, so they can be packed into a single archive instead. Each member goes
+ * through the file pipeline like a file of its own, in counter mode, so that any of
+ * them can be decrypted alone from its offset. The index is kept in memory while the
+ * archive is open, with a hash table on the names, and written after the last member
+ * when the archive is closed. New members are written over the old index, as a zip
+ * file would: the archive cannot be read if the program stops before closing it. */
+
+#include <errno.h>
+
+#include "archive.h"
+#include "pipeline.h"
+
+#define MIN_ARCHIVE_MEMBERS		256
+
+static int ReadArchiveIndex(Archive *ar, Uint64 fileSize);
+static int WriteArchiveIndex(Archive *ar);
+static int AddArchiveMember(Archive *ar, const ArchiveMember *member, const char *name);
+static void InsertArchiveName(Archive *ar, Uint64 i);
+static Uint64 HashName(const char *name);
+
+
+int OpenArchive(Archive *ar, IdeaContext *ctx, const char *fileName, int writable)
+{
+	Uint16 keySha[16];
+	char magic[8];
+	Uint8 version = ARCHIVE_VERSION;
+	Sint64 size;
+
+	memset(ar, 0, sizeof(Archive));
+	ar->ctx = ctx;
+	ar->writable = writable;
+	InitPathArena(&ar->names);
+	if (!(ar->fileName = StoreArenaString(&ar->names, fileName, 0)))
+	{
+		LogMessage(ctx, "Unable to allocate the index of the archive %s.\n", fileName);
+		return 0;
+	}
+
+	//A new archive is empty, but its index is written anyway
+	if (!(ar->file = fopen(fileName, writable ? "r+b" : "rb")) && writable && errno == ENOENT)
+	{
+		if (!(ar->file = fopen(fileName, "w+b")))
+		{
+			LogMessage(ctx, "Unable to create the archive %s: %s\n", fileName, strerror(errno));
+			FreePathArena(&ar->names);
+			return 0;
+		}
+		if (fwrite(ctx->keySha, 1, 32, ar->file) != 32 || fwrite(ARCHIVE_MAGIC, 1, 8, ar->file) != 8
+				|| fwrite(&version, 1, 1, ar->file) != 1)
+		{
+			LogMessage(ctx, "An error occurred during writing header in %s: %s\n", fileName, strerror(ferror(ar->file)));
+			fclose(ar->file);
+			remove(fileName);
+			FreePathArena(&ar->names);
+			return 0;
+		}
+		ar->dataEnd = ARCHIVE_HEADER_SIZE;
+		ar->modified = 1;
+		return 1;
+	}
+	if (!ar->file)
+	{
+		LogMessage(ctx, "Unable to open the archive %s: %s\n", fileName, strerror(errno));
+		FreePathArena(&ar->names);
+		return 0;
+	}
+
+	if (SetFilePosition(ar->file, 0, SEEK_END) || (size = GetFilePosition(ar->file)) < 0)
+	{
+		LogMessage(ctx, "Unable to get the size of the archive %s: %s\n", fileName, strerror(errno));
+		CloseArchive(ar);
+		return 0;
+	}
+	rewind(ar->file);
+	if (fread(keySha, 1, 32, ar->file) != 32 || fread(magic, 1, 8, ar->file) != 8 || fread(&version, 1, 1, ar->file) != 1
+			|| memcmp(magic, ARCHIVE_MAGIC, 8))
+	{
+		LogMessage(ctx, "%s is not a valid archive.\n", fileName);
+		CloseArchive(ar);
+		return 0;
+	}
+	if (memcmp(keySha, ctx->keySha, 32))
+	{
+		LogMessage(ctx, "Wrong password for the archive %s, or not a valid archive.\n", fileName);
+		CloseArchive(ar);
+		return 0;
+	}
+	if (version != ARCHIVE_VERSION)
+	{
+		LogMessage(ctx, "%s uses options that this version does not support.\n", fileName);
+		CloseArchive(ar);
+		return 0;
+	}
+
+	if (!ReadArchiveIndex(ar, (Uint64)size))
+	{
+		CloseArchive(ar);
+		return 0;
+	}
+	return 1;
+}
+
+int CloseArchive(Archive *ar)
+{
+	int r = 1;
+
+	if (ar->file)
+	{
+		if (ar->writable && ar->modified && !WriteArchiveIndex(ar))
+			r = 0;
+		if (fclose(ar->file) && ar->writable && r)
+		{
+			LogMessage(ar->ctx, "An error occurred during writing the index of %s: %s\n", ar->fileName, strerror(errno));
+			r = 0;
+		}
+	}
+
+	free(ar->members);
+	free(ar->table);
+	FreePathArena(&ar->names);
+	memset(ar, 0, sizeof(Archive));
+	return r;
+}
+
+int IsArchiveFile(const char *fileName)
+{
+	FILE *file = fopen(fileName, "rb");
+	char header[ARCHIVE_HEADER_SIZE];
+	int r;
+
+	if (!file)
+		return 0;
+	r = fread(header, 1, ARCHIVE_HEADER_SIZE, file) == ARCHIVE_HEADER_SIZE && !memcmp(header + 32, ARCHIVE_MAGIC, 8);
+	fclose(file);
+	return r;
+}
+
+int AddArchiveFile(Archive *ar, const char *fileName, const char *name)
+{
+	IdeaContext *ctx = ar->ctx;
+	ArchiveMember member;
+	FILE *fileIn = NULL;
+	Sint64 size;
+	int r;
+
+	memset(&member, 0, sizeof(ArchiveMember));
+	if (!*name || strlen(name) > MAX_PATH)
+	{
+		LogMessage(ctx, "The name %s cannot be stored in an archive.\n", name);
+		return 0;
+	}
+
+	if (!(fileIn = fopen(fileName, "rb")))
+	{
+		LogMessage(ctx, "Unable to open the input file %s: %s\n.", fileName, strerror(errno));
+		return 0;
+	}
+	if (SetFilePosition(fileIn, 0, SEEK_END) || (size = GetFilePosition(fileIn)) < 0)
+	{
+		LogMessage(ctx, "Unable to get the size of the input file %s: %s\n", fileName, strerror(errno));
+		fclose(fileIn);
+		return 0;
+	}
+	rewind(fileIn);
+
+	if (!GenerateNonce(ctx, &member.nonce))
+	{
+		fclose(fileIn);
+		return 0;
+	}
+
+	//From the first byte written, the old index is lost: it has to be written again
+	ar->modified = 1;
+	if (SetFilePosition(ar->file, ar->dataEnd, SEEK_SET))
+		r = PIPELINE_WRITE_ERROR;
+	else
+		r = RunFilePipeline(ctx, fileIn, ar->file, 1, CIPHER_CTR, member.nonce, size, size, HASH_TREE, member.checkSum, 0, NULL);
+	if (r == PIPELINE_WRITE_ERROR)
+		LogMessage(ctx, "An error occurred during writing data in %s: %s\n", ar->fileName, strerror(ferror(ar->file)));
+	else if (r == PIPELINE_READ_ERROR)
+		LogMessage(ctx, "An error occurred during reading from %s: %s\n", fileName, strerror(ferror(fileIn)));
+	fclose(fileIn);
+	if (r != PIPELINE_OK)
+		return 0;
+
+	member.offset = ar->dataEnd;
+	member.size = size;
+	if (!AddArchiveMember(ar, &member, name))
+	{
+		LogMessage(ctx, "Unable to allocate the index of the archive %s.\n", ar->fileName);
+		return 0;
+	}
+	ar->dataEnd += size;
+	return 1;
+}
+
+//Linear probing from the hash of the name
+Sint64 FindArchiveMember(const Archive *ar, const char *name)
+{
+	Uint64 slot, mask = ar->tableSize - 1;
+
+	if (!ar->tableSize)
+		return -1;
+	for (slot = HashName(name) & mask ; ar->table[slot] ; slot = (slot+1) & mask)
+	{
+		if (!strcmp(ar->members[ar->table[slot]-1].name, name))
+			return (Sint64)(ar->table[slot]-1);
+	}
+
+	return -1;
+}
+
+int ExtractArchiveMember(Archive *ar, Uint64 i, const char *fileNameOut)
+{
+	IdeaContext *ctx = ar->ctx;
+	const ArchiveMember *member = &(ar->members[i]);
+	FILE *fileOut = NULL;
+	Uint16 checkSum[8];
+	int r;
+
+	if (!(fileOut = fopen(fileNameOut, "w+b")))
+	{
+		LogMessage(ctx, "Unable to create the output file %s: %s\n.", fileNameOut, strerror(errno));
+		return 0;
+	}
+
+	//Only the bytes of the member are read, not the members after it
+	if (SetFilePosition(ar->file, member->offset, SEEK_SET))
+		r = PIPELINE_READ_ERROR;
+	else
+		r = RunFilePipeline(ctx, ar->file, fileOut, 0, CIPHER_CTR, member->nonce, member->size, member->size,
+				HASH_TREE, checkSum, 0, NULL);
+	if (r == PIPELINE_WRITE_ERROR)
+		LogMessage(ctx, "An error occurred during writing data in %s: %s\n", fileNameOut, strerror(ferror(fileOut)));
+	else if (r == PIPELINE_READ_ERROR)
+		LogMessage(ctx, "An error occurred during reading data from %s: %s\n", ar->fileName, strerror(ferror(ar->file)));
+
+	if (fclose(fileOut) && r == PIPELINE_OK)
+	{
+		LogMessage(ctx, "An error occurred during writing data in %s: %s\n", fileNameOut, strerror(errno));
+		r = PIPELINE_WRITE_ERROR;
+	}
+	if (r == PIPELINE_OK && memcmp(checkSum, member->checkSum, 16))
+	{
+		LogMessage(ctx, "The MD5 checksum of %s in %s is incorrect. It may have been corrupted.\n", member->name, ar->fileName);
+		r = PIPELINE_READ_ERROR;
+	}
+	if (r != PIPELINE_OK)
+	{
+		remove(fileNameOut);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+//Checks the footer, then decrypts and parses the index
+static int ReadArchiveIndex(Archive *ar, Uint64 fileSize)
+{
+	IdeaContext *ctx = ar->ctx;
+	ArchiveMember member;
+	Uint64 indexOffset = 0, indexSize = 0, indexNonce = 0, nbMembers = 0, k, p;
+	Uint16 md5[8], checkSum[8], l;
+	char magic[8], name[MAX_PATH+1];
+	Uint8 *index = NULL;
+	int valid;
+
+	valid = fileSize >= ARCHIVE_HEADER_SIZE + ARCHIVE_FOOTER_SIZE && !SetFilePosition(ar->file, -ARCHIVE_FOOTER_SIZE, SEEK_END)
+			&& fread(&indexOffset, 8, 1, ar->file) == 1 && fread(&indexSize, 8, 1, ar->file) == 1
+			&& fread(&indexNonce, 8, 1, ar->file) == 1 && fread(checkSum, 1, 16, ar->file) == 16
+			&& fread(&nbMembers, 8, 1, ar->file) == 1 && fread(magic, 1, 8, ar->file) == 8
+			&& !memcmp(magic, ARCHIVE_MAGIC, 8) && indexOffset >= ARCHIVE_HEADER_SIZE
+			&& indexOffset <= fileSize - ARCHIVE_FOOTER_SIZE && indexSize == fileSize - ARCHIVE_FOOTER_SIZE - indexOffset
+			&& nbMembers <= indexSize / ARCHIVE_ENTRY_SIZE;
+	if (!valid)
+	{
+		LogMessage(ctx, "%s is not a valid archive.\n", ar->fileName);
+		return 0;
+	}
+
+	//Whole blocks for the cipher
+	if (!(index = malloc((size_t)(indexSize+7)/8 * 8 + 8)))
+	{
+		LogMessage(ctx, "Unable to allocate the index of the archive %s.\n", ar->fileName);
+		return 0;
+	}
+	if (SetFilePosition(ar->file, indexOffset, SEEK_SET) || fread(index, 1, (size_t)indexSize, ar->file) != indexSize)
+	{
+		LogMessage(ctx, "An error occurred during reading the index from %s: %s\n", ar->fileName, strerror(ferror(ar->file)));
+		free(index);
+		return 0;
+	}
+	if (!ProcessCTR_MT(ctx, (Uint16*)index, (Uint16*)index, (size_t)(indexSize+7)/8 * 8, indexNonce, 0)
+			|| !ComputeMD5((char*)index, md5, (size_t)indexSize))
+	{
+		free(index);
+		return 0;
+	}
+	if (memcmp(md5, checkSum, 16))
+	{
+		LogMessage(ctx, "The index of %s is corrupted.\n", ar->fileName);
+		free(index);
+		return 0;
+	}
+
+	for (k=0, p=0 ; k < nbMembers && valid ; k++, p += ARCHIVE_ENTRY_SIZE + l)
+	{
+		valid = 0;
+		if (indexSize - p < ARCHIVE_ENTRY_SIZE)
+			break;
+		memcpy(&member.offset, index + p, 8);
+		memcpy(&member.size, index + p + 8, 8);
+		memcpy(&member.nonce, index + p + 16, 8);
+		memcpy(member.checkSum, index + p + 24, 16);
+		memcpy(&l, index + p + 40, 2);
+		if (!l || l > MAX_PATH || indexSize - p - ARCHIVE_ENTRY_SIZE < l || member.offset < ARCHIVE_HEADER_SIZE
+				|| member.offset > indexOffset || member.size > indexOffset - member.offset)
+			break;
+		memcpy(name, index + p + ARCHIVE_ENTRY_SIZE, l);
+		name[l] = '\0';
+		if (!AddArchiveMember(ar, &member, name))
+		{
+			LogMessage(ctx, "Unable to allocate the index of the archive %s.\n", ar->fileName);
+			free(index);
+			return 0;
+		}
+		valid = 1;
+	}
+	free(index);
+	if (!valid || p != indexSize)
+	{
+		LogMessage(ctx, "The index of %s is corrupted.\n", ar->fileName);
+		return 0;
+	}
+
+	ar->dataEnd = indexOffset;
+	return 1;
+}
+
+//After the last member, with a new nonce
+static int WriteArchiveIndex(Archive *ar)
+{
+	IdeaContext *ctx = ar->ctx;
+	ArchiveMember *member;
+	Uint64 indexSize = 0, nonce, k, p;
+	Uint16 md5[8], l;
+	Uint8 *index = NULL;
+	int r;
+
+	for (k=0 ; k < ar->nbMembers ; k++)
+		indexSize += ARCHIVE_ENTRY_SIZE + strlen(ar->members[k].name);
+	if (!(index = calloc((size_t)(indexSize+7)/8 * 8 + 8, 1)))
+	{
+		LogMessage(ctx, "Unable to allocate the index of the archive %s.\n", ar->fileName);
+		return 0;
+	}
+
+	for (k=0, p=0 ; k < ar->nbMembers ; k++, p += ARCHIVE_ENTRY_SIZE + l)
+	{
+		member = &(ar->members[k]);
+		l = (Uint16)strlen(member->name);
+		memcpy(index + p, &member->offset, 8);
+		memcpy(index + p + 8, &member->size, 8);
+		memcpy(index + p + 16, &member->nonce, 8);
+		memcpy(index + p + 24, member->checkSum, 16);
+		memcpy(index + p + 40, &l, 2);
+		memcpy(index + p + ARCHIVE_ENTRY_SIZE, member->name, l);
+	}
+
+	r = ComputeMD5((char*)index, md5, (size_t)indexSize) && GenerateNonce(ctx, &nonce)
+			&& ProcessCTR_MT(ctx, (Uint16*)index, (Uint16*)index, (size_t)(indexSize+7)/8 * 8, nonce, 0);
+	if (r && (SetFilePosition(ar->file, ar->dataEnd, SEEK_SET) || fwrite(index, 1, (size_t)indexSize, ar->file) != indexSize
+			|| fwrite(&ar->dataEnd, 8, 1, ar->file) != 1 || fwrite(&indexSize, 8, 1, ar->file) != 1
+			|| fwrite(&nonce, 8, 1, ar->file) != 1 || fwrite(md5, 1, 16, ar->file) != 16
+			|| fwrite(&ar->nbMembers, 8, 1, ar->file) != 1 || fwrite(ARCHIVE_MAGIC, 1, 8, ar->file) != 8))
+	{
+		LogMessage(ctx, "An error occurred during writing the index of %s: %s\n", ar->fileName, strerror(ferror(ar->file)));
+		r = 0;
+	}
+
+	free(index);
+	return r;
+}
+
+//The table is rebuilt twice as big when it is half full
+static int AddArchiveMember(Archive *ar, const ArchiveMember *member, const char *name)
+{
+	ArchiveMember *members;
+	Uint64 *table, i;
+
+	if (ar->nbMembers == ar->maxMembers)
+	{
+		i = ar->maxMembers ? ar->maxMembers * 2 : MIN_ARCHIVE_MEMBERS;
+		if (!(members = realloc(ar->members, (size_t)i * sizeof(ArchiveMember))))
+			return 0;
+		ar->members = members;
+		ar->maxMembers = i;
+	}
+	if ((ar->nbMembers+1) * 2 > ar->tableSize)
+	{
+		i = ar->tableSize ? ar->tableSize * 2 : MIN_ARCHIVE_MEMBERS * 2;
+		if (!(table = calloc((size_t)i, sizeof(Uint64))))
+			return 0;
+		free(ar->table);
+		ar->table = table;
+		ar->tableSize = i;
+		for (i=0 ; i < ar->nbMembers ; i++)
+			InsertArchiveName(ar, i);
+	}
+
+	ar->members[ar->nbMembers] = *member;
+	if (!(ar->members[ar->nbMembers].name = StoreArenaString(&ar->names, name, 0)))
+		return 0;
+	InsertArchiveName(ar, ar->nbMembers);
+	ar->nbMembers++;
+	return 1;
+}
+
+//A member replaces the one before with the same name in the table, not in the index
+static void InsertArchiveName(Archive *ar, Uint64 i)
+{
+	Uint64 slot, mask = ar->tableSize - 1;
+	const char *name = ar->members[i].name;
+
+	for (slot = HashName(name) & mask ; ar->table[slot] ; slot = (slot+1) & mask)
+	{
+		if (!strcmp(ar->members[ar->table[slot]-1].name, name))
+			break;
+	}
+	ar->table[slot] = i+1;
+}
+
+//FNV-1a
+static Uint64 HashName(const char *name)
+{
+	Uint64 hash = 14695981039346656037ULL;
+
+	for ( ; *name ; name++)
+		hash = (hash ^ (Uint8)*name) * 1099511628211ULL;
+	return hash;
+}
@@ -0,0 +1,82 @@
+/**** LICENSE INFORMATION ****
+IDEA - archive.h
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef ARCHIVE_H_
+#define ARCHIVE_H_
+
+#include "idea.h"
+#include "patharena.h"
+
+//An archive packs many files into one encrypted container, so that they cost a single output
+//file. It starts with the SHA-256 of the key (32 bytes), ARCHIVE_MAGIC and the version (1 byte).
+//The members follow back to back, each one encrypted in counter mode with its own nonce,
+//then the index, encrypted in counter mode too, and the footer: the offset, the size and
+//the nonce of the index, its MD5 (16 bytes), the number of members (8 bytes each but the MD5)
+//and ARCHIVE_MAGIC again.
+//An entry of the index holds the offset, the size and the nonce of a member (8 bytes each),
+//the tree MD5 of its plain data (16 bytes), the length of its name (2 bytes) and its name,
+//a relative path with '/' as separator. A name added again replaces the member before.
+#define ARCHIVE_MAGIC			"IDEA.ARC"
+#define ARCHIVE_VERSION			1
+#define ARCHIVE_HEADER_SIZE		41
+#define ARCHIVE_FOOTER_SIZE		56
+#define ARCHIVE_ENTRY_SIZE		42		//Without the name
+
+typedef struct
+{
+	Uint64 offset, size, nonce;
+	Uint16 checkSum[8];
+	const char *name;				//In the arena of the archive
+} ArchiveMember;
+
+typedef struct
+{
+	IdeaContext *ctx;
+	FILE *file;
+	const char *fileName;
+	int writable, modified;
+	ArchiveMember *members;
+	Uint64 nbMembers, maxMembers;
+	Uint64 *table;					//Index + 1 of the last member of each name, by the hash of the name
+	Uint64 tableSize;				//Power of 2, at least twice nbMembers
+	Uint64 dataEnd;					//Where the next member goes, then the index
+	PathArena names;
+} Archive;
+
+//Reads the index of fileName. Writable, the archive is created if it does not exist yet,
+//and the files added go after the members it has: the index is written again by CloseArchive.
+int OpenArchive(Archive *ar, IdeaContext *ctx, const char *fileName, int writable);
+
+//Writes the index if files have been added. Returns 0 if it could not be written.
+int CloseArchive(Archive *ar);
+
+//Returns 0 if fileName does not start like an archive, or cannot be read, without printing anything
+int IsArchiveFile(const char *fileName);
+
+//Encrypts fileName at the end of the archive, as the member name
+int AddArchiveFile(Archive *ar, const char *fileName, const char *name);
+
+//The index of the last member with that name, or -1 if there is none
+Sint64 FindArchiveMember(const Archive *ar, const char *name);
+
+//Decrypts the member i alone, checking it against its checksum
+int ExtractArchiveMember(Archive *ar, Uint64 i, const char *fileNameOut);
+
+#endif /* ARCHIVE_H_ */
@@ -0,0 +1,272 @@
+/**** LICENSE INFORMATION ****
+IDEA - batch.c
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Processes several files at the same time: Process_MT only spreads the blocks of
+ * a file over the thread pool when it has enough of them, so a directory of small
+ * files would otherwise run on a single core. The main thread prepares the files
+ * in order (output names, questions) and queues them. Each context available gets
+ * a long job of the pool, which processes the files queued one after the other;
+ * the slices of their buffers are jobs of the same pool, so the threads without a
+ * file steal the slices of the big ones. The messages of each file are printed as
+ * one piece, in order. */
+
+#include <errno.h>
+
+#include "batch.h"
+
+#define MAX_BATCH_WORKERS	64
+#define BATCH_BLOCK_SIZE	4096
+#define BATCH_PATH_SIZE		(4*MAX_PATH)
+
+static BatchFile* GetBatchFile(Batch *batch, int i);
+static void FreeBatchBlocks(Batch *batch);
+static void* BatchWorkerMain(void *data);
+static int ProcessBatchFile(Batch *batch, IdeaContext *ctx, BatchFile *file);
+
+
+int StartBatch(Batch *batch, const IdeaContext *ctx, int nbWorkers, int encrypt, int autoDelete)
+{
+	BatchWorker *worker;
+	int i;
+
+	memset(batch, 0, sizeof(Batch));
+	batch->encrypt = encrypt;
+	batch->autoDelete = autoDelete;
+	pthread_mutex_init(&batch->mutex, NULL);
+	pthread_cond_init(&batch->fileDone, NULL);
+	InitPathArena(&batch->paths);
+
+	if (nbWorkers > MAX_BATCH_WORKERS)
+		nbWorkers = MAX_BATCH_WORKERS;
+	if (nbWorkers < 1)
+		nbWorkers = 1;
+
+	if (!(batch->workers = calloc(nbWorkers, sizeof(BatchWorker))))
+	{
+		printf("Unable to allocate the file contexts.\n");
+		StopBatch(batch);
+		return 0;
+	}
+
+	for (i=0 ; i < nbWorkers ; i++)
+	{
+		worker = &(batch->workers[batch->nbWorkers]);
+		worker->batch = batch;
+		if (!CloneIdeaContext(&worker->ctx, ctx))
+			break;
+		worker->ctx.bufferLog = 1;
+		batch->nbWorkers++;
+	}
+
+	if (!batch->nbWorkers)
+	{
+		StopBatch(batch);
+		return 0;
+	}
+	return 1;
+}
+
+void QueueBatchFile(Batch *batch, const char *fileIn, const char *fileOut, char *log)
+{
+	BatchFile *file, **blocks;
+	BatchWorker *worker = NULL;
+	int i;
+
+	pthread_mutex_lock(&batch->mutex);
+	//The files already queued stay where they are, only the table of blocks moves
+	if (batch->nbFiles == batch->nbBlocks * BATCH_BLOCK_SIZE)
+	{
+		if (!(blocks = realloc(batch->blocks, sizeof(BatchFile*) * (batch->nbBlocks+1)))
+				|| !(blocks[batch->nbBlocks] = calloc(BATCH_BLOCK_SIZE, sizeof(BatchFile))))
+		{
+			if (blocks)
+				batch->blocks = blocks;
+			batch->nbFails++;
+			pthread_mutex_unlock(&batch->mutex);
+			printf("Unable to allocate memory to queue the file %s.\n", fileIn);
+			free(log);
+			return;
+		}
+		batch->blocks = blocks;
+		batch->nbBlocks++;
+	}
+
+	//The output usually is in the same directory as the input, it shares its copy
+	file = GetBatchFile(batch, batch->nbFiles);
+	file->log = log ? StoreArenaString(&batch->paths, log, batch->nbFiles) : NULL;
+	file->fileIn = StoreArenaPath(&batch->paths, fileIn, batch->nbFiles);
+	file->fileOut = fileOut ? StoreArenaPath(&batch->paths, fileOut, batch->nbFiles) : NULL;
+	free(log);
+	if (!file->fileIn || (fileOut && !file->fileOut) || (log && !file->log))
+	{
+		file->fileOut = NULL;
+		batch->nbFails++;
+		printf("Unable to allocate memory to queue the file %s.\n", fileIn);
+	}
+	file->done = !file->fileOut;
+	batch->nbFiles++;
+
+	//The busy jobs take the file when they are done with theirs, unless a context is free
+	for (i=0 ; !file->done && i < batch->nbWorkers && !worker ; i++)
+	{
+		if (!batch->workers[i].busy)
+		{
+			worker = &(batch->workers[i]);
+			worker->busy = 1;
+		}
+	}
+	pthread_mutex_unlock(&batch->mutex);
+
+	//Without worker threads, nobody else would run the job
+	if (worker && GetThreadPoolSize())
+		SubmitLongJob(&batch->group, &worker->job, BatchWorkerMain, worker);
+	else if (worker)
+		BatchWorkerMain(worker);
+}
+
+void PrintBatchLogs(Batch *batch, int wait)
+{
+	BatchFile *file;
+
+	pthread_mutex_lock(&batch->mutex);
+	while (batch->nextPrinted < batch->nbFiles)
+	{
+		file = GetBatchFile(batch, batch->nextPrinted);
+		if (!file->done)
+		{
+			if (!wait)
+				break;
+			pthread_cond_wait(&batch->fileDone, &batch->mutex);
+			continue;
+		}
+
+		//A file done is left alone by the jobs, and its block stays until it is counted as printed.
+		//Only the main thread prints.
+		pthread_mutex_unlock(&batch->mutex);
+		if (file->log)
+			fputs(file->log, stdout);
+		if (file->workerLog)
+			fputs(file->workerLog, stdout);
+		free(file->workerLog);
+		file->workerLog = NULL;
+		pthread_mutex_lock(&batch->mutex);
+		batch->nextPrinted++;
+		FreeBatchBlocks(batch);
+	}
+	pthread_mutex_unlock(&batch->mutex);
+}
+
+int StopBatch(Batch *batch)
+{
+	int i;
+
+	PrintBatchLogs(batch, 1);
+	WaitJobGroup(&batch->group);
+
+	for (i=0 ; i < batch->nbWorkers ; i++)
+		FreeIdeaContext(&batch->workers[i].ctx);
+	for (i=0 ; i < batch->nbBlocks ; i++)
+		free(batch->blocks[i]);
+	free(batch->workers);
+	free(batch->blocks);
+	FreePathArena(&batch->paths);
+	pthread_mutex_destroy(&batch->mutex);
+	pthread_cond_destroy(&batch->fileDone);
+	return batch->nbFails;
+}
+
+
+//Takes the files queued in order, until there are none left
+static void* BatchWorkerMain(void *data)
+{
+	BatchWorker *worker = (BatchWorker*)data;
+	Batch *batch = worker->batch;
+	BatchFile *file;
+	int r;
+
+	pthread_mutex_lock(&batch->mutex);
+	while (batch->nextFile < batch->nbFiles)
+	{
+		file = GetBatchFile(batch, batch->nextFile++);
+		if (file->done)
+		{
+			FreeBatchBlocks(batch);
+			continue;
+		}
+
+		pthread_mutex_unlock(&batch->mutex);
+		r = ProcessBatchFile(batch, &worker->ctx, file);
+		pthread_mutex_lock(&batch->mutex);
+
+		file->result = r;
+		file->workerLog = TakeLog(&worker->ctx);
+		file->done = 1;
+		if (!r)
+			batch->nbFails++;
+		pthread_cond_broadcast(&batch->fileDone);
+	}
+	worker->busy = 0;
+	pthread_mutex_unlock(&batch->mutex);
+
+	return NULL;
+}
+
+//Called with the batch mutex locked
+static BatchFile* GetBatchFile(Batch *batch, int i)
+{
+	return &(batch->blocks[i / BATCH_BLOCK_SIZE][i % BATCH_BLOCK_SIZE]);
+}
+
+//Called with the batch mutex locked. The blocks and the names that both the jobs and
+//the printing have gone past are not used anymore: millions of files do not stay in memory.
+static void FreeBatchBlocks(Batch *batch)
+{
+	int first = batch->nextPrinted < batch->nextFile ? batch->nextPrinted : batch->nextFile;
+
+	for ( ; batch->nbFreedBlocks < first / BATCH_BLOCK_SIZE ; batch->nbFreedBlocks++)
+	{
+		free(batch->blocks[batch->nbFreedBlocks]);
+		batch->blocks[batch->nbFreedBlocks] = NULL;
+	}
+	ReleasePathArena(&batch->paths, first);
+}
+
+static int ProcessBatchFile(Batch *batch, IdeaContext *ctx, BatchFile *file)
+{
+	char fileIn[BATCH_PATH_SIZE], fileOut[BATCH_PATH_SIZE];
+	int r;
+
+	if (GetArenaPath(file->fileIn, fileIn, BATCH_PATH_SIZE) >= BATCH_PATH_SIZE
+			|| GetArenaPath(file->fileOut, fileOut, BATCH_PATH_SIZE) >= BATCH_PATH_SIZE)
+	{
+		LogMessage(ctx, "The path of the file %s%s is too long.\n", file->fileIn->dir ? file->fileIn->dir : "", file->fileIn->name);
+		return 0;
+	}
+
+	if (!batch->encrypt)
+		r = DecryptFile(ctx, fileIn, fileOut);
+	else if (batch->manifest)
+		r = EncryptManifestFile(batch->manifest, ctx, fileIn, fileOut);
+	else
+		r = EncryptFile(ctx, fileIn, fileOut);
+	if (r && batch->autoDelete && remove(fileIn))
+		LogMessage(ctx, "Unable to delete the file %s: %s\n", fileIn, strerror(errno));
+	return r;
+}
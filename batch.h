@@ -0,0 +1,85 @@
+/**** LICENSE INFORMATION ****
+IDEA - batch.h
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include "idea.h"
+#include "threadpool.h"
+#include "patharena.h"
+#include "manifest.h"
+
+//A file to encrypt or decrypt. Its messages are printed once those of the files
+//before it have been, so that the output of concurrent files does not interleave.
+typedef struct
+{
+	const ArenaPath *fileIn;
+	const ArenaPath *fileOut;		//NULL: nothing to process, only the log to print
+	const char *log;				//Messages before the processing
+	char *workerLog;				//Messages of the processing
+	int done;
+	int result;
+} BatchFile;
+
+//A context and the job of the pool processing files with it, one after the other
+typedef struct
+{
+	struct Batch *batch;
+	IdeaContext ctx;
+	PoolJob job;
+	int busy;
+} BatchWorker;
+
+typedef struct Batch
+{
+	BatchWorker *workers;
+	int nbWorkers;
+	int encrypt;
+	int autoDelete;
+	Manifest *manifest;				//Set before queuing: only the files changed since are encrypted
+	BatchFile **blocks;				//BATCH_BLOCK_SIZE files each, freed once done and printed
+	int nbBlocks;
+	int nbFreedBlocks;
+	PathArena paths;				//Names and logs of the files, released with the blocks
+	int nbFiles;					//Queued so far
+	int nextFile;					//Next one for the workers
+	int nextPrinted;
+	int nbFails;
+	JobGroup group;
+	pthread_mutex_t mutex;
+	pthread_cond_t fileDone;
+} Batch;
+
+//The files are processed by jobs of the thread pool as they are queued, each job with
+//its own copy of ctx, so that up to nbWorkers files are processed at the same time.
+int StartBatch(Batch *batch, const IdeaContext *ctx, int nbWorkers, int encrypt, int autoDelete);
+
+//fileIn and fileOut are copied.
+//log is printed before the messages of the processing, it is freed at once.
+void QueueBatchFile(Batch *batch, const char *fileIn, const char *fileOut, char *log);
+
+//Prints the messages of the files done, in order. With wait, waits for all the files queued.
+void PrintBatchLogs(Batch *batch, int wait);
+
+//Prints the messages of the last files and waits for the jobs.
+//Returns the number of files that could not be processed.
+int StopBatch(Batch *batch);
+
+#endif /* BATCH_H_ */
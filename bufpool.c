@@ -0,0 +1,184 @@
+/**** LICENSE INFORMATION ****
+IDEA - bufpool.c
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* The pipeline goes through its buffers over and over at full speed: on 4 KB pages,
+ * a 16 MB buffer takes 4096 TLB entries, on 2 MB pages 8. The buffers are also reused
+ * from one file to the next, instead of being allocated and touched again each time.
+ *
+ * Windows: large pages need the "Lock pages in memory" privilege, without it VirtualAlloc
+ * fails and normal pages are used. Linux: the reserved huge pages (MAP_HUGETLB) are tried
+ * first, then transparent huge pages are asked for on a region aligned on 2 MB. */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		//MAP_ANONYMOUS, MAP_HUGETLB, MADV_HUGEPAGE
+#endif
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "bufpool.h"
+
+#define HUGE_PAGE_SIZE		(2*1024*1024)
+
+typedef struct PoolBuffer
+{
+	struct PoolBuffer *next;
+	void *data;
+	size_t size;
+	size_t mappedSize;		//What to unmap, the size rounded up to the pages used
+	int used;
+} PoolBuffer;
+
+static PoolBuffer *buffers = NULL;
+static pthread_mutex_t bufPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+static int hugePages = -1;				//-1 until IDEA_HUGE_PAGES has been read
+static int hugePagesFailed = 0;		//No reserved huge pages, or no privilege for them
+
+static void* AllocPages(size_t size, size_t *mappedSize);
+static void FreePages(void *data, size_t mappedSize);
+
+
+void* TakeBuffer(size_t size)
+{
+	PoolBuffer *buffer;
+
+	pthread_mutex_lock(&bufPoolMutex);
+	for (buffer = buffers ; buffer && (buffer->used || buffer->size != size) ; buffer = buffer->next);
+	if (!buffer && (buffer = malloc(sizeof(PoolBuffer))))
+	{
+		if (!(buffer->data = AllocPages(size, &buffer->mappedSize)))
+		{
+			free(buffer);
+			buffer = NULL;
+		}
+		else
+		{
+			buffer->size = size;
+			buffer->next = buffers;
+			buffers = buffer;
+		}
+	}
+	if (buffer)
+		buffer->used = 1;
+	pthread_mutex_unlock(&bufPoolMutex);
+
+	return buffer ? buffer->data : NULL;
+}
+
+void GiveBackBuffer(void *buf, size_t size)
+{
+	PoolBuffer *buffer;
+
+	if (!buf)
+		return;
+
+	pthread_mutex_lock(&bufPoolMutex);
+	for (buffer = buffers ; buffer && buffer->data != buf ; buffer = buffer->next);
+	if (buffer && buffer->size == size)
+		buffer->used = 0;
+	pthread_mutex_unlock(&bufPoolMutex);
+}
+
+//The buffers still used are freed too
+void FreeBufferPool(void)
+{
+	PoolBuffer *buffer;
+
+	pthread_mutex_lock(&bufPoolMutex);
+	while ((buffer = buffers))
+	{
+		buffers = buffer->next;
+		FreePages(buffer->data, buffer->mappedSize);
+		free(buffer);
+	}
+	pthread_mutex_unlock(&bufPoolMutex);
+}
+
+
+//Called with the pool mutex locked
+static void* AllocPages(size_t size, size_t *mappedSize)
+{
+	void *data = NULL;
+#ifdef WIN32
+	SIZE_T largePage;
+#else
+	Uint8 *p;
+	size_t head;
+#endif
+
+	if (hugePages < 0)
+		hugePages = !getenv("IDEA_HUGE_PAGES") || atoi(getenv("IDEA_HUGE_PAGES")) != 0;
+
+#ifdef WIN32
+	largePage = GetLargePageMinimum();
+	if (hugePages && !hugePagesFailed && largePage && size >= HUGE_PAGE_SIZE)
+	{
+		*mappedSize = (size + largePage-1) / largePage * largePage;
+		if ((data = VirtualAlloc(NULL, *mappedSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE)))
+			return data;
+		hugePagesFailed = 1;
+	}
+	*mappedSize = size;
+	return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	if (!hugePages || size < HUGE_PAGE_SIZE)
+	{
+		*mappedSize = size;
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return data != MAP_FAILED ? data : NULL;
+	}
+
+	*mappedSize = (size + HUGE_PAGE_SIZE-1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+#ifdef MAP_HUGETLB
+	if (!hugePagesFailed)
+	{
+		data = mmap(NULL, *mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (data != MAP_FAILED)
+			return data;
+		hugePagesFailed = 1;
+	}
+#endif
+
+	//One more huge page to cut an aligned region from, the rest is unmapped
+	if ((p = mmap(NULL, *mappedSize + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		return NULL;
+	head = (HUGE_PAGE_SIZE - (size_t)p % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+	if (head)
+		munmap(p, head);
+	munmap(p + head + *mappedSize, HUGE_PAGE_SIZE - head);
+#ifdef MADV_HUGEPAGE
+	madvise(p + head, *mappedSize, MADV_HUGEPAGE);
+#endif
+	return p + head;
+#endif
+}
+
+static void FreePages(void *data, size_t mappedSize)
+{
+#ifdef WIN32
+	VirtualFree(data, 0, MEM_RELEASE);
+#else
+	munmap(data, mappedSize);
+#endif
+}
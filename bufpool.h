@@ -0,0 +1,37 @@
+/**** LICENSE INFORMATION ****
+IDEA - bufpool.h
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef BUFPOOL_H_
+#define BUFPOOL_H_
+
+#include "idea.h"
+
+//The data buffers of the contexts and of the I/O engines. A buffer is taken from the pool,
+//owned by one stage at a time, and given back with its size once nobody uses it anymore.
+//The buffers are aligned on pages, so on cache lines too, and those of 2 MB or more are
+//backed by huge pages when the system allows it (unless IDEA_HUGE_PAGES is 0).
+//Their content is undefined. Returns NULL if the memory is lacking.
+void* TakeBuffer(size_t size);
+void GiveBackBuffer(void *buf, size_t size);
+
+//Frees the buffers kept for reuse
+void FreeBufferPool(void);
+
+#endif /* BUFPOOL_H_ */
@@ -0,0 +1,180 @@
+/**** LICENSE INFORMATION ****
+IDEA - directio.c
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Linux: the file is opened again through /proc/self/fd with O_DIRECT, so that the
+ * stream keeps its own, cached, file description. Windows: ReOpenFile with
+ * FILE_FLAG_NO_BUFFERING. Elsewhere OpenDirectFile fails and the callers use stdio.
+ *
+ * The transfers are positioned (pread, pwrite, OVERLAPPED offsets): the positions of
+ * the streams are left to their owners. */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		//O_DIRECT
+#endif
+//off_t on 64 bits on the 32-bit POSIX systems, for pread and pwrite
+#define _FILE_OFFSET_BITS	64
+
+#include <errno.h>
+
+#include "directio.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+
+int OpenDirectFile(DirectFile *df, FILE *file, int writable)
+{
+	//The direct transfers must not be overwritten later by what the stream still holds
+	if (fflush(file))
+		return 0;
+
+#ifdef WIN32
+	df->file = (HANDLE)_get_osfhandle(_fileno(file));
+	if (df->file == INVALID_HANDLE_VALUE)
+		return 0;
+	df->direct = ReOpenFile(df->file, writable ? GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			FILE_FLAG_NO_BUFFERING);
+	return df->direct != INVALID_HANDLE_VALUE;
+#elif defined(__linux__) && defined(O_DIRECT)
+	{
+		char path[32];
+
+		if ((df->fd = fileno(file)) < 0)
+			return 0;
+		sprintf(path, "/proc/self/fd/%d", df->fd);
+		df->directFd = open(path, (writable ? O_WRONLY : O_RDONLY) | O_DIRECT);
+		return df->directFd >= 0;
+	}
+#else
+	df->fd = df->directFd = -1;
+	return 0;
+#endif
+}
+
+//A transfer that does not end on a sector boundary has reached the end of the file
+Sint64 ReadDirectFile(DirectFile *df, void *buf, size_t size, Uint64 offset)
+{
+	size_t done = 0;
+
+	while (done < size)
+	{
+#ifdef WIN32
+		OVERLAPPED ov;
+		DWORD n;
+
+		memset(&ov, 0, sizeof(ov));
+		ov.Offset = (DWORD)(offset + done);
+		ov.OffsetHigh = (DWORD)((offset + done) >> 32);
+		if (!ReadFile(df->direct, (Uint8*)buf + done, (DWORD)(size - done), &n, &ov))
+		{
+			if (GetLastError() == ERROR_HANDLE_EOF)
+				break;
+			return -1;
+		}
+#else
+		ssize_t n = pread(df->directFd, (Uint8*)buf + done, size - done, (off_t)(offset + done));
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+#endif
+		done += n;
+		if (!n || n % DIRECT_IO_ALIGNMENT)
+			break;
+	}
+
+	return (Sint64)done;
+}
+
+int WriteDirectFile(DirectFile *df, const void *buf, size_t size, Uint64 offset)
+{
+	size_t done = 0;
+
+	while (done < size)
+	{
+#ifdef WIN32
+		OVERLAPPED ov;
+		DWORD n;
+
+		memset(&ov, 0, sizeof(ov));
+		ov.Offset = (DWORD)(offset + done);
+		ov.OffsetHigh = (DWORD)((offset + done) >> 32);
+		if (!WriteFile(df->direct, (const Uint8*)buf + done, (DWORD)(size - done), &n, &ov) || !n)
+			return 0;
+#else
+		ssize_t n = pwrite(df->directFd, (const Uint8*)buf + done, size - done, (off_t)(offset + done));
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0 || n % DIRECT_IO_ALIGNMENT)
+			return 0;
+#endif
+		done += n;
+	}
+
+	return 1;
+}
+
+int WriteCachedFile(DirectFile *df, const void *buf, size_t size, Uint64 offset)
+{
+	size_t done = 0;
+
+	while (done < size)
+	{
+#ifdef WIN32
+		OVERLAPPED ov;
+		DWORD n;
+
+		memset(&ov, 0, sizeof(ov));
+		ov.Offset = (DWORD)(offset + done);
+		ov.OffsetHigh = (DWORD)((offset + done) >> 32);
+		if (!WriteFile(df->file, (const Uint8*)buf + done, (DWORD)(size - done), &n, &ov) || !n)
+			return 0;
+#else
+		ssize_t n = pwrite(df->fd, (const Uint8*)buf + done, size - done, (off_t)(offset + done));
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+#endif
+		done += n;
+	}
+
+	return 1;
+}
+
+void CloseDirectFile(DirectFile *df)
+{
+#ifdef WIN32
+	if (df->direct != INVALID_HANDLE_VALUE)
+		CloseHandle(df->direct);
+	df->direct = INVALID_HANDLE_VALUE;
+#else
+	if (df->directFd >= 0)
+		close(df->directFd);
+	df->directFd = -1;
+#endif
+}
@@ -0,0 +1,62 @@
+/**** LICENSE INFORMATION ****
+IDEA - directio.h
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef DIRECTIO_H_
+#define DIRECTIO_H_
+
+#include "idea.h"
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+//Offsets, sizes and buffer addresses of the direct transfers are multiples of this.
+//It covers the sectors of the disks, whether of 512 or 4096 bytes.
+#define DIRECT_IO_ALIGNMENT		4096
+
+//A file read or written around the system cache (O_DIRECT, FILE_FLAG_NO_BUFFERING),
+//through a second handle, the one of its stream staying as it is
+typedef struct
+{
+#ifdef WIN32
+	HANDLE file, direct;
+#else
+	int fd, directFd;
+#endif
+} DirectFile;
+
+//file must stay open until CloseDirectFile. The second handle only reads, or only writes if writable is set.
+//Returns 0 if the file cannot bypass the cache (file system, pipe...), without printing anything.
+int OpenDirectFile(DirectFile *df, FILE *file, int writable);
+
+//Reads size bytes at offset, aligned. Returns the bytes read, fewer only at the end
+//of the file, or -1 on failure.
+Sint64 ReadDirectFile(DirectFile *df, void *buf, size_t size, Uint64 offset);
+
+//Writes size bytes at offset, aligned. Returns 0 on failure.
+int WriteDirectFile(DirectFile *df, const void *buf, size_t size, Uint64 offset);
+
+//Any offset and size, through the cache, for the ends of the data that do not fill a sector.
+//Returns 0 on failure.
+int WriteCachedFile(DirectFile *df, const void *buf, size_t size, Uint64 offset);
+
+void CloseDirectFile(DirectFile *df);
+
+#endif /* DIRECTIO_H_ */
@@ -0,0 +1,157 @@
+/**** LICENSE INFORMATION ****
+IDEA - filemap.c
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Windows: CreateFileMapping / MapViewOfFile. Elsewhere: mmap, with madvise hints
+ * for a single sequential pass. Views start on the allocation granularity, so the
+ * pointer returned for a window is usually a little after the start of the view. */
+
+//off_t on 64 bits on the 32-bit POSIX systems, for posix_fallocate and mmap
+#define _FILE_OFFSET_BITS	64
+
+#include "filemap.h"
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+static int ReserveFileSpace(FILE *file, Uint64 fileSize);
+static Uint64 GetMapGranularity(void);
+
+
+int OpenMappedFile(MappedFile *mf, FILE *file, Uint64 fileSize, int writable)
+{
+	memset(mf, 0, sizeof(MappedFile));
+	mf->writable = writable;
+	mf->fileSize = fileSize;
+
+	//What is still in the stdio buffer would be written over the mapped data later
+	if (fflush(file) || !fileSize)
+		return 0;
+	//A write through the mapping cannot fail: without the space, the process would be killed
+	if (writable && !ReserveFileSpace(file, fileSize))
+		return 0;
+
+#ifdef WIN32
+	{
+		HANDLE handle = (HANDLE)_get_osfhandle(_fileno(file));
+		if (handle == INVALID_HANDLE_VALUE)
+			return 0;
+
+		mf->mapping = CreateFileMapping(handle, NULL, writable ? PAGE_READWRITE : PAGE_READONLY,
+				(DWORD)(fileSize >> 32), (DWORD)fileSize, NULL);
+		return mf->mapping != NULL;
+	}
+#else
+	mf->fd = fileno(file);
+	return mf->fd >= 0;
+#endif
+}
+
+void* MapFileWindow(MappedFile *mf, Uint64 offset, size_t size)
+{
+	Uint64 start = offset - offset % GetMapGranularity();
+	size_t viewSize = (size_t)(offset - start) + size;
+
+	if (mf->view)
+	{
+#ifdef WIN32
+		UnmapViewOfFile(mf->view);
+#else
+		munmap(mf->view, mf->viewSize);
+#endif
+		mf->view = NULL;
+	}
+
+	if (!size || offset + size > mf->fileSize)
+		return NULL;
+
+#ifdef WIN32
+	mf->view = MapViewOfFile(mf->mapping, mf->writable ? FILE_MAP_WRITE : FILE_MAP_READ,
+			(DWORD)(start >> 32), (DWORD)start, viewSize);
+	if (!mf->view)
+		return NULL;
+#else
+	mf->view = mmap(NULL, viewSize, mf->writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, mf->fd, (off_t)start);
+	if (mf->view == MAP_FAILED)
+	{
+		mf->view = NULL;
+		return NULL;
+	}
+	madvise(mf->view, viewSize, MADV_SEQUENTIAL);
+	if (!mf->writable)
+		madvise(mf->view, viewSize, MADV_WILLNEED);
+#endif
+
+	mf->viewSize = viewSize;
+	return (Uint8*)mf->view + (offset - start);
+}
+
+void CloseMappedFile(MappedFile *mf)
+{
+	MapFileWindow(mf, 0, 0);
+#ifdef WIN32
+	if (mf->mapping)
+		CloseHandle(mf->mapping);
+	mf->mapping = NULL;
+#endif
+}
+
+//Allocates the blocks of the file up to fileSize, a disk full is reported here and not
+//while writing the mapped pages. On failure stdio goes on with the file: whatever has been
+//allocated is within the output, which it writes over.
+static int ReserveFileSpace(FILE *file, Uint64 fileSize)
+{
+#ifdef WIN32
+	HANDLE handle = (HANDLE)_get_osfhandle(_fileno(file));
+	LARGE_INTEGER size, position, zero;
+
+	//The file pointer is shared with the stream, it is put back where it was
+	zero.QuadPart = 0;
+	size.QuadPart = (LONGLONG)fileSize;
+	if (handle == INVALID_HANDLE_VALUE || !SetFilePointerEx(handle, zero, &position, FILE_CURRENT))
+		return 0;
+	if (!SetFilePointerEx(handle, size, NULL, FILE_BEGIN) || !SetEndOfFile(handle))
+	{
+		SetFilePointerEx(handle, position, NULL, FILE_BEGIN);
+		return 0;
+	}
+	return SetFilePointerEx(handle, position, NULL, FILE_BEGIN);
+#else
+	int fd = fileno(file);
+
+	return fd >= 0 && !posix_fallocate(fd, 0, (off_t)fileSize);
+#endif
+}
+
+static Uint64 GetMapGranularity(void)
+{
+#ifdef WIN32
+	SYSTEM_INFO sysInfo;
+	GetSystemInfo(&sysInfo);
+	return sysInfo.dwAllocationGranularity;
+#else
+	long n = sysconf(_SC_PAGESIZE);
+	return n > 0 ? (Uint64)n : 4096;
+#endif
+}
@@ -0,0 +1,56 @@
+/**** LICENSE INFORMATION ****
+IDEA - filemap.h
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef FILEMAP_H_
+#define FILEMAP_H_
+
+#include "idea.h"
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+//A file mapped in memory one window at a time, so that 32-bit builds can map big files
+typedef struct
+{
+#ifdef WIN32
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+	int writable;
+	Uint64 fileSize;
+	void *view;
+	size_t viewSize;
+} MappedFile;
+
+//Maps file, which must stay open until CloseMappedFile. A writable file must be opened
+//for reading and writing ("w+b"): its space up to fileSize is allocated first, so that
+//a full disk fails here. A read-only one must be at least fileSize bytes long.
+//Returns 0 if the file cannot be mapped (pipe, unsupported file system...), without printing anything.
+int OpenMappedFile(MappedFile *mf, FILE *file, Uint64 fileSize, int writable);
+
+//Maps [offset, offset+size[, unmapping the previous window.
+//Returns a pointer on the byte at offset, or NULL on failure.
+void* MapFileWindow(MappedFile *mf, Uint64 offset, size_t size);
+
+void CloseMappedFile(MappedFile *mf);
+
+#endif /* FILEMAP_H_ */
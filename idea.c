@@ -18,36 +18,84 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+//off_t, and so ftello and mmap, on 64 bits on the 32-bit POSIX systems
+#define _FILE_OFFSET_BITS	64
+
+#include <stdarg.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#ifdef WIN32
+#include <windows.h>
+#include <wincrypt.h>
+#endif
+
 #include "idea.h"
+#include "idea_simd.h"
+#include "threadpool.h"
+#include "pipeline.h"
+#include "bufpool.h"
+#include "md5_simd.h"
 
 //#define INCLUDE_USELESS
-#define NUM_THREADS				4
-#define DATA_BUF_SIZE			1000000		//Must be multiple of 8
-#define BLOCK_MIN_PER_THREAD	500
+#define MAX_JOBS				256
+#define DATA_BUF_SIZE			1048576		//Default, must be multiple of TREE_HASH_LEAF_SIZE and CBC_SEGMENT_SIZE
+#define NB_DATA_BUFS			4			//Buffers in flight between the reader, the cipher and the writer
+#define DEFAULT_QUEUE_DEPTH		16			//Buffers of DATA_BUF_SIZE bytes in flight with io_uring
+#define BLOCK_MIN_PER_THREAD	500			//Default of minJobBlocks
+#define CTR_CHUNK_BLOCKS		256			//Keystream blocks generated at a time by a job
+#define CBC_LANES				64			//CBC segments encrypted side by side by a job
+#define LOG_MESSAGE_SIZE		(3*MAX_PATH)
 
 typedef struct
 {
 	const Uint16 *in;
 	Uint16 *out;
-	Uint32 num;
-	Uint8 encrypt;
+	size_t num;				//Of Uint16
+	const Uint16 *keys;
+	const Uint16 *ivKeys;	//Encryption keys, for the IVs of the CBC segments
+	Uint64 nonce;
+	Uint64 firstBlock;		//Number of in[0] in the whole data, for the CTR and CBC modes
 } ProcessMTStruct;
 
-static Uint16 mainPartialKeys[9][6] = {{0}};
-static Uint16 mainPartialInvertedKeys[9][6] = {{0}};
-static Uint16 mainDataBuf[DATA_BUF_SIZE/sizeof(Uint16)] = {0};
+//What the header and the index of an encrypted file tell about its data
+typedef struct
+{
+	Uint8 flags, padding;
+	Uint16 checkSum[8];
+	Uint64 nonce;
+	Uint64 dataSize;			//Encrypted bytes, right after the header
+	Uint64 plainSize;
+	Uint32 chunkSize;			//0 if the file is not chunked
+	Uint64 nbChunks;
+	Uint16 *chunkTags;			//Decrypted, 8 words per chunk
+} FileHeader;
 
 #ifdef INCLUDE_USELESS
 static Uint16 StrToUint16(const char *str, const char **p);
 static Uint8 CharToUint8(char c);
 #endif	//INCLUDE_USELESS
 
+static int RunBlockJobs(const ProcessMTStruct *whole, size_t size, size_t alignBlocks, size_t minJobBlocks,
+		void* (*func)(void*));
 static void* Process_MT_sub(void *data);
+static void* ProcessCTR_MT_sub(void *data);
+static void* EncryptCBC_MT_sub(void *data);
+static void* DecryptCBC_MT_sub(void *data);
+static void ProcessBlocks(const Uint16 *in, Uint16 *out, size_t nbBlocks, const Uint16 *keys);
+static void SetCounterBlock(Uint16 *block, Uint64 counter);
+static int GetCipherMode(Uint8 flags);
+static int ReadFileHeader(IdeaContext *ctx, FILE *fileIn, const char *fileNameIn, FileHeader *header);
+static int ReadStreamHeader(IdeaContext *ctx, FILE *fileIn, FileHeader *header);
+static Uint64 CheckChunkTags(IdeaContext *ctx, const FileHeader *header, const Uint16 *chunkTags, Uint64 first, Uint64 last,
+		const char *fileNameIn);
+static int WriteChunkIndex(IdeaContext *ctx, FILE *fileOut, Uint16 *chunkTags, Uint64 nbChunks, Uint64 plainSize);
+static int GetIoEngine(const char *name);
+static int GetRandomBytes(void *buf, size_t size);
 
 static void ShiftKey(Uint16 *partialKeys);
-static const Uint16* GetPartialKeys(unsigned int roundNum);
-static const Uint16* GetPartialInvertedKeys(unsigned int roundNum);
 
+static void ProcessBlock(const Uint16 *in, Uint16 *out, const Uint16 *keys);
 static void MakeRound(const Uint16 *in, Uint16 *out, const Uint16 *keys);
 static void MakeTransfo(const Uint16 *in, Uint16 *out, const Uint16 *keys);
 static Uint16 ModuloMult(Uint16 x1, Uint16 x2);
@@ -98,7 +146,154 @@ static Uint8 CharToUint8(char c)
 #endif	//INCLUDE_USELESS
 
 
-int EncryptString(const char *string, Uint16 *out, int md5Only)
+int InitIdeaContext(IdeaContext *ctx, const Uint16 *partialKeys0)
+{
+	int i, k=0, r;
+	Uint16 partialKeys[8] = {0};
+
+	memset(ctx, 0, sizeof(IdeaContext));
+	ctx->dataBufSize = DATA_BUF_SIZE;
+	ctx->nbDataBufs = NB_DATA_BUFS;
+	ctx->minJobBlocks = BLOCK_MIN_PER_THREAD;
+	ctx->ioEngine = GetIoEngine(getenv("IDEA_IO"));
+	ctx->queueDepth = getenv("IDEA_QUEUE_DEPTH") ? atoi(getenv("IDEA_QUEUE_DEPTH")) : DEFAULT_QUEUE_DEPTH;
+	if (!(ctx->dataBuf = TakeBuffer(DATA_BUF_SIZE * NB_DATA_BUFS)))
+	{
+		printf("Unable to allocate the data buffers.\n");
+		return 0;
+	}
+
+	if (!ComputeSHA256((char*)partialKeys0, ctx->keySha, 16))
+	{
+		printf("Unable to compute the key hash.\n");
+		FreeIdeaContext(ctx);
+		return 0;
+	}
+
+	memcpy(partialKeys, partialKeys0, sizeof(Uint16)*8);
+	for (r=0 ; r < 9 ; r++)
+	{
+		for (i=0 ; i < 6 ; i++)
+		{
+			if (k % 8 == 0 && k > 0)
+			{
+				ShiftKey(partialKeys);
+				k = 0;
+			}
+			ctx->partialKeys[r][i] = partialKeys[k];
+			if (i == 2 || i == 1)
+			{
+				if (r >= 1 && r <= 7)
+					ctx->partialInvertedKeys[8-r][i==2 ? 1 : 2] = ModuloAddInv(partialKeys[k]);
+				else
+					ctx->partialInvertedKeys[8-r][i] = ModuloAddInv(partialKeys[k]);
+			}
+			else if (i == 4 || i == 5)
+			{
+				if (r > 0)
+					ctx->partialInvertedKeys[8-r][i] = ctx->partialKeys[r-1][i];
+			}
+			else
+				ctx->partialInvertedKeys[8-r][i] = ModuloMultInv(partialKeys[k]);
+			k++;
+		}
+	}
+
+	return 1;
+}
+
+//Same keys and options, with its own buffers and log, so that both can process files at the same time
+int CloneIdeaContext(IdeaContext *ctx, const IdeaContext *src)
+{
+	memcpy(ctx, src, sizeof(IdeaContext));
+	ctx->log = NULL;
+	ctx->logLength = ctx->logSize = 0;
+	if (!(ctx->dataBuf = TakeBuffer(ctx->dataBufSize * ctx->nbDataBufs)))
+	{
+		printf("Unable to allocate the data buffers.\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+void FreeIdeaContext(IdeaContext *ctx)
+{
+	GiveBackBuffer(ctx->dataBuf, ctx->dataBufSize * ctx->nbDataBufs);
+	free(ctx->log);
+	memset(ctx, 0, sizeof(IdeaContext));
+}
+
+//Unless it has been set, the queue depth keeps the same number of bytes in flight
+int SetIdeaBufferSize(IdeaContext *ctx, size_t size)
+{
+	Uint16 *dataBuf;
+
+	if (!size || size % TREE_HASH_LEAF_SIZE)
+	{
+		printf("The buffer size must be a multiple of %d bytes.\n", TREE_HASH_LEAF_SIZE);
+		return 0;
+	}
+	if (!(dataBuf = TakeBuffer(size * ctx->nbDataBufs)))
+	{
+		printf("Unable to allocate the data buffers.\n");
+		return 0;
+	}
+
+	GiveBackBuffer(ctx->dataBuf, ctx->dataBufSize * ctx->nbDataBufs);
+	ctx->dataBuf = dataBuf;
+	ctx->dataBufSize = size;
+	if (!getenv("IDEA_QUEUE_DEPTH"))
+		ctx->queueDepth = DEFAULT_QUEUE_DEPTH * DATA_BUF_SIZE / size > 2 ? DEFAULT_QUEUE_DEPTH * DATA_BUF_SIZE / size : 2;
+	return 1;
+}
+
+//Printed right away, or kept in the log of the context when it is buffered.
+//A message that does not fit in the log is printed anyway rather than lost.
+void LogMessage(IdeaContext *ctx, const char *format, ...)
+{
+	char msg[LOG_MESSAGE_SIZE];
+	char *log;
+	va_list args;
+	size_t l;
+
+	va_start(args, format);
+	if (!ctx->bufferLog)
+	{
+		vprintf(format, args);
+		va_end(args);
+		return;
+	}
+	vsnprintf(msg, LOG_MESSAGE_SIZE, format, args);
+	va_end(args);
+	msg[LOG_MESSAGE_SIZE-1] = '\0';
+
+	l = strlen(msg);
+	if (ctx->logLength + l + 1 > ctx->logSize)
+	{
+		if (!(log = realloc(ctx->log, (ctx->logLength + l + 1) * 2)))
+		{
+			fputs(msg, stdout);
+			return;
+		}
+		ctx->log = log;
+		ctx->logSize = (ctx->logLength + l + 1) * 2;
+	}
+	memcpy(ctx->log + ctx->logLength, msg, l+1);
+	ctx->logLength += l;
+}
+
+//The messages logged so far, to be freed by the caller, or NULL if there are none
+char* TakeLog(IdeaContext *ctx)
+{
+	char *log = ctx->log;
+
+	ctx->log = NULL;
+	ctx->logLength = ctx->logSize = 0;
+	return log;
+}
+
+int EncryptString(IdeaContext *ctx, const char *string, Uint16 *out, int md5Only)
 {
 	Uint16 part[4] = {0};
 	Uint16 md5[8] = {0};
@@ -114,14 +309,14 @@ int EncryptString(const char *string, Uint16 *out, int md5Only)
 	for (i=0 ; i < l ; i += 8)
 	{
 		memcpy(part, &(string[i]), i+7 < l ? 8 : l-i);
-		Encrypt(part, &(out[8+i/2]));
+		Encrypt(ctx, part, &(out[8+i/2]));
 		memset(part, 0, sizeof(Uint16)*4);
 	}
 
 	return 1;
 }
 
-int DecryptString(Uint16 *string, int n, char *out)
+int DecryptString(IdeaContext *ctx, Uint16 *string, int n, char *out)
 {
 	Uint16 part[4] = {0};
 	Uint16 md5[8] = {0}, md5_0[8] = {0};
@@ -129,7 +324,7 @@ int DecryptString(Uint16 *string, int n, char *out)
 
 	if (n <= 8 || n % 4)
 	{
-		printf("The string %04x[...]%04x is not a valid string.\n", string[0], string[n-1]);
+		LogMessage(ctx, "The string %04x[...]%04x is not a valid string.\n", string[0], string[n-1]);
 		return 0;
 	}
 
@@ -138,7 +333,7 @@ int DecryptString(Uint16 *string, int n, char *out)
 	for (i=8 ; i < n ; i += 4)
 	{
 		memcpy(part, &(string[i]), sizeof(Uint16)*4);
-		Decrypt(part, (Uint16*)&(out[(i-8)*2]));
+		Decrypt(ctx, part, (Uint16*)&(out[(i-8)*2]));
 		memset(part, 0, sizeof(Uint16)*4);
 	}
 
@@ -152,7 +347,7 @@ int DecryptString(Uint16 *string, int n, char *out)
 	{
 		if (md5[i] != md5_0[i])
 		{
-			printf("The MD5 checksum of the encrypted file name %04x[...]%04x is not valid. The string may have been corrupted.\n", string[0], string[n-1]);
+			LogMessage(ctx, "The MD5 checksum of the encrypted file name %04x[...]%04x is not valid. The string may have been corrupted.\n", string[0], string[n-1]);
 			return 0;
 		}
 	}
@@ -160,48 +355,73 @@ int DecryptString(Uint16 *string, int n, char *out)
 	return 1;
 }
 
-int EncryptFile(const char *fileNameIn, const char *fileNameOut, const Uint16 *keySha)
+int EncryptFile(IdeaContext *ctx, const char *fileNameIn, const char *fileNameOut)
 {
 	FILE *fileIn = fopen(fileNameIn, "rb");
 	FILE *fileOut = NULL;
-	Uint16 checkSum[8], l;
-	size_t n;
-	Uint8 padding;
-	Uint16 *cryptedFileName = NULL;
+	Uint16 checkSum[8] = {0}, l;
+	Sint64 size;
+	Uint8 padding, flags = ctx->fileFlags & FILE_KNOWN_FLAGS, version = FILE_FORMAT_VERSION;
+	Uint16 *cryptedFileName = NULL, *chunkTags = NULL;
+	Uint32 chunkSize = FILE_CHUNK_SIZE;
+	Uint64 nonce = 0, nbChunks = 0;
 	const char *p = NULL;
+	int r;
 
 	if (!strcmp(fileNameIn, fileNameOut))
 	{
-		printf("The source and destination files are identical (%s)\n", fileNameIn);
+		LogMessage(ctx, "The source and destination files are identical (%s)\n", fileNameIn);
 		return 0;
 	}
 
 	if (!fileIn)
 	{
-		printf("Unable to open the input file %s: %s\n.", fileNameIn, strerror(errno));
+		LogMessage(ctx, "Unable to open the input file %s: %s\n.", fileNameIn, strerror(errno));
 		return 0;
 	}
 
-	fseek(fileIn, 0, SEEK_END);
-	padding = (8 - (ftell(fileIn) % 8)) % 8;
+	if (SetFilePosition(fileIn, 0, SEEK_END) || (size = GetFilePosition(fileIn)) < 0)
+	{
+		LogMessage(ctx, "Unable to get the size of the input file %s: %s\n", fileNameIn, strerror(errno));
+		fclose(fileIn);
+		return 0;
+	}
+	padding = (flags & FILE_FLAG_CTR) ? 0 : (8 - (size % 8)) % 8;
+	flags |= padding;
 	rewind(fileIn);
 
-	if (!ComputeFileMD5Checksum(fileIn, checkSum))
+	if ((flags & FILE_NONCE_FLAGS) && !GenerateNonce(ctx, &nonce))
 	{
 		fclose(fileIn);
 		return 0;
 	}
 
-	if (!(fileOut = fopen(fileNameOut, "wb")))
+	//The tags of the chunks are checked with the leaves of the tree hash
+	if (flags & FILE_FLAG_CHUNKED)
+	{
+		flags |= FILE_FLAG_TREE_HASH;
+		nbChunks = (size + chunkSize-1) / chunkSize;
+		if (nbChunks && !(chunkTags = malloc(16 * nbChunks)))
+		{
+			LogMessage(ctx, "Unable to allocate the chunk tags.\n");
+			fclose(fileIn);
+			return 0;
+		}
+	}
+
+	if (!(fileOut = fopen(fileNameOut, "w+b")))
 	{
-		printf("Unable to create the output file %s: %s\n.", fileNameOut, strerror(errno));
+		LogMessage(ctx, "Unable to create the output file %s: %s\n.", fileNameOut, strerror(errno));
+		free(chunkTags);
 		fclose(fileIn);
 		return 0;
 	}
 
-	if (fwrite(keySha, 1, 32, fileOut) != 32 || fwrite(checkSum, 1, 16, fileOut) != 16 || fwrite(&padding, 1, 1, fileOut) != 1)
+	//The checksum is only known at the end, it is written over the zeros then
+	if (fwrite(ctx->keySha, 1, 32, fileOut) != 32 || fwrite(checkSum, 1, 16, fileOut) != 16 || fwrite(&flags, 1, 1, fileOut) != 1)
 	{
-		printf("An error occurred during writing header in %s: %s\n", fileNameOut, strerror(ferror(fileOut)));
+		LogMessage(ctx, "An error occurred during writing header in %s: %s\n", fileNameOut, strerror(ferror(fileOut)));
+		free(chunkTags);
 		fclose(fileIn); fclose(fileOut);
 		remove(fileNameOut);
 		return 0;
@@ -210,177 +430,341 @@ int EncryptFile(const char *fileNameIn, const char *fileNameOut, const Uint16 *k
 	p = GetFileNameFromAddr((char*)fileNameIn);
 	l = 16 + (strlen(p)+7)/8 * 8;
 	cryptedFileName = malloc(sizeof(char) * l);
-	if (!cryptedFileName || !EncryptString(p, cryptedFileName, 0))
+	if (!cryptedFileName || !EncryptString(ctx, p, cryptedFileName, 0))
 	{
 		if (!cryptedFileName)
-			printf("Unable to allocate the buffer for the encrypted file name.\n");
+			LogMessage(ctx, "Unable to allocate the buffer for the encrypted file name.\n");
+		free(chunkTags);
 		fclose(fileIn); fclose(fileOut);
 		remove(fileNameOut);
 		return 0;
 	}
 
-	if (fwrite(&l, 2, 1, fileOut) != 1 || fwrite(cryptedFileName, 1, l, fileOut) != l)
+	if (fwrite(&l, 2, 1, fileOut) != 1 || fwrite(cryptedFileName, 1, l, fileOut) != l
+			|| ((flags & FILE_NONCE_FLAGS) && fwrite(&nonce, 8, 1, fileOut) != 1)
+			|| ((flags & FILE_FLAG_CHUNKED) && (fwrite(&version, 1, 1, fileOut) != 1 || fwrite(&chunkSize, 4, 1, fileOut) != 1)))
 	{
-		printf("An error occurred during writing file name in %s: %s\n", fileNameOut, strerror(ferror(fileOut)));
+		LogMessage(ctx, "An error occurred during writing file name in %s: %s\n", fileNameOut, strerror(ferror(fileOut)));
+		free(chunkTags);
 		fclose(fileIn); fclose(fileOut);
 		remove(fileNameOut);
 		return 0;
 	}
 	free(cryptedFileName);
 
-	memset(mainDataBuf, 0, DATA_BUF_SIZE);
-	while ((n = fread(mainDataBuf, 1, DATA_BUF_SIZE, fileIn)) > 0)
+	r = RunFilePipeline(ctx, fileIn, fileOut, 1, GetCipherMode(flags), nonce,
+			size, size + padding, (flags & FILE_FLAG_TREE_HASH) ? HASH_TREE : HASH_MD5, checkSum, chunkSize, chunkTags);
+	if (r == PIPELINE_WRITE_ERROR)
+		LogMessage(ctx, "An error occurred during writing data in %s: %s\n", fileNameOut, strerror(ferror(fileOut)));
+	else if (r == PIPELINE_READ_ERROR)
+		LogMessage(ctx, "An error occurred during reading from %s: %s\n", fileNameIn, strerror(ferror(fileIn)));
+
+	if (r == PIPELINE_OK && (flags & FILE_FLAG_CHUNKED) && !WriteChunkIndex(ctx, fileOut, chunkTags, nbChunks, size))
 	{
-		n = (n+7)/8 * 8;
-		if (!Process_MT(mainDataBuf, mainDataBuf, n, 1))
-		{
-			fclose(fileIn); fclose(fileOut);
-			remove(fileNameOut);
-			return 0;
-		}
+		LogMessage(ctx, "An error occurred during writing the index in %s: %s\n", fileNameOut, strerror(ferror(fileOut)));
+		r = PIPELINE_WRITE_ERROR;
+	}
+	free(chunkTags);
 
-		if (fwrite(mainDataBuf, 1, n, fileOut) != n)
+	if (r == PIPELINE_OK)
+	{
+		if (fseek(fileOut, 32, SEEK_SET) || fwrite(checkSum, 1, 16, fileOut) != 16)
 		{
-			printf("An error occurred during writing data in %s: %s\n", fileNameOut, strerror(ferror(fileOut)));
-			fclose(fileIn); fclose(fileOut);
-			remove(fileNameOut);
-			return 0;
+			LogMessage(ctx, "An error occurred during writing header in %s: %s\n", fileNameOut, strerror(ferror(fileOut)));
+			r = PIPELINE_WRITE_ERROR;
 		}
-		memset(mainDataBuf, 0, DATA_BUF_SIZE);
 	}
 
-	fclose(fileOut);
-	if (!feof(fileIn))
+	fclose(fileIn);
+	if (fclose(fileOut) && r == PIPELINE_OK)
+	{
+		LogMessage(ctx, "An error occurred during writing data in %s: %s\n", fileNameOut, strerror(errno));
+		r = PIPELINE_WRITE_ERROR;
+	}
+	if (r != PIPELINE_OK)
 	{
-		printf("An error occurred during reading from %s: %s\n", fileNameIn, strerror(ferror(fileIn)));
-		fclose(fileIn);
 		remove(fileNameOut);
 		return 0;
 	}
 
-	fclose(fileIn);
 	return 1;
 }
 
-int DecryptFile(const char *fileNameIn, const char *fileNameOut, const Uint16 *keySha0)
+int DecryptFile(IdeaContext *ctx, const char *fileNameIn, const char *fileNameOut)
 {
 	FILE *fileIn = fopen(fileNameIn, "rb");
 	FILE *fileOut = NULL;
-	Uint16 keySha[16];
-	Uint16 checkSum[8], checkSum0[8];
-	Uint16 c = 0;
-	size_t n, nbBlocks = 0, l;
-	Uint8 padding = 0;
+	FileHeader header;
+	Uint16 checkSum[8];
+	Uint16 *chunkTags = NULL;
+	Uint64 nbCorrupted;
 	int i, r;
 
 	if (!strcmp(fileNameIn, fileNameOut))
 	{
-		printf("The source and destination files are identical (%s).\n", fileNameIn);
+		LogMessage(ctx, "The source and destination files are identical (%s).\n", fileNameIn);
 		return 0;
 	}
 
 	if (!fileIn)
 	{
-		printf("Unable to open the input file %s: %s\n.", fileNameIn, strerror(errno));
+		LogMessage(ctx, "Unable to open the input file %s: %s\n.", fileNameIn, strerror(errno));
 		return 0;
 	}
 
-	fseek(fileIn, 0, SEEK_END);
-	nbBlocks = ftell(fileIn);
-	rewind(fileIn);
-
-	if (!(fileOut = fopen(fileNameOut, "wb+")))
+	if (!(fileOut = fopen(fileNameOut, "w+b")))
 	{
-		printf("Unable to create the output file %s: %s\n.", fileNameOut, strerror(errno));
+		LogMessage(ctx, "Unable to create the output file %s: %s\n.", fileNameOut, strerror(errno));
 		fclose(fileIn);
 		return 0;
 	}
 
-	if (fread(keySha, 1, 32, fileIn) != 32 || fread(checkSum0, 1, 16, fileIn) != 16 || fread(&padding, 1, 1, fileIn) != 1
-			|| fread(&c, 1, 2, fileIn) != 2)
+	if (!ReadFileHeader(ctx, fileIn, fileNameIn, &header))
 	{
-		if (feof(fileIn))
-			printf("%s is not a valid file.\n", fileNameIn);
-		else
-			printf("An error occurred during reading header from %s: %s\n", fileNameIn, strerror(ferror(fileIn)));
 		fclose(fileIn); fclose(fileOut);
 		remove(fileNameOut);
 		return 0;
 	}
-	for (i=0 ; i < 16 ; i++)
+	if (header.nbChunks && !(chunkTags = malloc(16 * header.nbChunks)))
 	{
-		if (keySha[i] != keySha0[i])
-		{
-			printf("Wrong password for file %s, or not a valid file.\n", fileNameIn);
-			fclose(fileIn); fclose(fileOut);
-			remove(fileNameOut);
-			return 0;
-		}
+		LogMessage(ctx, "Unable to allocate the chunk tags.\n");
+		free(header.chunkTags);
+		fclose(fileIn); fclose(fileOut);
+		remove(fileNameOut);
+		return 0;
+	}
+
+	r = RunFilePipeline(ctx, fileIn, fileOut, 0, GetCipherMode(header.flags), header.nonce,
+			header.dataSize, header.dataSize - header.padding, (header.flags & FILE_FLAG_TREE_HASH) ? HASH_TREE : HASH_MD5,
+			checkSum, header.chunkSize, chunkTags);
+	if (r != PIPELINE_OK)
+	{
+		if (r == PIPELINE_WRITE_ERROR)
+			LogMessage(ctx, "An error occurred during writing data in %s: %s\n", fileNameOut, strerror(ferror(fileOut)));
+		else if (r == PIPELINE_READ_ERROR)
+			LogMessage(ctx, "An error occurred during reading data from %s: %s\n", fileNameIn, strerror(ferror(fileIn)));
+		free(header.chunkTags);
+		free(chunkTags);
+		fclose(fileIn); fclose(fileOut);
+		remove(fileNameOut);
+		return 0;
 	}
 
-	nbBlocks = (nbBlocks-(51+c)+(DATA_BUF_SIZE-1)) / DATA_BUF_SIZE;
-	fseek(fileIn, c, SEEK_CUR);
+	fclose(fileIn);
+	if (fclose(fileOut))
+	{
+		LogMessage(ctx, "An error occurred during writing data in %s: %s\n", fileNameOut, strerror(errno));
+		free(header.chunkTags);
+		free(chunkTags);
+		remove(fileNameOut);
+		return 0;
+	}
 
-	memset(mainDataBuf, 0, DATA_BUF_SIZE);
-	for (i=1 ; (n = fread(mainDataBuf, 1, DATA_BUF_SIZE, fileIn)) > 0 ; i++)
+	//A corrupted chunk does not spoil the others: the output is kept, with the damaged ranges reported
+	nbCorrupted = CheckChunkTags(ctx, &header, chunkTags, 0, header.nbChunks, fileNameIn);
+	free(header.chunkTags);
+	free(chunkTags);
+	if (nbCorrupted)
 	{
-		l = n;
-		if (i == nbBlocks)
-			l -= padding;
+		LogMessage(ctx, "%" PRIu64 " of the %" PRIu64 " chunks of %s have been corrupted. %s is kept: only the bytes listed above are wrong.\n",
+				nbCorrupted, header.nbChunks, fileNameIn, fileNameOut);
+		return 0;
+	}
 
-		n = (n+7)/8 * 8;
-		if (!Process_MT(mainDataBuf, mainDataBuf, n, 0))
+	for (i=0 ; i < 8 ; i++)
+	{
+		if (checkSum[i] != header.checkSum[i])
 		{
-			fclose(fileIn); fclose(fileOut);
+			LogMessage(ctx, "The MD5 checksum of the file %s is incorrect. It may have been corrupted.\n", fileNameIn);
 			remove(fileNameOut);
 			return 0;
 		}
+	}
 
-		if (fwrite(mainDataBuf, 1, l, fileOut) != l)
-		{
-			printf("An error occurred during writing data in %s: %s\n", fileNameOut, strerror(ferror(fileOut)));
-			fclose(fileIn); fclose(fileOut);
-			remove(fileNameOut);
-			return 0;
-		}
+	return 1;
+}
+
+//Only the chunked files can be checked, chunk by chunk: the checksum of the others covers the whole data
+int DecryptFileRange(IdeaContext *ctx, const char *fileNameIn, const char *fileNameOut, Uint64 start, Uint64 end)
+{
+	FILE *fileIn = fopen(fileNameIn, "rb");
+	FILE *fileOut = NULL;
+	FileHeader header;
+	Uint16 *chunkTags = NULL;
+	Sint64 dataOffset;
+	Uint64 alignment, first, last, inputSize, nbCorrupted;
+	int r;
+
+	if (!strcmp(fileNameIn, fileNameOut))
+	{
+		LogMessage(ctx, "The source and destination files are identical (%s).\n", fileNameIn);
+		return 0;
+	}
+
+	if (!fileIn)
+	{
+		LogMessage(ctx, "Unable to open the input file %s: %s\n.", fileNameIn, strerror(errno));
+		return 0;
+	}
+
+	if (!ReadFileHeader(ctx, fileIn, fileNameIn, &header))
+	{
+		fclose(fileIn);
+		return 0;
+	}
+	if (end > header.plainSize)
+		end = header.plainSize;
+	if (start >= end)
+	{
+		LogMessage(ctx, "Nothing to decrypt, %s holds %" PRIu64 " bytes.\n", fileNameIn, header.plainSize);
+		free(header.chunkTags);
+		fclose(fileIn);
+		return 0;
 	}
 
-	if (!feof(fileIn))
+	//The decryption starts on a block, a CBC segment or a chunk, so that it needs nothing before.
+	//A chunk is decrypted whole, to be checked.
+	if (header.chunkSize)
+		alignment = header.chunkSize;
+	else
+		alignment = (header.flags & FILE_FLAG_CBC) ? CBC_SEGMENT_SIZE : 8;
+	first = start - start % alignment;
+	last = header.chunkSize ? (end + alignment-1) / alignment * alignment : end;
+	if (last > header.plainSize)
+		last = header.plainSize;
+	inputSize = (last+7)/8 * 8 < header.dataSize ? (last+7)/8 * 8 - first : header.dataSize - first;
+
+	if (header.nbChunks && !(chunkTags = malloc(16 * header.nbChunks)))
 	{
-		printf("An error occurred during reading data from %s: %s\n", fileNameIn, strerror(ferror(fileIn)));
+		LogMessage(ctx, "Unable to allocate the chunk tags.\n");
+		free(header.chunkTags);
+		fclose(fileIn);
+		return 0;
+	}
+
+	if (!(fileOut = fopen(fileNameOut, "w+b")))
+	{
+		LogMessage(ctx, "Unable to create the output file %s: %s\n.", fileNameOut, strerror(errno));
+		free(header.chunkTags);
+		free(chunkTags);
+		fclose(fileIn);
+		return 0;
+	}
+
+	if ((dataOffset = GetFilePosition(fileIn)) < 0 || SetFilePosition(fileIn, dataOffset + first, SEEK_SET))
+		r = PIPELINE_READ_ERROR;
+	else
+		r = RunRangePipeline(ctx, fileIn, fileOut, GetCipherMode(header.flags), header.nonce, first,
+				inputSize, last - first, start - first, end - start, header.chunkSize, chunkTags);
+	if (r != PIPELINE_OK)
+	{
+		if (r == PIPELINE_WRITE_ERROR)
+			LogMessage(ctx, "An error occurred during writing data in %s: %s\n", fileNameOut, strerror(ferror(fileOut)));
+		else if (r == PIPELINE_READ_ERROR)
+			LogMessage(ctx, "An error occurred during reading data from %s: %s\n", fileNameIn, strerror(ferror(fileIn)));
+		free(header.chunkTags);
+		free(chunkTags);
 		fclose(fileIn); fclose(fileOut);
 		remove(fileNameOut);
 		return 0;
 	}
 
-	r = ComputeFileMD5Checksum(fileOut, checkSum);
-	fclose(fileIn); fclose(fileOut);
+	fclose(fileIn);
+	if (fclose(fileOut))
+	{
+		LogMessage(ctx, "An error occurred during writing data in %s: %s\n", fileNameOut, strerror(errno));
+		free(header.chunkTags);
+		free(chunkTags);
+		remove(fileNameOut);
+		return 0;
+	}
 
-	if (!r)
+	nbCorrupted = header.nbChunks ? CheckChunkTags(ctx, &header, chunkTags, first / alignment, (last-1) / alignment + 1, fileNameIn) : 0;
+	free(header.chunkTags);
+	free(chunkTags);
+	if (nbCorrupted)
 	{
-		printf("Unable to check the decrypted file %s. Keep it anyway? (y/n): ", fileNameOut);
-		if (toupper(EnterChar("yYnN")) == 'N')
-		{
-			remove(fileNameOut);
-			return 0;
-		}
-		return 1;
+		LogMessage(ctx, "%" PRIu64 " of the chunks of the range have been corrupted, the others are decrypted correctly.\n", nbCorrupted);
+		return 0;
 	}
 
-	for (i=0 ; i < 8 ; i++)
+	return 1;
+}
+
+//The chunks need the size of the data beforehand, a stream only has the other options
+int EncryptStream(IdeaContext *ctx, FILE *fileIn, FILE *fileOut)
+{
+	Uint16 checkSum[8] = {0}, cryptedName[8], l = 16;
+	Uint8 flags = (ctx->fileFlags & FILE_KNOWN_FLAGS & ~FILE_FLAG_CHUNKED) | FILE_FLAG_STREAM;
+	Uint64 nonce = 0, plainSize = 0;
+	int r;
+
+	if ((flags & FILE_NONCE_FLAGS) && !GenerateNonce(ctx, &nonce))
+		return 0;
+
+	//No name, the checksum is in the trailer
+	if (!EncryptString(ctx, "", cryptedName, 0))
+		return 0;
+	if (fwrite(ctx->keySha, 1, 32, fileOut) != 32 || fwrite(checkSum, 1, 16, fileOut) != 16 || fwrite(&flags, 1, 1, fileOut) != 1
+			|| fwrite(&l, 2, 1, fileOut) != 1 || fwrite(cryptedName, 1, l, fileOut) != l
+			|| ((flags & FILE_NONCE_FLAGS) && fwrite(&nonce, 8, 1, fileOut) != 1))
 	{
-		if (checkSum[i] != checkSum0[i])
-		{
-			printf("The MD5 checksum of the file %s is incorrect. It may have been corrupted.\n", fileNameIn);
-			remove(fileNameOut);
-			return 0;
-		}
+		LogMessage(ctx, "An error occurred during writing header to the output stream: %s\n", strerror(ferror(fileOut)));
+		return 0;
+	}
+
+	r = RunStreamPipeline(ctx, fileIn, fileOut, 1, GetCipherMode(flags), nonce,
+			(flags & FILE_FLAG_TREE_HASH) ? HASH_TREE : HASH_MD5, checkSum, &plainSize, NULL);
+	if (r == PIPELINE_WRITE_ERROR)
+		LogMessage(ctx, "An error occurred during writing data to the output stream: %s\n", strerror(ferror(fileOut)));
+	else if (r == PIPELINE_READ_ERROR)
+		LogMessage(ctx, "An error occurred during reading from the input stream: %s\n", strerror(ferror(fileIn)));
+	if (r != PIPELINE_OK)
+		return 0;
+
+	if (fwrite(&plainSize, 8, 1, fileOut) != 1 || fwrite(checkSum, 1, 16, fileOut) != 16 || fflush(fileOut))
+	{
+		LogMessage(ctx, "An error occurred during writing the trailer to the output stream: %s\n", strerror(ferror(fileOut)));
+		return 0;
+	}
+
+	return 1;
+}
+
+//The data is written as it is decrypted, before the checksum can be checked
+int DecryptStream(IdeaContext *ctx, FILE *fileIn, FILE *fileOut)
+{
+	FileHeader header;
+	Uint16 checkSum[8];
+	Uint8 trailer[FILE_TRAILER_SIZE];
+	int r;
+
+	if (!ReadStreamHeader(ctx, fileIn, &header))
+		return 0;
+
+	r = RunStreamPipeline(ctx, fileIn, fileOut, 0, GetCipherMode(header.flags), header.nonce,
+			(header.flags & FILE_FLAG_TREE_HASH) ? HASH_TREE : HASH_MD5, checkSum, &header.plainSize, trailer);
+	if (r == PIPELINE_OK && fflush(fileOut))
+		r = PIPELINE_WRITE_ERROR;
+	if (r == PIPELINE_WRITE_ERROR)
+		LogMessage(ctx, "An error occurred during writing data to the output stream: %s\n", strerror(ferror(fileOut)));
+	else if (r == PIPELINE_READ_ERROR)
+		LogMessage(ctx, "An error occurred during reading from the input stream: %s\n", strerror(ferror(fileIn)));
+	else if (r == PIPELINE_FORMAT_ERROR)
+		LogMessage(ctx, "The input stream is truncated, or not a valid stream.\n");
+	if (r != PIPELINE_OK)
+		return 0;
+
+	if (memcmp(checkSum, trailer + 8, 16))
+	{
+		LogMessage(ctx, "The MD5 checksum of the input stream is incorrect. It may have been corrupted, and so the output.\n");
+		return 0;
 	}
 
 	return 1;
 }
 
-int DecryptFileName(const char *fileNameIn, char **fileNameOut, const Uint16 *keySha0)
+int DecryptFileName(IdeaContext *ctx, const char *fileNameIn, char **fileNameOut)
 {
 	FILE *fileIn = fopen(fileNameIn, "rb");
 	Uint16 keySha[16], l=0;
@@ -391,7 +775,7 @@ int DecryptFileName(const char *fileNameIn, char **fileNameOut, const Uint16 *ke
 
 	if (!fileIn)
 	{
-		printf("Unable to open the input file %s: %s\n.", fileNameIn, strerror(errno));
+		LogMessage(ctx, "Unable to open the input file %s: %s\n.", fileNameIn, strerror(errno));
 		return -1;
 	}
 
@@ -399,14 +783,14 @@ int DecryptFileName(const char *fileNameIn, char **fileNameOut, const Uint16 *ke
 	{
 		if (!l)
 		{
-			printf("%s is not a valid file.\n", fileNameIn);
+			LogMessage(ctx, "%s is not a valid file.\n", fileNameIn);
 			fclose(fileIn);
 			return -1;
 		}
 
 		if (!(cryptedFileName = malloc(l)))
 		{
-			printf("Unable to allocate memory for the encrypted file name.\n");
+			LogMessage(ctx, "Unable to allocate memory for the encrypted file name.\n");
 			fclose(fileIn);
 			return -1;
 		}
@@ -418,9 +802,9 @@ int DecryptFileName(const char *fileNameIn, char **fileNameOut, const Uint16 *ke
 	if (!r)
 	{
 		if (feof(fileIn))
-			printf("%s is not a valid file.\n", fileNameIn);
+			LogMessage(ctx, "%s is not a valid file.\n", fileNameIn);
 		else
-			printf("An error occurred during reading from %s: %s\n", fileNameIn, strerror(ferror(fileIn)));
+			LogMessage(ctx, "An error occurred during reading from %s: %s\n", fileNameIn, strerror(ferror(fileIn)));
 		fclose(fileIn);
 		if (cryptedFileName)
 			free(cryptedFileName);
@@ -431,26 +815,33 @@ int DecryptFileName(const char *fileNameIn, char **fileNameOut, const Uint16 *ke
 
 	for (i=0 ; i < 16 ; i++)
 	{
-		if (keySha[i] != keySha0[i])
+		if (keySha[i] != ctx->keySha[i])
 		{
-			printf("Wrong password for file %s, or not a valid file.\n", fileNameIn);
+			LogMessage(ctx, "Wrong password for file %s, or not a valid file.\n", fileNameIn);
 			free(cryptedFileName);
 			return -1;
 		}
 	}
 
+	//No name, like the streams: the caller chooses one
+	if (l == 16)
+	{
+		free(cryptedFileName);
+		return 0;
+	}
+
 	p = GetFileNameFromAddr((char*)fileNameIn);
 	i = p - fileNameIn;
 
 	if (!(*fileNameOut = malloc(sizeof(char) * (l+1+i-16))))
 	{
-		printf("Unable to allocate memory for the decrypted file name.\n");
+		LogMessage(ctx, "Unable to allocate memory for the decrypted file name.\n");
 		free(cryptedFileName);
 		return -1;
 	}
 
 	strncpy(*fileNameOut, fileNameIn, i);
-	r = DecryptString(cryptedFileName, l/2, &((*fileNameOut)[i])) ? 1 : 0;
+	r = DecryptString(ctx, cryptedFileName, l/2, &((*fileNameOut)[i])) ? 1 : 0;
 
 	free(cryptedFileName);
 	if (!r)
@@ -458,128 +849,594 @@ int DecryptFileName(const char *fileNameIn, char **fileNameOut, const Uint16 *ke
 	return r;
 }
 
-int Process_MT(const Uint16 *in, Uint16 *out, size_t size, int encrypt)
+int Process_MT(IdeaContext *ctx, const Uint16 *in, Uint16 *out, size_t size, int encrypt)
 {
-	pthread_t threads[NUM_THREADS];
-	ProcessMTStruct pmts[NUM_THREADS];
-	int rc, t;
-	Uint32 nbThreads = (size / 8) / BLOCK_MIN_PER_THREAD;
-	Uint32 blockSize;
+	ProcessMTStruct pmts;
 
-	if (nbThreads <= 0)
+	memset(&pmts, 0, sizeof(ProcessMTStruct));
+	pmts.in = in;
+	pmts.out = out;
+	pmts.keys = encrypt ? &(ctx->partialKeys[0][0]) : &(ctx->partialInvertedKeys[0][0]);
+	return RunBlockJobs(&pmts, size, 1, ctx->minJobBlocks, Process_MT_sub);
+}
+
+//The keystream only depends on the block number, so any part of the data can be
+//processed on its own: the same call encrypts and decrypts.
+int ProcessCTR_MT(IdeaContext *ctx, const Uint16 *in, Uint16 *out, size_t size, Uint64 nonce, Uint64 firstBlock)
+{
+	ProcessMTStruct pmts = {in, out, 0, &(ctx->partialKeys[0][0]), NULL, nonce, firstBlock};
+	return RunBlockJobs(&pmts, size, 1, ctx->minJobBlocks, ProcessCTR_MT_sub);
+}
+
+//The data is cut into segments of CBC_SEGMENT_SIZE bytes, each one chained from its
+//own IV, the encrypted (nonce + segment number). firstBlock must start a segment.
+//Decryption is parallel over the blocks, encryption over the segments.
+int ProcessCBC_MT(IdeaContext *ctx, const Uint16 *in, Uint16 *out, size_t size, Uint64 nonce, Uint64 firstBlock,
+		int encrypt)
+{
+	ProcessMTStruct pmts = {in, out, 0, encrypt ? &(ctx->partialKeys[0][0]) : &(ctx->partialInvertedKeys[0][0]),
+			&(ctx->partialKeys[0][0]), nonce, firstBlock};
+
+	if (firstBlock % (CBC_SEGMENT_SIZE/8))
 	{
-		ProcessMTStruct pmts = {in, out, size/sizeof(Uint16)};
-		Process_MT_sub(&pmts);
-		return 1;
+		LogMessage(ctx, "CBC data must be processed from the beginning of a segment.\n");
+		return 0;
 	}
+	return RunBlockJobs(&pmts, size, CBC_SEGMENT_SIZE/8, ctx->minJobBlocks, encrypt ? EncryptCBC_MT_sub : DecryptCBC_MT_sub);
+}
 
-	if (nbThreads > NUM_THREADS)
-		nbThreads = NUM_THREADS;
-
-	blockSize = size / (sizeof(Uint16) * nbThreads);
+//Past 2^32 blocks (32 GB) into the data, and with counters wrapping around 2^64. The
+//reference is the scalar cipher, one block at a time, and the data is also processed in
+//two calls, as the buffers of a big file are, to check the block number of the second one.
+int CheckBlockCounters(void)
+{
+	static const Uint16 keys[8] = {0x0102, 0x0304, 0x0506, 0x0708, 0x090a, 0x0b0c, 0x0d0e, 0x0f10};
+	static const Uint64 nonces[2] = {0x0123456789abcdefULL, 0xfffffffffffff000ULL};
+	static const Uint64 firstBlocks[2] = {(1ULL << 32) - CBC_SEGMENT_SIZE/8, (1ULL << 40) + 3 * CBC_SEGMENT_SIZE/8};
+	const size_t segmentBlocks = CBC_SEGMENT_SIZE/8, nbBlocks = 4*segmentBlocks + 37, split = 2*segmentBlocks;
+	IdeaContext ctx;
+	Uint16 *plain = NULL, *ref = NULL, *out = NULL, block[4], chain[4];
+	Uint32 seed = 1;
+	Uint64 nonce, first;
+	size_t b, i;
+	int k, r = 1;
+
+	if (!InitIdeaContext(&ctx, keys))
+		return 0;
+	ctx.minJobBlocks = 64;
+	plain = malloc(nbBlocks * 8);
+	ref = malloc(nbBlocks * 8);
+	out = malloc(nbBlocks * 8);
+	if (!plain || !ref || !out)
+	{
+		printf("Unable to allocate the test buffers.\n");
+		free(plain); free(ref); free(out);
+		FreeIdeaContext(&ctx);
+		return 0;
+	}
+	for (i=0 ; i < nbBlocks*4 ; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		plain[i] = (Uint16)(seed >> 16);
+	}
 
-	for(t=0 ; t < nbThreads ; t++)
+	for (k=0 ; k < 4 ; k++)
 	{
-		pmts[t].in = &(in[t*blockSize]);
-		pmts[t].out = &(out[t*blockSize]);
-		pmts[t].num = blockSize;
-		pmts[t].encrypt = encrypt;
+		nonce = nonces[k/2];
+		first = firstBlocks[k%2];
 
-		rc = pthread_create(&(threads[t]), NULL, Process_MT_sub, &(pmts[t]));
-		if (rc)
+		for (b=0 ; b < nbBlocks ; b++)
 		{
-			printf("Unable to create thread for %s: return code from pthread_create() is %d\n", encrypt ? "encryption" : "decryption", rc);
-			return 0;
+			SetCounterBlock(block, nonce + first + b);
+			Encrypt(&ctx, block, block);
+			for (i=0 ; i < 4 ; i++)
+				ref[b*4+i] = plain[b*4+i] ^ block[i];
 		}
+		ProcessCTR_MT(&ctx, plain, out, nbBlocks*8, nonce, first);
+		if (memcmp(out, ref, nbBlocks*8))
+		{
+			printf("Counter mode: wrong output from block %" PRIu64 " with the nonce %016" PRIx64 ".\n", first, nonce);
+			r = 0;
+		}
+		ProcessCTR_MT(&ctx, plain, out, split*8, nonce, first);
+		ProcessCTR_MT(&ctx, &(plain[split*4]), &(out[split*4]), (nbBlocks-split)*8, nonce, first + split);
+		if (memcmp(out, ref, nbBlocks*8))
+		{
+			printf("Counter mode: wrong output in two parts from block %" PRIu64 " with the nonce %016" PRIx64 ".\n", first, nonce);
+			r = 0;
+		}
+
+		for (b=0 ; b < nbBlocks ; b++)
+		{
+			if (!((first + b) % segmentBlocks))
+			{
+				SetCounterBlock(chain, nonce + (first + b) / segmentBlocks);
+				Encrypt(&ctx, chain, chain);
+			}
+			for (i=0 ; i < 4 ; i++)
+				block[i] = plain[b*4+i] ^ chain[i];
+			Encrypt(&ctx, block, chain);
+			memcpy(&(ref[b*4]), chain, 8);
+		}
+		ProcessCBC_MT(&ctx, plain, out, split*8, nonce, first, 1);
+		ProcessCBC_MT(&ctx, &(plain[split*4]), &(out[split*4]), (nbBlocks-split)*8, nonce, first + split, 1);
+		if (memcmp(out, ref, nbBlocks*8))
+		{
+			printf("CBC mode: wrong encryption from block %" PRIu64 " with the nonce %016" PRIx64 ".\n", first, nonce);
+			r = 0;
+		}
+		ProcessCBC_MT(&ctx, ref, out, nbBlocks*8, nonce, first, 0);
+		if (memcmp(out, plain, nbBlocks*8))
+		{
+			printf("CBC mode: wrong decryption from block %" PRIu64 " with the nonce %016" PRIx64 ".\n", first, nonce);
+			r = 0;
+		}
+	}
+
+	free(plain); free(ref); free(out);
+	FreeIdeaContext(&ctx);
+	return r;
+}
+
+int GenerateNonce(IdeaContext *ctx, Uint64 *nonce)
+{
+	if (!GetRandomBytes(nonce, sizeof(Uint64)))
+	{
+		LogMessage(ctx, "Unable to get random data for the nonce.\n");
+		return 0;
+	}
+	return 1;
+}
+
+Sint64 GetFilePosition(FILE *file)
+{
+#ifdef WIN32
+	return ftello64(file);
+#else
+	return ftello(file);
+#endif
+}
+
+int SetFilePosition(FILE *file, Sint64 offset, int origin)
+{
+#ifdef WIN32
+	return fseeko64(file, offset, origin);
+#else
+	return fseeko(file, (off_t)offset, origin);
+#endif
+}
+
+//Spreads the blocks over the thread pool, func processing one slice.
+//The slices start on multiples of alignBlocks blocks.
+static int RunBlockJobs(const ProcessMTStruct *whole, size_t size, size_t alignBlocks, size_t minJobBlocks,
+		void* (*func)(void*))
+{
+	PoolJob jobs[MAX_JOBS];
+	ProcessMTStruct pmts[MAX_JOBS];
+	JobGroup group = {0};
+	size_t nbBlocks = size / 8, blocksPerJob, first;
+	size_t nbJobs = nbBlocks / (minJobBlocks ? minJobBlocks : 1), t;
+	size_t maxJobs = (size_t)(GetThreadPoolSize() + 1) * SLICES_PER_THREAD;
+
+	//The calling thread takes part in the work while it waits. There are more slices
+	//than threads, so that the threads done first, or free after another file, steal the rest.
+	if (nbJobs > maxJobs)
+		nbJobs = maxJobs;
+	if (nbJobs > MAX_JOBS)
+		nbJobs = MAX_JOBS;
+
+	if (nbJobs <= 1)
+	{
+		pmts[0] = *whole;
+		pmts[0].num = nbBlocks * 4;
+		func(&(pmts[0]));
+		return 1;
 	}
 
-	for(t=0 ; t < nbThreads ; t++)
-		pthread_join(threads[t], NULL);
+	//Slices are cut on block boundaries, the last one takes the remainder
+	blocksPerJob = (nbBlocks + nbJobs - 1) / nbJobs;
+	blocksPerJob = (blocksPerJob + alignBlocks - 1) / alignBlocks * alignBlocks;
+	for (t=0, first=0 ; first < nbBlocks ; t++, first += blocksPerJob)
+	{
+		pmts[t] = *whole;
+		pmts[t].in = &(whole->in[first*4]);
+		pmts[t].out = &(whole->out[first*4]);
+		pmts[t].num = (nbBlocks - first < blocksPerJob ? nbBlocks - first : blocksPerJob) * 4;
+		pmts[t].firstBlock = whole->firstBlock + first;
+		SubmitJob(&group, &(jobs[t]), func, &(pmts[t]));
+	}
 
+	WaitJobGroup(&group);
 	return 1;
 }
 
 static void* Process_MT_sub(void *data)
 {
 	ProcessMTStruct *pmts = (ProcessMTStruct*)data;
-	Uint32 i, n = pmts->num / 4;
+	ProcessBlocks(pmts->in, pmts->out, pmts->num / 4, pmts->keys);
+	return NULL;
+}
+
+//The counter blocks are encrypted by chunks, which are then xored with the data
+static void* ProcessCTR_MT_sub(void *data)
+{
+	ProcessMTStruct *pmts = (ProcessMTStruct*)data;
+	Uint16 keyStream[CTR_CHUNK_BLOCKS*4];
+	size_t i, j, nbBlocks, done, n = pmts->num / 4;
 
-	if (pmts->encrypt)
+	for (done=0 ; done < n ; done += nbBlocks)
 	{
-		for (i=0 ; i < n ; i++)
-			Encrypt(&(pmts->in[i*4]), &(pmts->out[i*4]));
+		nbBlocks = n - done < CTR_CHUNK_BLOCKS ? n - done : CTR_CHUNK_BLOCKS;
+		for (i=0 ; i < nbBlocks ; i++)
+			SetCounterBlock(&(keyStream[i*4]), pmts->nonce + pmts->firstBlock + done + i);
+		ProcessBlocks(keyStream, keyStream, nbBlocks, pmts->keys);
+
+		for (j=0 ; j < nbBlocks*4 ; j++)
+			pmts->out[done*4 + j] = pmts->in[done*4 + j] ^ keyStream[j];
 	}
-	else
+
+	return NULL;
+}
+
+//The segments of the slice go side by side in the lanes of the kernel: their block j
+//are gathered, chained and encrypted together, then put back.
+static void* EncryptCBC_MT_sub(void *data)
+{
+	ProcessMTStruct *pmts = (ProcessMTStruct*)data;
+	Uint16 lanes[CBC_LANES*4];
+	const Uint16 *block;
+	const size_t segmentBlocks = CBC_SEGMENT_SIZE/8;
+	size_t n = pmts->num / 4, s, nbSegments, i, j, k, nbLanes;
+	Uint64 segment0 = pmts->firstBlock / segmentBlocks;
+
+	for (s=0 ; s < n ; s += nbSegments * segmentBlocks)
 	{
-		for (i=0 ; i < n ; i++)
-			Decrypt(&(pmts->in[i*4]), &(pmts->out[i*4]));
+		nbSegments = (n - s + segmentBlocks-1) / segmentBlocks;
+		if (nbSegments > CBC_LANES)
+			nbSegments = CBC_LANES;
+
+		//The chaining values start as the IVs
+		for (k=0 ; k < nbSegments ; k++)
+			SetCounterBlock(&(lanes[k*4]), pmts->nonce + segment0 + s / segmentBlocks + k);
+		ProcessBlocks(lanes, lanes, nbSegments, pmts->ivKeys);
+
+		for (j=0 ; j < segmentBlocks ; j++)
+		{
+			//Only the last segment of the data can be shorter, and it is the last lane
+			for (k=0, nbLanes=0 ; k < nbSegments && s + k*segmentBlocks + j < n ; k++, nbLanes++)
+			{
+				block = &(pmts->in[(s + k*segmentBlocks + j) * 4]);
+				for (i=0 ; i < 4 ; i++)
+					lanes[k*4+i] ^= block[i];
+			}
+			if (!nbLanes)
+				break;
+
+			ProcessBlocks(lanes, lanes, nbLanes, pmts->keys);
+			for (k=0 ; k < nbLanes ; k++)
+				memcpy(&(pmts->out[(s + k*segmentBlocks + j) * 4]), &(lanes[k*4]), 8);
+		}
 	}
 
 	return NULL;
 }
 
-void Encrypt(const Uint16 *in, Uint16 *out)
+//Every block is decrypted at once, then xored with the previous encrypted block,
+//which is saved beforehand when working in place
+static void* DecryptCBC_MT_sub(void *data)
 {
-	int i;
-	Uint16 tmp[4] = {0};
+	ProcessMTStruct *pmts = (ProcessMTStruct*)data;
+	Uint16 saved[CBC_SEGMENT_SIZE/2], iv[4];
+	const size_t segmentBlocks = CBC_SEGMENT_SIZE/8;
+	size_t n = pmts->num / 4, s, nbBlocks, i;
 
-	memcpy(tmp, in, sizeof(Uint16) * 4);
+	for (s=0 ; s < n ; s += segmentBlocks)
+	{
+		nbBlocks = n - s < segmentBlocks ? n - s : segmentBlocks;
+		SetCounterBlock(iv, pmts->nonce + (pmts->firstBlock + s) / segmentBlocks);
+		ProcessBlock(iv, iv, pmts->ivKeys);
 
-	for (i=0 ; i < 8 ; i++)
-		MakeRound(tmp, tmp, GetPartialKeys(i));
+		memcpy(saved, &(pmts->in[s*4]), nbBlocks * 8);
+		ProcessBlocks(saved, &(pmts->out[s*4]), nbBlocks, pmts->keys);
+
+		for (i=0 ; i < 4 ; i++)
+			pmts->out[s*4 + i] ^= iv[i];
+		for (i=4 ; i < nbBlocks*4 ; i++)
+			pmts->out[s*4 + i] ^= saved[i-4];
+	}
 
-	MakeTransfo(tmp, out, GetPartialKeys(i));
+	return NULL;
 }
 
-void Decrypt(const Uint16 *in, Uint16 *out)
+//Whole groups of blocks go through the vectorized kernel, the rest through the scalar one
+static void ProcessBlocks(const Uint16 *in, Uint16 *out, size_t nbBlocks, const Uint16 *keys)
 {
-	int i;
-	Uint16 tmp[4] = {0};
+	size_t i;
 
-	memcpy(tmp, in, sizeof(Uint16) * 4);
+	for (i = ProcessBlocks_SIMD(in, out, nbBlocks, keys) ; i < nbBlocks ; i++)
+		ProcessBlock(&(in[i*4]), &(out[i*4]), keys);
+}
 
-	for (i=0 ; i < 8 ; i++)
-		MakeRound(tmp, tmp, GetPartialInvertedKeys(i));
+static int GetCipherMode(Uint8 flags)
+{
+	if (flags & FILE_FLAG_CTR)
+		return CIPHER_CTR;
+	if (flags & FILE_FLAG_CBC)
+		return CIPHER_CBC;
+	return CIPHER_ECB;
+}
+
+//Checks the header of fileIn against the key, and the index of a chunked file, then leaves
+//the file at the start of the data. The tags are allocated and decrypted.
+static int ReadFileHeader(IdeaContext *ctx, FILE *fileIn, const char *fileNameIn, FileHeader *header)
+{
+	Uint16 keySha[16];
+	Uint16 c = 0;
+	Sint64 position;
+	Uint64 size, nonceSize, extSize, indexOffset;
+	Uint8 version = 0;
+	int i, valid;
+
+	memset(header, 0, sizeof(FileHeader));
+	if (SetFilePosition(fileIn, 0, SEEK_END) || (position = GetFilePosition(fileIn)) < 0)
+	{
+		LogMessage(ctx, "Unable to get the size of the input file %s: %s\n", fileNameIn, strerror(errno));
+		return 0;
+	}
+	size = (Uint64)position;
+	rewind(fileIn);
+
+	if (fread(keySha, 1, 32, fileIn) != 32 || fread(header->checkSum, 1, 16, fileIn) != 16
+			|| fread(&header->padding, 1, 1, fileIn) != 1 || fread(&c, 1, 2, fileIn) != 2)
+	{
+		if (feof(fileIn))
+			LogMessage(ctx, "%s is not a valid file.\n", fileNameIn);
+		else
+			LogMessage(ctx, "An error occurred during reading header from %s: %s\n", fileNameIn, strerror(ferror(fileIn)));
+		return 0;
+	}
+	for (i=0 ; i < 16 ; i++)
+	{
+		if (keySha[i] != ctx->keySha[i])
+		{
+			LogMessage(ctx, "Wrong password for file %s, or not a valid file.\n", fileNameIn);
+			return 0;
+		}
+	}
+
+	header->flags = header->padding & ~FILE_PADDING_MASK;
+	header->padding &= FILE_PADDING_MASK;
+	if (header->flags & ~FILE_KNOWN_FLAGS)
+	{
+		LogMessage(ctx, "%s uses options that this version does not support.\n", fileNameIn);
+		return 0;
+	}
+	if (header->flags & FILE_FLAG_STREAM)
+	{
+		LogMessage(ctx, "%s has been encrypted as a stream, it can only be decrypted as one (--stream=decrypt).\n", fileNameIn);
+		return 0;
+	}
+
+	//The data must be whole blocks, ending with the padding, except in counter mode
+	nonceSize = (header->flags & FILE_NONCE_FLAGS) ? 8 : 0;
+	extSize = (header->flags & FILE_FLAG_CHUNKED) ? 5 + FILE_INDEX_FOOTER_SIZE : 0;
+	size -= 51;
+	if (size < c + nonceSize + extSize || (header->flags & FILE_NONCE_FLAGS) == FILE_NONCE_FLAGS)
+		valid = 0;
+	else
+	{
+		size -= c + nonceSize + extSize;
+		valid = (header->flags & FILE_FLAG_CTR) ? !header->padding : !(size % 8) && size >= header->padding;
+	}
+	if (!valid)
+	{
+		LogMessage(ctx, "%s is not a valid file.\n", fileNameIn);
+		return 0;
+	}
+	if (SetFilePosition(fileIn, c, SEEK_CUR) || (nonceSize && fread(&header->nonce, 8, 1, fileIn) != 1)
+			|| (extSize && (fread(&version, 1, 1, fileIn) != 1 || fread(&header->chunkSize, 4, 1, fileIn) != 1)))
+	{
+		LogMessage(ctx, "An error occurred during reading header from %s: %s\n", fileNameIn, strerror(ferror(fileIn)));
+		return 0;
+	}
+	header->dataSize = size;
+	header->plainSize = size - header->padding;
+	if (!extSize)
+		return 1;
+
+	if (version != FILE_FORMAT_VERSION)
+	{
+		LogMessage(ctx, "%s uses options that this version does not support.\n", fileNameIn);
+		return 0;
+	}
+
+	//The index is at the end, it tells how much of what is left is data
+	position = GetFilePosition(fileIn);
+	if (SetFilePosition(fileIn, -FILE_INDEX_FOOTER_SIZE, SEEK_END) || fread(&indexOffset, 8, 1, fileIn) != 1
+			|| fread(&header->plainSize, 8, 1, fileIn) != 1)
+	{
+		LogMessage(ctx, "An error occurred during reading the index from %s: %s\n", fileNameIn, strerror(ferror(fileIn)));
+		return 0;
+	}
+	valid = header->chunkSize && !(header->chunkSize % TREE_HASH_LEAF_SIZE) && (header->flags & FILE_FLAG_TREE_HASH);
+	if (valid)
+	{
+		header->nbChunks = (header->plainSize + header->chunkSize-1) / header->chunkSize;
+		header->dataSize = (header->flags & FILE_FLAG_CTR) ? header->plainSize : (header->plainSize+7)/8 * 8;
+		valid = header->dataSize - header->plainSize == header->padding && indexOffset == (Uint64)position + header->dataSize
+				&& size == header->dataSize + header->nbChunks * 16;
+	}
+	if (!valid)
+	{
+		LogMessage(ctx, "%s is not a valid file.\n", fileNameIn);
+		return 0;
+	}
+
+	if (header->nbChunks && !(header->chunkTags = malloc(16 * header->nbChunks)))
+	{
+		LogMessage(ctx, "Unable to allocate the chunk tags.\n");
+		return 0;
+	}
+	if (SetFilePosition(fileIn, indexOffset, SEEK_SET) || fread(header->chunkTags, 16, (size_t)header->nbChunks, fileIn) != header->nbChunks
+			|| SetFilePosition(fileIn, position, SEEK_SET))
+	{
+		LogMessage(ctx, "An error occurred during reading the index from %s: %s\n", fileNameIn, strerror(ferror(fileIn)));
+		free(header->chunkTags);
+		header->chunkTags = NULL;
+		return 0;
+	}
+	if (header->nbChunks && !Process_MT(ctx, header->chunkTags, header->chunkTags, (size_t)(16 * header->nbChunks), 0))
+	{
+		free(header->chunkTags);
+		header->chunkTags = NULL;
+		return 0;
+	}
 
-	MakeTransfo(tmp, out, GetPartialInvertedKeys(i));
+	return 1;
 }
 
+//Same, read once from its start, up to the data. The name is skipped.
+static int ReadStreamHeader(IdeaContext *ctx, FILE *fileIn, FileHeader *header)
+{
+	Uint16 keySha[16];
+	Uint16 c = 0;
+	Uint8 name[256];
+	size_t n;
+	int valid;
+
+	memset(header, 0, sizeof(FileHeader));
+	valid = fread(keySha, 1, 32, fileIn) == 32 && fread(header->checkSum, 1, 16, fileIn) == 16
+			&& fread(&header->flags, 1, 1, fileIn) == 1 && fread(&c, 1, 2, fileIn) == 2;
+	for ( ; valid && c ; c -= n)
+	{
+		n = c < sizeof(name) ? c : sizeof(name);
+		valid = fread(name, 1, n, fileIn) == n;
+	}
+	if (!valid)
+	{
+		if (feof(fileIn))
+			LogMessage(ctx, "The input stream is not a valid stream.\n");
+		else
+			LogMessage(ctx, "An error occurred during reading header from the input stream: %s\n", strerror(ferror(fileIn)));
+		return 0;
+	}
+	if (memcmp(keySha, ctx->keySha, 32))
+	{
+		LogMessage(ctx, "Wrong password for the input stream, or not a valid stream.\n");
+		return 0;
+	}
+
+	if (header->flags & ~(FILE_KNOWN_FLAGS | FILE_PADDING_MASK))
+	{
+		LogMessage(ctx, "The input stream uses options that this version does not support.\n");
+		return 0;
+	}
+	if (!(header->flags & FILE_FLAG_STREAM) || (header->flags & (FILE_PADDING_MASK | FILE_FLAG_CHUNKED))
+			|| (header->flags & FILE_NONCE_FLAGS) == FILE_NONCE_FLAGS)
+	{
+		LogMessage(ctx, "The input stream is not a valid stream. An encrypted file is decrypted as a file.\n");
+		return 0;
+	}
+
+	if ((header->flags & FILE_NONCE_FLAGS) && fread(&header->nonce, 8, 1, fileIn) != 1)
+	{
+		LogMessage(ctx, "The input stream is not a valid stream.\n");
+		return 0;
+	}
+
+	return 1;
+}
 
-void SetMainKey(const Uint16 *partialKeys0)
+//The chunks [first, last[, reported one by one. Returns how many are corrupted.
+static Uint64 CheckChunkTags(IdeaContext *ctx, const FileHeader *header, const Uint16 *chunkTags, Uint64 first, Uint64 last,
+		const char *fileNameIn)
 {
-	int i, k=0, r;
-	Uint16 partialKeys[8] = {0};
+	Uint64 k, end, n = 0;
 
-	memcpy(partialKeys, partialKeys0, sizeof(Uint16)*8);
-	for (r=0 ; r < 9 ; r++)
+	for (k=first ; k < last ; k++)
 	{
-		for (i=0 ; i < 6 ; i++)
+		if (memcmp(&(chunkTags[k*8]), &(header->chunkTags[k*8]), 16))
 		{
-			if (k % 8 == 0 && k > 0)
-			{
-				ShiftKey(partialKeys);
-				k = 0;
-			}
-			mainPartialKeys[r][i] = partialKeys[k];
-			if (i == 2 || i == 1)
-			{
-				if (r >= 1 && r <= 7)
-					mainPartialInvertedKeys[8-r][i==2 ? 1 : 2] = ModuloAddInv(partialKeys[k]);
-				else
-					mainPartialInvertedKeys[8-r][i] = ModuloAddInv(partialKeys[k]);
-			}
-			else if (i == 4 || i == 5)
-			{
-				if (r > 0)
-					mainPartialInvertedKeys[8-r][i] = mainPartialKeys[r-1][i];
-			}
-			else
-				mainPartialInvertedKeys[8-r][i] = ModuloMultInv(partialKeys[k]);
-			k++;
+			end = (k+1) * header->chunkSize < header->plainSize ? (k+1) * header->chunkSize : header->plainSize;
+			LogMessage(ctx, "The bytes %" PRIu64 " to %" PRIu64 " of the data of %s are corrupted.\n", k * header->chunkSize, end-1, fileNameIn);
+			n++;
 		}
 	}
+
+	return n;
+}
+
+//The tags are encrypted in place
+static int WriteChunkIndex(IdeaContext *ctx, FILE *fileOut, Uint16 *chunkTags, Uint64 nbChunks, Uint64 plainSize)
+{
+	Sint64 indexOffset = GetFilePosition(fileOut);
+
+	if (nbChunks && !Process_MT(ctx, chunkTags, chunkTags, (size_t)(16 * nbChunks), 1))
+		return 0;
+	return indexOffset >= 0 && fwrite(chunkTags, 16, (size_t)nbChunks, fileOut) == nbChunks
+			&& fwrite(&indexOffset, 8, 1, fileOut) == 1 && fwrite(&plainSize, 8, 1, fileOut) == 1;
+}
+
+//"uring", "mmap", "stdio" or "direct", anything else lets the pipeline choose
+static int GetIoEngine(const char *name)
+{
+	if (!name)
+		return IO_ENGINE_AUTO;
+	if (!strcmp(name, "uring"))
+		return IO_ENGINE_URING;
+	if (!strcmp(name, "mmap"))
+		return IO_ENGINE_MMAP;
+	if (!strcmp(name, "stdio"))
+		return IO_ENGINE_STDIO;
+	if (!strcmp(name, "direct"))
+		return IO_ENGINE_DIRECT;
+	return IO_ENGINE_AUTO;
+}
+
+//Counter blocks are big-endian in words
+static void SetCounterBlock(Uint16 *block, Uint64 counter)
+{
+	block[0] = (Uint16)(counter >> 48);
+	block[1] = (Uint16)(counter >> 32);
+	block[2] = (Uint16)(counter >> 16);
+	block[3] = (Uint16)counter;
 }
 
+//From the system's cryptographic random generator
+static int GetRandomBytes(void *buf, size_t size)
+{
+#ifdef WIN32
+	HCRYPTPROV prov;
+	int r;
+
+	if (!CryptAcquireContext(&prov, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT))
+		return 0;
+	r = CryptGenRandom(prov, (DWORD)size, (BYTE*)buf) != 0;
+	CryptReleaseContext(prov, 0);
+	return r;
+#else
+	FILE *file = fopen("/dev/urandom", "rb");
+	int r;
+
+	if (!file)
+		return 0;
+	r = fread(buf, 1, size, file) == size;
+	fclose(file);
+	return r;
+#endif
+}
+
+void Encrypt(IdeaContext *ctx, const Uint16 *in, Uint16 *out)
+{
+	ProcessBlock(in, out, &(ctx->partialKeys[0][0]));
+}
+
+void Decrypt(IdeaContext *ctx, const Uint16 *in, Uint16 *out)
+{
+	ProcessBlock(in, out, &(ctx->partialInvertedKeys[0][0]));
+}
+
+
 static void ShiftKey(Uint16 *partialKeys)
 {
 	int i;
@@ -595,14 +1452,17 @@ static void ShiftKey(Uint16 *partialKeys)
 	partialKeys[7] = (partialKeys[7] << 9) + pKey;
 }
 
-static const Uint16* GetPartialKeys(unsigned int roundNum)
+static void ProcessBlock(const Uint16 *in, Uint16 *out, const Uint16 *keys)
 {
-	return mainPartialKeys[roundNum];
-}
+	int i;
+	Uint16 tmp[4] = {0};
 
-static const Uint16* GetPartialInvertedKeys(unsigned int roundNum)
-{
-	return mainPartialInvertedKeys[roundNum];
+	memcpy(tmp, in, sizeof(Uint16) * 4);
+
+	for (i=0 ; i < 8 ; i++)
+		MakeRound(tmp, tmp, &(keys[i*6]));
+
+	MakeTransfo(tmp, out, &(keys[i*6]));
 }
 
 
@@ -685,26 +1545,21 @@ static Uint16 ModuloAddInv(Uint16 x)
 }
 
 
-int ComputeMD5(const char *in0, Uint16 *out, size_t l)
+int ComputeMD5(const char *in, Uint16 *out, size_t l)
 {
-	MD5_CTX mdContext = {{0}};
-	unsigned char *in = malloc(l);
-	if (!in)
-		return 0;
-	memcpy(in, in0, l);
+	MD5_CTX mdContext;
 
 	MD5Init(&mdContext);
-	MD5Update(&mdContext, in, l);
+	MD5Update(&mdContext, (const unsigned char*)in, l);
 	MD5Final(&mdContext);
 
 	memcpy(out, mdContext.digest, sizeof(char)*16);
-	free(in);
 	return 1;
 }
 
 int ComputeSHA256(const char *in0, Uint16 *out, size_t l)
 {
-	sha256_context shaContext = {{0}};
+	sha256_context shaContext;
 	Uint8 tabOut[32] = {0};
 	uint8 *in = malloc(l);
 	if (!in)
@@ -736,29 +1591,72 @@ int ComputeSHAThenMD5(const char *in, Uint16 *out)
 	return 1;
 }
 
-int ComputeFileMD5Checksum(FILE *file, Uint16 *checkSum)
+int ComputeFileMD5Checksum(IdeaContext *ctx, FILE *file, Uint16 *checkSum)
 {
 	size_t n = 0;
-	long int t;
-	MD5_CTX mdContext = {{0}};
+	Sint64 t;
+	MD5_CTX mdContext;
 
 	MD5Init(&mdContext);
-	t = ftell(file);
+	t = GetFilePosition(file);
 	rewind(file);
 
-	while ((n = fread(mainDataBuf, 1, DATA_BUF_SIZE, file)) > 0)
-		MD5Update(&mdContext, (unsigned char*)mainDataBuf, n);
+	while ((n = fread(ctx->dataBuf, 1, ctx->dataBufSize, file)) > 0)
+		MD5Update(&mdContext, (const unsigned char*)ctx->dataBuf, n);
 
 	if (!feof(file))
 	{
-		printf("An error occurred while reading from file 0x%x: %s\n", (unsigned int)file, strerror(ferror(file)));
-		fseek(file, t, SEEK_SET);
+		LogMessage(ctx, "An error occurred while reading from file %p: %s\n", (void*)file, strerror(ferror(file)));
+		SetFilePosition(file, t, SEEK_SET);
 		return 0;
 	}
-	fseek(file, t, SEEK_SET);
+	SetFilePosition(file, t, SEEK_SET);
 
 	MD5Final(&mdContext);
 	memcpy(checkSum, mdContext.digest, sizeof(char)*16);
 	return 1;
 }
 
+//Same as the pipeline with HASH_TREE, the leaves of each buffer hashed in the lanes of the MD5 kernel
+int ComputeFileTreeChecksum(IdeaContext *ctx, FILE *file, Uint16 *checkSum)
+{
+	size_t n = 0, i, j, nbLeaves = ctx->dataBufSize / TREE_HASH_LEAF_SIZE;
+	Sint64 t;
+	MD5_CTX mdContext;
+	MD5Stream *leaves = malloc(sizeof(MD5Stream) * nbLeaves);
+
+	if (!leaves)
+	{
+		LogMessage(ctx, "Unable to allocate the tree hash buffers.\n");
+		return 0;
+	}
+	MD5Init(&mdContext);
+	t = GetFilePosition(file);
+	rewind(file);
+
+	//The buffer is filled up to its end but for the last one, so the leaves are those of the file
+	while ((n = fread(ctx->dataBuf, 1, ctx->dataBufSize, file)) > 0)
+	{
+		for (i=0 ; i*TREE_HASH_LEAF_SIZE < n ; i++)
+		{
+			leaves[i].data = (const unsigned char*)ctx->dataBuf + i*TREE_HASH_LEAF_SIZE;
+			leaves[i].size = n - i*TREE_HASH_LEAF_SIZE < TREE_HASH_LEAF_SIZE ? n - i*TREE_HASH_LEAF_SIZE : TREE_HASH_LEAF_SIZE;
+		}
+		ComputeMD5Streams(leaves, i);
+		for (j=0 ; j < i ; j++)
+			MD5Update(&mdContext, leaves[j].digest, 16);
+	}
+	free(leaves);
+
+	if (!feof(file))
+	{
+		LogMessage(ctx, "An error occurred while reading from file %p: %s\n", (void*)file, strerror(ferror(file)));
+		SetFilePosition(file, t, SEEK_SET);
+		return 0;
+	}
+	SetFilePosition(file, t, SEEK_SET);
+
+	MD5Final(&mdContext);
+	memcpy(checkSum, mdContext.digest, sizeof(char)*16);
+	return 1;
+}
@@ -32,26 +32,108 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "sha256.h"
 #include "utility.h"
 
+typedef int64_t Sint64;
 typedef int32_t Sint32;
 typedef uint32_t Uint32;
 typedef uint16_t Uint16;
 typedef uint8_t Uint8;
+typedef uint64_t Uint64;
 
-int EncryptString(const char *string, Uint16 *out, int md5Only);
-int DecryptString(Uint16 *string, int n, char *out);
-int EncryptFile(const char *fileNameIn, const char *fileNameOut, const Uint16 *keySha);
-int DecryptFile(const char *fileNameIn, const char *fileNameOut, const Uint16 *keySha);
-int DecryptFileName(const char *fileNameIn, char **fileNameOut, const Uint16 *keySha0);
-int Process_MT(const Uint16 *in, Uint16 *out, size_t size, int encrypt);
-void Encrypt(const Uint16 *in, Uint16 *out);
-void Decrypt(const Uint16 *in, Uint16 *out);
+#define TREE_HASH_LEAF_SIZE		65536		//Bytes of plain data per leaf of the tree checksum
+#define CBC_SEGMENT_SIZE		4096		//Bytes chained from the same IV in CBC mode
+#define SLICES_PER_THREAD		4			//Slices of a buffer per thread of the pool, for the work stealing
 
-void SetMainKey(const Uint16 *partialKeys);
+//Stored with the padding in the header of the encrypted files
+#define FILE_PADDING_MASK		0x07
+#define FILE_FLAG_STREAM		0x08		//Written as a stream, see below
+#define FILE_FLAG_TREE_HASH		0x10		//The checksum is the MD5 of the MD5s of the leaves
+#define FILE_FLAG_CTR			0x20		//Counter mode, with a nonce after the name and no padding
+#define FILE_FLAG_CBC			0x40		//CBC mode by segments, with a nonce after the name
+#define FILE_FLAG_CHUNKED		0x80		//Format v2, see below. Implies FILE_FLAG_TREE_HASH.
+#define FILE_KNOWN_FLAGS		(FILE_FLAG_STREAM | FILE_FLAG_TREE_HASH | FILE_FLAG_CTR | FILE_FLAG_CBC | FILE_FLAG_CHUNKED)
+#define FILE_NONCE_FLAGS		(FILE_FLAG_CTR | FILE_FLAG_CBC)
+
+//The chunked files (v2) have the format version (1 byte) and the chunk size (4 bytes) after
+//the nonce. Their data is cut into chunks of that many plain bytes, each of which can be
+//decrypted on its own, and checked against its tag: the MD5 of its number (8 bytes) and of
+//the MD5s of its leaves, encrypted. The tags of all the chunks follow the data, then the
+//offset of the first one in the file and the size of the plain data (8 bytes each).
+#define FILE_FORMAT_VERSION		2
+#define FILE_CHUNK_SIZE			1048576		//Default, multiple of TREE_HASH_LEAF_SIZE
+#define FILE_INDEX_FOOTER_SIZE	16
+
+//The streams are written and read in one pass, without knowing their size beforehand.
+//Their header has no padding and a zero checksum, and their data, padded to whole blocks
+//in all the modes, is followed by a trailer: the size of the plain data (8 bytes), then the
+//checksum. They are never chunked.
+#define FILE_TRAILER_SIZE		24
+
+//How the big files are read and written, set from IDEA_IO
+#define IO_ENGINE_AUTO		0	//The first of the following available
+#define IO_ENGINE_URING		1	//Queued reads and writes, Linux only
+#define IO_ENGINE_MMAP		2	//Memory-mapped files
+#define IO_ENGINE_STDIO		3	//Reader and writer threads
+#define IO_ENGINE_DIRECT	4	//Same, around the system cache. Never chosen automatically.
+
+//Everything needed to process data with one key. A context is used by one thread
+//at a time, but any number of contexts (and keys) can be used concurrently.
+typedef struct
+{
+	Uint16 partialKeys[9][6];
+	Uint16 partialInvertedKeys[9][6];
+	Uint16 keySha[16];				//Written in the header of the encrypted files
+	Uint16 *dataBuf;				//Working buffers for the file functions, one after the other
+	size_t dataBufSize;				//Bytes per buffer, multiple of TREE_HASH_LEAF_SIZE
+	int nbDataBufs;
+	size_t minJobBlocks;			//Blocks per slice at least, when a buffer is spread over the threads
+	Uint8 fileFlags;				//FILE_FLAG_xxx options used by EncryptFile
+	int ioEngine;					//IO_ENGINE_xxx used for the big files
+	int queueDepth;					//Reads and writes in flight with io_uring
+	int bufferLog;					//The messages of the functions below go to log instead of the console
+	char *log;
+	size_t logLength, logSize;
+} IdeaContext;
+
+int InitIdeaContext(IdeaContext *ctx, const Uint16 *partialKeys);
+int CloneIdeaContext(IdeaContext *ctx, const IdeaContext *src);
+void FreeIdeaContext(IdeaContext *ctx);
+//Reallocates the buffers. size must be a multiple of TREE_HASH_LEAF_SIZE.
+int SetIdeaBufferSize(IdeaContext *ctx, size_t size);
+void LogMessage(IdeaContext *ctx, const char *format, ...);
+char* TakeLog(IdeaContext *ctx);
+
+int EncryptString(IdeaContext *ctx, const char *string, Uint16 *out, int md5Only);
+int DecryptString(IdeaContext *ctx, Uint16 *string, int n, char *out);
+int EncryptFile(IdeaContext *ctx, const char *fileNameIn, const char *fileNameOut);
+int DecryptFile(IdeaContext *ctx, const char *fileNameIn, const char *fileNameOut);
+//Decrypts the plain bytes [start, end[ only, reading the blocks that hold them and no other.
+//end may be past the end of the data.
+int DecryptFileRange(IdeaContext *ctx, const char *fileNameIn, const char *fileNameOut, Uint64 start, Uint64 end);
+//Standard input to standard output, or any other pipes
+int EncryptStream(IdeaContext *ctx, FILE *fileIn, FILE *fileOut);
+int DecryptStream(IdeaContext *ctx, FILE *fileIn, FILE *fileOut);
+int DecryptFileName(IdeaContext *ctx, const char *fileNameIn, char **fileNameOut);
+int Process_MT(IdeaContext *ctx, const Uint16 *in, Uint16 *out, size_t size, int encrypt);
+int ProcessCTR_MT(IdeaContext *ctx, const Uint16 *in, Uint16 *out, size_t size, Uint64 nonce, Uint64 firstBlock);
+int ProcessCBC_MT(IdeaContext *ctx, const Uint16 *in, Uint16 *out, size_t size, Uint64 nonce, Uint64 firstBlock,
+		int encrypt);
+int GenerateNonce(IdeaContext *ctx, Uint64 *nonce);
+//Checks the counter and CBC modes against the scalar cipher far into the data.
+//Prints what is wrong, returns 0 then.
+int CheckBlockCounters(void);
+
+//ftell and fseek on 64 bits, the files can be bigger than what a long holds (4 GB and more).
+//GetFilePosition returns -1 on failure. SetFilePosition returns 0 on success, like fseek.
+Sint64 GetFilePosition(FILE *file);
+int SetFilePosition(FILE *file, Sint64 offset, int origin);
+void Encrypt(IdeaContext *ctx, const Uint16 *in, Uint16 *out);
+void Decrypt(IdeaContext *ctx, const Uint16 *in, Uint16 *out);
 
 int ComputeMD5(const char *in, Uint16 *out, size_t l);
 int ComputeSHA256(const char *in, Uint16 *out, size_t l);
 int ComputeSHAThenMD5(const char *in, Uint16 *out);
-int ComputeFileMD5Checksum(FILE *file, Uint16 *checkSum);
+int ComputeFileMD5Checksum(IdeaContext *ctx, FILE *file, Uint16 *checkSum);
+int ComputeFileTreeChecksum(IdeaContext *ctx, FILE *file, Uint16 *checkSum);
 
 
 #endif /* IDEA_H_ */
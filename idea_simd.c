@@ -0,0 +1,285 @@
+/**** LICENSE INFORMATION ****
+IDEA - idea_simd.c
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Multi-block IDEA: 8 (SSE2), 16 (AVX2) or 32 (AVX-512BW) independent blocks
+ * are encrypted at once, one 16-bit lane per block and one vector per word.
+ * The kernels are compiled with per-function target attributes, so the rest
+ * of the program does not need any -m flag, and the best one is picked once
+ * at startup from CPUID. */
+
+#include "idea_simd.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define IDEA_SIMD_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#if __GNUC__ >= 5
+#define IDEA_SIMD_AVX512
+#endif
+#define IDEA_TARGET(t)		__attribute__((target(t)))
+#endif
+
+typedef size_t (*IdeaKernel)(const Uint16 *in, Uint16 *out, size_t nbBlocks, const Uint16 *keys);
+
+typedef struct
+{
+	const char *name;
+	int width;			//Blocks per pass
+	unsigned int cpuFeatures;
+	IdeaKernel kernel;
+} IdeaKernelDesc;
+
+static void SelectIdeaKernel(void);
+
+
+#ifdef IDEA_SIMD_X86
+
+/* Same dataflow as MakeRound in idea.c, on whole vectors of words */
+#define IDEA_ROUND(ADD, XOR, MUL, x0, x1, x2, x3, k) \
+  { \
+	a1 = MUL(x0, (k)[0]); \
+	a2 = ADD(x2, (k)[2]); \
+	a3 = ADD(x1, (k)[1]); \
+	a4 = MUL(x3, (k)[3]); \
+	a5 = MUL((k)[4], XOR(a1, a2)); \
+	a6 = MUL((k)[5], ADD(a5, XOR(a3, a4))); \
+	a5 = ADD(a5, a6); \
+	x0 = XOR(a1, a6); \
+	x1 = XOR(a6, a2); \
+	x2 = XOR(a3, a5); \
+	x3 = XOR(a5, a4); \
+  }
+
+/* Turns 4 vectors of whole blocks into 4 vectors of words (x0 = first words, etc.).
+ * The unpacks work inside 128-bit lanes, so wider vectors end up with the blocks
+ * permuted across lanes; IDEA_UNTRANSPOSE undoes exactly the same permutation. */
+#define IDEA_TRANSPOSE(P, x0, x1, x2, x3) \
+  { \
+	t0 = P##_unpacklo_epi16(x0, x1); \
+	t1 = P##_unpackhi_epi16(x0, x1); \
+	t2 = P##_unpacklo_epi16(x2, x3); \
+	t3 = P##_unpackhi_epi16(x2, x3); \
+	x0 = P##_unpacklo_epi16(t0, t1); \
+	x1 = P##_unpackhi_epi16(t0, t1); \
+	x2 = P##_unpacklo_epi16(t2, t3); \
+	x3 = P##_unpackhi_epi16(t2, t3); \
+	t0 = P##_unpacklo_epi64(x0, x2); \
+	t1 = P##_unpackhi_epi64(x0, x2); \
+	t2 = P##_unpacklo_epi64(x1, x3); \
+	t3 = P##_unpackhi_epi64(x1, x3); \
+	x0 = t0; x1 = t1; x2 = t2; x3 = t3; \
+  }
+
+#define IDEA_UNTRANSPOSE(P, x0, x1, x2, x3) \
+  { \
+	t0 = P##_unpacklo_epi64(x0, x1); \
+	t2 = P##_unpackhi_epi64(x0, x1); \
+	t1 = P##_unpacklo_epi64(x2, x3); \
+	t3 = P##_unpackhi_epi64(x2, x3); \
+	x0 = P##_unpacklo_epi16(t0, t1); \
+	x1 = P##_unpackhi_epi16(t0, t1); \
+	x2 = P##_unpacklo_epi16(t2, t3); \
+	x3 = P##_unpackhi_epi16(t2, t3); \
+	t0 = P##_unpacklo_epi16(x0, x1); \
+	t1 = P##_unpackhi_epi16(x0, x1); \
+	t2 = P##_unpacklo_epi16(x2, x3); \
+	t3 = P##_unpackhi_epi16(x2, x3); \
+	x0 = t0; x1 = t1; x2 = t2; x3 = t3; \
+  }
+
+/* Defines a kernel for one vector type. P is the intrinsics prefix (_mm, _mm256, _mm512)
+ * and SI the integer vector suffix (si128, si256, si512). */
+#define IDEA_DEFINE_KERNEL(NAME, TARGET, VEC, P, SI, MUL) \
+IDEA_TARGET(TARGET) \
+static size_t NAME(const Uint16 *in, Uint16 *out, size_t nbBlocks, const Uint16 *keys) \
+{ \
+	const size_t width = 4 * sizeof(VEC) / 8; \
+	VEC k[52], x0, x1, x2, x3, t0, t1, t2, t3, a1, a2, a3, a4, a5, a6; \
+	size_t i; \
+	int r; \
+	\
+	for (r=0 ; r < 52 ; r++) \
+		k[r] = P##_set1_epi16((short)keys[r]); \
+	\
+	for (i=0 ; i + width <= nbBlocks ; i += width) \
+	{ \
+		const VEC *pIn = (const VEC*)&(in[i*4]); \
+		VEC *pOut = (VEC*)&(out[i*4]); \
+		\
+		x0 = P##_loadu_##SI(&(pIn[0])); \
+		x1 = P##_loadu_##SI(&(pIn[1])); \
+		x2 = P##_loadu_##SI(&(pIn[2])); \
+		x3 = P##_loadu_##SI(&(pIn[3])); \
+		IDEA_TRANSPOSE(P, x0, x1, x2, x3); \
+		\
+		for (r=0 ; r < 8 ; r++) \
+			IDEA_ROUND(P##_add_epi16, P##_xor_##SI, MUL, x0, x1, x2, x3, &(k[r*6])); \
+		\
+		a1 = MUL(k[48], x0); \
+		a2 = P##_add_epi16(x2, k[49]); \
+		a3 = P##_add_epi16(x1, k[50]); \
+		a4 = MUL(k[51], x3); \
+		IDEA_UNTRANSPOSE(P, a1, a2, a3, a4); \
+		\
+		P##_storeu_##SI(&(pOut[0]), a1); \
+		P##_storeu_##SI(&(pOut[1]), a2); \
+		P##_storeu_##SI(&(pOut[2]), a3); \
+		P##_storeu_##SI(&(pOut[3]), a4); \
+	} \
+	\
+	return i; \
+}
+
+/* Multiplication modulo 2^16+1, 0 standing for 2^16 (see ModuloMult in idea.c).
+ * For non-zero operands, with p = hi*2^16 + lo, the result is lo - hi (+1 if lo < hi).
+ * If one operand is 0, the result is 1 - a - b, which also covers 0 * 0 = 1. */
+IDEA_TARGET("sse2")
+static inline __m128i ModuloMult_SSE2(__m128i a, __m128i b)
+{
+	const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi16(1);
+	__m128i lo = _mm_mullo_epi16(a, b);
+	__m128i hi = _mm_mulhi_epu16(a, b);
+	__m128i ge = _mm_cmpeq_epi16(_mm_subs_epu16(hi, lo), zero);
+	__m128i r = _mm_add_epi16(_mm_sub_epi16(lo, hi), _mm_add_epi16(ge, one));
+	__m128i z = _mm_cmpeq_epi16(_mm_or_si128(lo, hi), zero);
+
+	return _mm_or_si128(_mm_and_si128(z, _mm_sub_epi16(_mm_sub_epi16(one, a), b)), _mm_andnot_si128(z, r));
+}
+
+IDEA_TARGET("avx2")
+static inline __m256i ModuloMult_AVX2(__m256i a, __m256i b)
+{
+	const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi16(1);
+	__m256i lo = _mm256_mullo_epi16(a, b);
+	__m256i hi = _mm256_mulhi_epu16(a, b);
+	__m256i ge = _mm256_cmpeq_epi16(_mm256_subs_epu16(hi, lo), zero);
+	__m256i r = _mm256_add_epi16(_mm256_sub_epi16(lo, hi), _mm256_add_epi16(ge, one));
+	__m256i z = _mm256_cmpeq_epi16(_mm256_or_si256(lo, hi), zero);
+
+	return _mm256_blendv_epi8(r, _mm256_sub_epi16(_mm256_sub_epi16(one, a), b), z);
+}
+
+IDEA_DEFINE_KERNEL(ProcessBlocks_SSE2, "sse2", __m128i, _mm, si128, ModuloMult_SSE2)
+IDEA_DEFINE_KERNEL(ProcessBlocks_AVX2, "avx2", __m256i, _mm256, si256, ModuloMult_AVX2)
+
+#ifdef IDEA_SIMD_AVX512
+
+IDEA_TARGET("avx512f,avx512bw")
+static inline __m512i ModuloMult_AVX512(__m512i a, __m512i b)
+{
+	const __m512i zero = _mm512_setzero_si512(), one = _mm512_set1_epi16(1);
+	__m512i lo = _mm512_mullo_epi16(a, b);
+	__m512i hi = _mm512_mulhi_epu16(a, b);
+	__m512i r = _mm512_sub_epi16(lo, hi);
+	__mmask32 lt = _mm512_cmplt_epu16_mask(lo, hi);
+	__mmask32 z = _mm512_cmpeq_epi16_mask(_mm512_or_si512(lo, hi), zero);
+
+	r = _mm512_mask_add_epi16(r, lt, r, one);
+	return _mm512_mask_sub_epi16(r, z, _mm512_sub_epi16(one, a), b);
+}
+
+IDEA_DEFINE_KERNEL(ProcessBlocks_AVX512, "avx512f,avx512bw", __m512i, _mm512, si512, ModuloMult_AVX512)
+
+#endif	//IDEA_SIMD_AVX512
+
+#endif	//IDEA_SIMD_X86
+
+
+//Best first
+static const IdeaKernelDesc ideaKernels[] =
+{
+#ifdef IDEA_SIMD_X86
+#ifdef IDEA_SIMD_AVX512
+	{"avx512bw", 32, CPU_AVX512BW, ProcessBlocks_AVX512},
+#endif
+	{"avx2", 16, CPU_AVX2, ProcessBlocks_AVX2},
+	{"sse2", 8, CPU_SSE2, ProcessBlocks_SSE2},
+#endif
+	{"scalar", 1, 0, NULL}
+};
+
+static const IdeaKernelDesc *selectedKernel = NULL;
+static pthread_once_t selectedKernelOnce = PTHREAD_ONCE_INIT;
+
+
+size_t ProcessBlocks_SIMD(const Uint16 *in, Uint16 *out, size_t nbBlocks, const Uint16 *keys)
+{
+	pthread_once(&selectedKernelOnce, SelectIdeaKernel);
+	return selectedKernel->kernel ? selectedKernel->kernel(in, out, nbBlocks, keys) : 0;
+}
+
+const char* GetIdeaKernelName(void)
+{
+	pthread_once(&selectedKernelOnce, SelectIdeaKernel);
+	return selectedKernel->name;
+}
+
+int GetIdeaKernelWidth(void)
+{
+	pthread_once(&selectedKernelOnce, SelectIdeaKernel);
+	return selectedKernel->width;
+}
+
+static void SelectIdeaKernel(void)
+{
+	unsigned int features = GetCpuFeatures();
+	const char *forced = getenv("IDEA_KERNEL");
+	int i, n = sizeof(ideaKernels) / sizeof(ideaKernels[0]);
+
+	selectedKernel = &(ideaKernels[n-1]);
+	for (i=0 ; i < n ; i++)
+	{
+		if ((ideaKernels[i].cpuFeatures & features) != ideaKernels[i].cpuFeatures)
+			continue;
+		if (!forced || !strcmp(forced, ideaKernels[i].name))
+		{
+			selectedKernel = &(ideaKernels[i]);
+			break;
+		}
+	}
+}
+
+unsigned int GetCpuFeatures(void)
+{
+	unsigned int features = 0;
+#ifdef IDEA_SIMD_X86
+	unsigned int eax, ebx, ecx, edx, maxLeaf, xcr0 = 0;
+
+	if (!__get_cpuid(0, &maxLeaf, &ebx, &ecx, &edx) || !__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+
+	if (edx & bit_SSE2)
+		features |= CPU_SSE2;
+
+	//The OS must save the YMM/ZMM registers too, not only the CPU support them
+	if (ecx & bit_OSXSAVE)
+		__asm__ __volatile__ ("xgetbv" : "=a"(xcr0), "=d"(edx) : "c"(0));
+
+	if (maxLeaf >= 7)
+	{
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		if ((ebx & bit_AVX2) && (xcr0 & 0x06) == 0x06)
+			features |= CPU_AVX2;
+		if ((ebx & (1 << 16)) && (ebx & (1 << 30)) && (xcr0 & 0xE6) == 0xE6)	//AVX512F + AVX512BW
+			features |= CPU_AVX512BW;
+	}
+#endif
+	return features;
+}
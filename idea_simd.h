@@ -0,0 +1,42 @@
+/**** LICENSE INFORMATION ****
+IDEA - idea_simd.h
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef IDEA_SIMD_H_
+#define IDEA_SIMD_H_
+
+#include "idea.h"
+
+//Returned by GetCpuFeatures, the OS support for the registers is checked too
+#define CPU_SSE2		0x01
+#define CPU_AVX2		0x02
+#define CPU_AVX512BW	0x04		//AVX512F and AVX512BW
+
+//keys points to the 9x6 partial keys of a key schedule (encryption or decryption).
+//Processes as many whole groups of blocks as the selected kernel handles and
+//returns the number of 64-bit blocks done. The caller finishes the remainder.
+size_t ProcessBlocks_SIMD(const Uint16 *in, Uint16 *out, size_t nbBlocks, const Uint16 *keys);
+
+//Kernel chosen at startup (CPUID, or the IDEA_KERNEL environment variable)
+const char* GetIdeaKernelName(void);
+int GetIdeaKernelWidth(void);
+
+unsigned int GetCpuFeatures(void);
+
+#endif /* IDEA_SIMD_H_ */
@@ -25,52 +25,102 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <string.h>
 #include <conio.h>
 #include <ctype.h>
-#include <dirent.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <math.h>
+#ifdef WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <direct.h>
+#else
+#include <unistd.h>
+#endif
 
 #include "utility.h"
 #include "idea.h"
+#include "idea_simd.h"
+#include "md5_simd.h"
+#include "threadpool.h"
+#include "batch.h"
+#include "walker.h"
+#include "tuning.h"
+#include "bufpool.h"
+#include "archive.h"
+#include "manifest.h"
 
 #define _VERSION	"0.1.1"
 
 #define ENCRYPT		1
 #define DECRYPT		2
 
-#define MAX_ENTRIES	10000
-
-typedef __int64	Sint64;
+#ifdef WIN32
+#define MakeDir(path)	_mkdir(path)
+#else
+#define MakeDir(path)	mkdir(path, 0777)
+#endif
 
 static void Purge(void);
 static void Clean(char chaine[]);
 
+static const char* TakeOption(int *argc, char *argv[], const char *name);
+static int TakeFlag(int *argc, char *argv[], const char *name);
+static int ReadRangeOption(int *argc, char *argv[], const char **range, Uint64 *start, Uint64 *end);
+static int DecryptRange(IdeaContext *ctx, const char *fileIn, const char *range, Uint64 start, Uint64 end);
+static int ReadStreamOption(int *argc, char *argv[]);
+static FILE* TakeStdout(void);
+static int NameAfterDir(const char *dir, const char *extension, char *fileName);
+static int PackDirectory(IdeaContext *ctx, const char *dir, int recursive, int autoDelete);
+static int ExtractArchive(IdeaContext *ctx, const char *fileIn, const char *member);
+static int IsSafeMemberName(const char *name);
+static void MakeParentDirs(char *path);
+static void PrintSummary(int count, int nbFails, Sint64 totalSize, clock_t t);
+
 static int CheckDirOrFile(const char *fullAddr);
 static Sint64 GetFileSize(const char *fullAddr);
-static int ListDirectory(const char *dirAddr, int listSubDirs, char **addrLists, int max, Sint64 *size);
 
-static void FreeStrTab(char **strTab, int num);
 static void Wait();
 
 static int IsLittleEndian();
 
 
-int main(void)
+int main(int argc, char *argv[])
 {
 	char passwd[MAX_STR] = "", addr[MAX_PATH]="";
-	char *addrLists[MAX_ENTRIES] = {NULL};
-	char fileOutAddr[MAX_PATH+1] = "";
+	char fileOutAddr[MAX_PATH+1] = "", manifestAddr[MAX_PATH+1] = "";
 	char *p = NULL;
-	Uint16 partialKeys[8] = {0}, keySha[16] = {0};
-	int i, ok = 0, r = 0, count = 0, nbFails = 0;
-	int autoOverwrite = 0, autoDelete = 0, encryptName = 0;
-	int mode = 0;
+	const char *fileIn = NULL, *range = NULL, *member = NULL;
+	FILE *streamOut = NULL;
+	Uint16 partialKeys[8] = {0};
+	IdeaContext ctx;
+	Batch batch;
+	DirWalker walker;
+	Manifest manifest;
+	FileStamp stamp;
+	Tuning tuning;
+	int ok = 0, r = 0, count = 0, nbFails = 0, nbFileWorkers = 0, listDir = 0, listSubDirs = 0, err = 0;
+	int autoOverwrite = 0, autoDelete = 0, encryptName = 0, overwrite = 0, archive = 0, incremental = 0, known = 0;
+	int mode = 0, stream = 0, selfTest = 0;
 	Sint64 totalSize = 0;
+	Uint64 rangeStart = 0, rangeEnd = 0;
 	clock_t t;
-	double delay;
 
-	atexit(Wait);
+	//A stream takes the standard input and output: the messages go to the standard error,
+	//and nothing is asked
+	stream = ReadStreamOption(&argc, argv);
+	selfTest = TakeFlag(&argc, argv, "self-test");
+	if (stream > 0)
+	{
+		if (!(streamOut = TakeStdout()))
+		{
+			fprintf(stderr, "Unable to set up the standard output: %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+	else if (!selfTest)
+		atexit(Wait);
+	if (stream < 0)
+		return EXIT_FAILURE;
 
 	printf("Welcome on the IDEA project.\nAuthor: cokie\nLast build: %s\nVersion: %s\n\n", __DATE__, _VERSION);
 	if (!IsLittleEndian())
@@ -79,29 +129,95 @@ int main(void)
 		printf("Unfortunately, this program is not compatible with this convention yet,\nso we have to leave.\n\n");
 		return EXIT_SUCCESS;
 	}
+	member = TakeOption(&argc, argv, "member");
+	if (!ReadRangeOption(&argc, argv, &range, &rangeStart, &rangeEnd) || !ReadTuningOptions(&tuning, argc, argv))
+		return EXIT_FAILURE;
 
-	printf("Do you want to encrypt [1], decrypt [2], or leave [3]? (1/2/3): ");
-	switch (EnterChar("123"))
+	//Checks the counters past 2^32 blocks, which no test file can reach, without a password or any question
+	if (selfTest)
 	{
-		case '1':
-			mode = ENCRYPT;
-			break;
-		case '2':
-			mode = DECRYPT;
-			break;
-		default:
-			printf("\n");
-			return EXIT_SUCCESS;
+		StartThreadPool(tuning.nbThreads);
+		r = CheckBlockCounters();
+		printf(r ? "Self test passed.\n" : "Self test failed.\n");
+		StopThreadPool();
+		FreeBufferPool();
+		return r ? EXIT_SUCCESS : EXIT_FAILURE;
 	}
 
-	printf(mode == ENCRYPT ? "\nPlease choose a password:\n" : "\nPlease enter your password:\n");
-	GetText(passwd, MAX_STR);
+	if (stream)
+		mode = stream;
+	else
+	{
+		printf("Do you want to encrypt [1], decrypt [2], or leave [3]? (1/2/3): ");
+		switch (EnterChar("123"))
+		{
+			case '1':
+				mode = ENCRYPT;
+				break;
+			case '2':
+				mode = DECRYPT;
+				break;
+			default:
+				printf("\n");
+				return EXIT_SUCCESS;
+		}
+	}
+	if (range && (mode != DECRYPT || stream))
+	{
+		printf("The --range option only applies to the decryption of a file.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (stream)
+	{
+		if (!getenv("IDEA_PASSWORD"))
+		{
+			printf("The password of a stream is taken from the environment variable IDEA_PASSWORD.\n");
+			return EXIT_FAILURE;
+		}
+		strncpy(passwd, getenv("IDEA_PASSWORD"), MAX_STR-1);
+	}
+	else
+	{
+		printf(mode == ENCRYPT ? "\nPlease choose a password:\n" : "\nPlease enter your password:\n");
+		GetText(passwd, MAX_STR);
+	}
 	ComputeSHAThenMD5(passwd, partialKeys);
-	ComputeSHA256((char*)partialKeys, keySha, 16);
 	printf("Key: %04x %04x %04x %04x %04x %04x %04x %04x\n", partialKeys[0], partialKeys[1], partialKeys[2], partialKeys[3],
 			partialKeys[4], partialKeys[5], partialKeys[6], partialKeys[7]);
+	printf("Cipher kernel: %s (%d blocks per pass)\n", GetIdeaKernelName(), GetIdeaKernelWidth());
+	printf("Hash kernel: %s (%d messages per pass)\n", GetMD5KernelName(), GetMD5KernelWidth());
+
+	if (!InitIdeaContext(&ctx, partialKeys))
+		return EXIT_FAILURE;
+	DetectHardware(&tuning);
+	StartThreadPool(tuning.nbThreads);
+	printf("Worker threads: %d\n", GetThreadPoolSize());
+	if (!TuneIdeaContext(&tuning, &ctx))
+	{
+		FreeIdeaContext(&ctx);
+		StopThreadPool();
+		FreeBufferPool();
+		return EXIT_FAILURE;
+	}
+	printf("Buffers: %d KB, split by %d blocks at least (cipher: %.1f ns per block, job: %.0f ns)\n",
+			(int)(ctx.dataBufSize / 1024), (int)ctx.minJobBlocks, tuning.blockTime, tuning.jobTime);
 
-	SetMainKey(partialKeys);
+	//The counter mode and the tree hash: no block waits for the one before
+	if (stream)
+	{
+		ctx.fileFlags = FILE_FLAG_CTR | FILE_FLAG_TREE_HASH;
+		r = mode == ENCRYPT ? EncryptStream(&ctx, stdin, streamOut) : DecryptStream(&ctx, stdin, streamOut);
+		if (fclose(streamOut) && r)
+		{
+			printf("An error occurred during writing to the standard output: %s\n", strerror(errno));
+			r = 0;
+		}
+		FreeIdeaContext(&ctx);
+		StopThreadPool();
+		FreeBufferPool();
+		return r ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
 
 	while (!ok)
 	{
@@ -113,26 +229,24 @@ int main(void)
 				printf("The specified file / directory does not exist or cannot be reached.\n");
 				break;
 			case 1:
+				if (range)
+				{
+					printf("A range can only be decrypted from a file.\n");
+					break;
+				}
 				printf("Do you want to process files in the subdirectories too? (y/n): ");
-				r = toupper(EnterChar("yYnN")) == 'Y';
-
-				printf("\nListing in progress, please wait...\n");
-				count = ListDirectory(addr, r, addrLists, MAX_ENTRIES, &totalSize);
-				if (count < 0)
+				listSubDirs = toupper(EnterChar("yYnN")) == 'Y';
+				listDir = ok = 1;
+				if (mode == ENCRYPT)
 				{
-					printf("An error occurred during the listing: %s\nExiting now.\n", strerror(errno));
-					FreeStrTab(addrLists, MAX_ENTRIES);
-					return EXIT_FAILURE;
+					printf("Do you want to pack the files into one archive, next to the directory (added to if it exists)? (y/n): ");
+					archive = toupper(EnterChar("yYnN")) == 'Y';
 				}
-				printf("Done. %d entries found, %.2f MB.\n", count, totalSize / pow(2,20));
-
-				ok = count > 0;
 				break;
 			case 2:
 				ok = 1;
-				addrLists[0] = malloc(sizeof(char) * MAX_PATH);
-				strcpy(addrLists[0], addr);
-				count = 1;
+				totalSize = GetFileSize(addr);
+				archive = mode == DECRYPT && !range && IsArchiveFile(addr);
 				break;
 			default:
 				printf("An error occurred: %s\n", strerror(errno));
@@ -140,59 +254,177 @@ int main(void)
 		}
 	}
 
+	if (range)
+	{
+		r = DecryptRange(&ctx, addr, range, rangeStart, rangeEnd);
+		FreeIdeaContext(&ctx);
+		StopThreadPool();
+		FreeBufferPool();
+		return r ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	//An archive is extracted whole or member by member, without deleting it
+	if ((member && (!archive || mode != DECRYPT)) || (archive && mode == DECRYPT))
+	{
+		if (archive)
+			r = ExtractArchive(&ctx, addr, member);
+		else
+			printf("The --member option only applies to the extraction of an archive.\n");
+		FreeIdeaContext(&ctx);
+		StopThreadPool();
+		FreeBufferPool();
+		return r ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
 	printf("\nDo you want to automatically delete the processed files? (y/n): ");
 	autoDelete = toupper(EnterChar("yYnN")) == 'Y';
 
-	if (mode == ENCRYPT)
+	//The members of an archive are always in counter mode, with the tree hash
+	if (mode == ENCRYPT && !archive)
 	{
 		printf("Do you want to encrypt the files names too? (y/n): ");
 		encryptName = toupper(EnterChar("yYnN")) == 'Y';
+
+		printf("Do you want to use the parallel checksum (faster on big files, not readable by older versions)? (y/n): ");
+		if (toupper(EnterChar("yYnN")) == 'Y')
+			ctx.fileFlags |= FILE_FLAG_TREE_HASH;
+		printf("Cipher mode: 1 - ECB, 2 - CTR (no padding), 3 - CBC. CTR and CBC are not readable by older versions: ");
+		switch (EnterChar("123"))
+		{
+			case '2':
+				ctx.fileFlags |= FILE_FLAG_CTR;
+				break;
+			case '3':
+				ctx.fileFlags |= FILE_FLAG_CBC;
+				break;
+		}
+		printf("Do you want to use the chunked format (each part checked on its own, not readable by older versions)? (y/n): ");
+		if (toupper(EnterChar("yYnN")) == 'Y')
+			ctx.fileFlags |= FILE_FLAG_CHUNKED;
+
+		//The files deleted would all be new again next time
+		if (listDir && !autoDelete)
+		{
+			printf("Do you want to skip the files unchanged since the last run (manifest kept next to the directory)? (y/n): ");
+			incremental = toupper(EnterChar("yYnN")) == 'Y';
+		}
 	}
 
 	printf("\nPress a key to start.\n");
 	getch();
 
-	printf("Starting...\n\n");
+	if (archive)
+	{
+		r = PackDirectory(&ctx, addr, listSubDirs, autoDelete);
+		FreeIdeaContext(&ctx);
+		StopThreadPool();
+		FreeBufferPool();
+		return r ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	//Several small files at a time keep all the cores busy, the big ones share the pool anyway
+	nbFileWorkers = getenv("IDEA_CONCURRENT_FILES") ? atoi(getenv("IDEA_CONCURRENT_FILES")) : GetCpuCount();
+	if (!listDir)
+		nbFileWorkers = 1;
+	if (!StartBatch(&batch, &ctx, nbFileWorkers, mode == ENCRYPT, autoDelete))
+	{
+		FreeIdeaContext(&ctx);
+		StopThreadPool();
+		FreeBufferPool();
+		return EXIT_FAILURE;
+	}
+
+	//The outputs of the files recorded are replaced without asking, they come from the runs before
+	if (incremental)
+	{
+		if (!NameAfterDir(addr, ".crmf", manifestAddr) || !OpenManifest(&manifest, &ctx, manifestAddr, addr,
+				(ctx.fileFlags & FILE_KNOWN_FLAGS) | (encryptName ? MANIFEST_ENCRYPTED_NAMES : 0)))
+		{
+			StopBatch(&batch);
+			FreeIdeaContext(&ctx);
+			StopThreadPool();
+			FreeBufferPool();
+			return EXIT_FAILURE;
+		}
+		batch.manifest = &manifest;
+		printf("Manifest: %s, %d file(s) recorded\n", manifestAddr, (int)manifest.nbEntries);
+	}
+
+	//The files are processed as they are found, while the listing goes on
+	if (listDir && !StartDirWalker(&walker, addr, listSubDirs, 0))
+	{
+		StopBatch(&batch);
+		if (incremental)
+			CloseManifest(&manifest);
+		FreeIdeaContext(&ctx);
+		StopThreadPool();
+		FreeBufferPool();
+		return EXIT_FAILURE;
+	}
+
+	printf("Starting, %d file(s) at a time...\n\n", batch.nbWorkers);
 	t = clock();
 
-	for (i=0 ; i < count ; i++)
+	//The messages of each file are printed in one piece, in order, once it is done
+	ctx.bufferLog = 1;
+	while (1)
 	{
-		printf("Processing file %d of %d...\n", i+1, count);
+		if (listDir)
+			fileIn = GetNextWalkedFile(&walker, &err);
+		else
+			fileIn = count ? NULL : addr;
+		if (!fileIn)
+			break;
+
+		//The outputs of the runs before are in the directory too
+		if (incremental && (p = strrchr(fileIn, '.')) && !strcmp(p, ".crpt"))
+			continue;
+
+		count++;
+		if (err)
+		{
+			LogMessage(&ctx, "Unable to list the directory %s: %s\n", fileIn, strerror(err));
+			nbFails++;
+			QueueBatchFile(&batch, fileIn, NULL, TakeLog(&ctx));
+			continue;
+		}
+		LogMessage(&ctx, "Processing file %d...\n", count);
 
 		if (mode == ENCRYPT)
 		{
 			if (encryptName)
 			{
 				Uint16 md5[8] = {0};
-				strncpy(fileOutAddr, addrLists[i], MAX_PATH);
+				strncpy(fileOutAddr, fileIn, MAX_PATH);
 				p = GetFileNameFromAddr(fileOutAddr);
-				EncryptString(addrLists[i], md5, 1);
+				EncryptString(&ctx, fileIn, md5, 1);
 				snprintf(p, MAX_PATH-(int)(p-fileOutAddr), "%04x%04x%04x%04x%04x%04x%04x%04x.crpt",
 						md5[0], md5[1], md5[2], md5[3], md5[4], md5[5], md5[6], md5[7]);
 			}
 			else
-				snprintf(fileOutAddr, MAX_PATH, "%s.crpt", addrLists[i]);
+				snprintf(fileOutAddr, MAX_PATH, "%s.crpt", fileIn);
 		}
 		else
 		{
 			char *ptFileOutAddr = NULL;
-			r = DecryptFileName(addrLists[i], &ptFileOutAddr, keySha);
+			r = DecryptFileName(&ctx, fileIn, &ptFileOutAddr);
 			if (r == -1)
 			{
 				nbFails++;
+				QueueBatchFile(&batch, fileIn, NULL, TakeLog(&ctx));
 				continue;
 			}
 			else if (!r)
 			{
-				strncpy(fileOutAddr, addrLists[i], MAX_PATH);
+				strncpy(fileOutAddr, fileIn, MAX_PATH);
 				if ((p = strrchr(fileOutAddr, '.')) && !strcmp(p, ".crpt"))
 					*p = '\0';
 				else
 				{
 					if ( (p = GetFileNameFromAddr(fileOutAddr)) )
-						snprintf(p, MAX_PATH-(int)(p-fileOutAddr), "~DCPT-%s", addrLists[i]+(p-fileOutAddr));
+						snprintf(p, MAX_PATH-(int)(p-fileOutAddr), "~DCPT-%s", fileIn+(p-fileOutAddr));
 					else
-						snprintf(fileOutAddr, MAX_PATH, "~DCPT-%s", addrLists[i]);
+						snprintf(fileOutAddr, MAX_PATH, "~DCPT-%s", fileIn);
 				}
 			}
 			else
@@ -202,38 +434,74 @@ int main(void)
 			}
 		}
 
-		if (autoOverwrite <= 0 && CheckDirOrFile(fileOutAddr) == 2)
+		//The file overwritten may be the input of another one: the files before are waited for,
+		//and the files after wait for this one
+		overwrite = CheckDirOrFile(fileOutAddr) == 2;
+		known = incremental && GetFileStamp(fileIn, &stamp) ? CheckManifestFile(&manifest, fileIn, &stamp, overwrite) : 0;
+		if (known == 2)
 		{
-			if (autoOverwrite < 0)
+			LogMessage(&ctx, "Unchanged since the last run, skipped.\n");
+			QueueBatchFile(&batch, fileIn, NULL, TakeLog(&ctx));
+			continue;
+		}
+		if (overwrite)
+		{
+			if (autoOverwrite < 0 && !known)
+			{
+				QueueBatchFile(&batch, fileIn, NULL, TakeLog(&ctx));
 				continue;
+			}
 
-			printf("The output file %s already exists. Overwrite? (y/n/Y/N): ", fileOutAddr);
-			r = EnterChar("yYnN");
-			if (r == 'n' || r == 'N')
+			PrintBatchLogs(&batch, 1);
+			if (!autoOverwrite && !known)
 			{
-				if (r == 'N')
-					autoOverwrite = -1;
-				continue;
+				//The question comes after the messages of the files before
+				if ((p = TakeLog(&ctx)))
+				{
+					fputs(p, stdout);
+					free(p);
+				}
+
+				printf("The output file %s already exists. Overwrite? (y/n/Y/N): ", fileOutAddr);
+				r = EnterChar("yYnN");
+				if (r == 'n' || r == 'N')
+				{
+					if (r == 'N')
+						autoOverwrite = -1;
+					QueueBatchFile(&batch, fileIn, NULL, NULL);
+					continue;
+				}
+				if (r == 'Y')
+					autoOverwrite = 1;
 			}
-			if (r == 'Y')
-				autoOverwrite = 1;
 		}
 
-		r = mode == ENCRYPT ? EncryptFile(addrLists[i], fileOutAddr, keySha) : DecryptFile(addrLists[i], fileOutAddr, keySha);
-		if (!r)
-			nbFails++;
-		else if (autoDelete && remove(addrLists[i]))
-			printf("Unable to delete the file %s: %s\n", addrLists[i], strerror(errno));
+		QueueBatchFile(&batch, fileIn, fileOutAddr, TakeLog(&ctx));
+		PrintBatchLogs(&batch, overwrite);
 	}
 
-	delay = (clock() - t) / (double)CLOCKS_PER_SEC;
-	printf("\nAll done.\n%d file(s) processed, %d error(s).\n", count-nbFails, nbFails);
-	printf("Total time: %.1f sec\n", delay);
-	if (delay > 0)
-		printf("%.2f files / sec, %.2f MB / sec.\n", count / delay, totalSize / (pow(2,20) * delay));
-	printf("\n");
+	ctx.bufferLog = 0;
+	nbFails += StopBatch(&batch);
+	if (listDir)
+	{
+		totalSize = walker.totalSize;
+		StopDirWalker(&walker);
+	}
+
+	//The files that could not be encrypted are not recorded: they are tried again next time
+	if (incremental)
+	{
+		printf("\n%d file(s) unchanged since the last run.\n", (int)manifest.nbUnchanged);
+		if (!SaveManifest(&manifest))
+			printf("The manifest %s could not be written, all the files will be encrypted again next time.\n", manifestAddr);
+		CloseManifest(&manifest);
+	}
+
+	PrintSummary(count, nbFails, totalSize, t);
 
-	FreeStrTab(addrLists, MAX_ENTRIES);
+	FreeIdeaContext(&ctx);
+	StopThreadPool();
+	FreeBufferPool();
 	return EXIT_SUCCESS;
 }
 
@@ -287,6 +555,334 @@ char EnterChar(const char *allowedChars)
 }
 
 
+//The value of the option --name=VALUE, taken out of the arguments with its repetitions,
+//the last one winning, or NULL if it is not given
+static const char* TakeOption(int *argc, char *argv[], const char *name)
+{
+	const char *value = NULL;
+	size_t l = strlen(name);
+	int i, j;
+
+	for (i=1 ; i < *argc ; i++)
+	{
+		if (strncmp(argv[i], "--", 2) || strncmp(argv[i] + 2, name, l) || argv[i][l+2] != '=')
+			continue;
+
+		value = argv[i] + l + 3;
+		for (j=i ; j < *argc-1 ; j++)
+			argv[j] = argv[j+1];
+		(*argc)--;
+		i--;
+	}
+
+	return value;
+}
+
+//--name alone
+static int TakeFlag(int *argc, char *argv[], const char *name)
+{
+	int i, j, found = 0;
+
+	for (i=1 ; i < *argc ; i++)
+	{
+		if (strncmp(argv[i], "--", 2) || strcmp(argv[i] + 2, name))
+			continue;
+
+		found = 1;
+		for (j=i ; j < *argc-1 ; j++)
+			argv[j] = argv[j+1];
+		(*argc)--;
+		i--;
+	}
+
+	return found;
+}
+
+//--range=A-B decrypts the bytes [A, B[ of a file only, --range=A- up to its end.
+//Returns 0 on a wrong range, after printing why.
+static int ReadRangeOption(int *argc, char *argv[], const char **range, Uint64 *start, Uint64 *end)
+{
+	char *p = NULL;
+
+	if (!(*range = TakeOption(argc, argv, "range")))
+		return 1;
+
+	*end = (Uint64)-1;
+	if (isdigit(**range))
+		*start = strtoull(*range, &p, 10);
+	if (!p || *p != '-' || (p[1] && (!isdigit(p[1]) || (*end = strtoull(p+1, &p, 10)) <= *start || *p)))
+	{
+		printf("Wrong range --range=%s: the option is --range=START-END, in bytes, END excluded and optional.\n", *range);
+		return 0;
+	}
+
+	return 1;
+}
+
+//To the name of the encrypted file, without .crpt, followed by the range
+static int DecryptRange(IdeaContext *ctx, const char *fileIn, const char *range, Uint64 start, Uint64 end)
+{
+	char fileOut[MAX_PATH+1] = "";
+	char *p;
+	int r;
+
+	strncpy(fileOut, fileIn, MAX_PATH);
+	if ((p = strrchr(fileOut, '.')) && !strcmp(p, ".crpt"))
+		*p = '\0';
+	snprintf(fileOut + strlen(fileOut), MAX_PATH+1 - strlen(fileOut), ".%s", range);
+
+	r = DecryptFileRange(ctx, fileIn, fileOut, start, end);
+	if (r)
+		printf("\nThe bytes %s have been decrypted to %s.\n\n", range, fileOut);
+	else
+		printf("\n");
+	return r;
+}
+
+//--stream=encrypt or --stream=decrypt. Returns ENCRYPT or DECRYPT, 0 without the option,
+//or -1 on a wrong value, after printing why.
+static int ReadStreamOption(int *argc, char *argv[])
+{
+	const char *stream = TakeOption(argc, argv, "stream");
+
+	if (!stream)
+		return 0;
+	if (!strcmp(stream, "encrypt"))
+		return ENCRYPT;
+	if (!strcmp(stream, "decrypt"))
+		return DECRYPT;
+
+	printf("Wrong option --stream=%s: the option is --stream=encrypt or --stream=decrypt.\n", stream);
+	return -1;
+}
+
+//The data goes to the real standard output through a stream of its own, the messages
+//of the whole program to the standard error instead. The data streams are binary.
+static FILE* TakeStdout(void)
+{
+	FILE *out;
+	int fd;
+
+	fflush(stdout);
+	if ((fd = dup(fileno(stdout))) < 0 || dup2(fileno(stderr), fileno(stdout)) < 0 || !(out = fdopen(fd, "wb")))
+		return NULL;
+	setvbuf(stdout, NULL, _IONBF, 0);
+#ifdef WIN32
+	_setmode(fileno(stdin), _O_BINARY);
+	_setmode(fd, _O_BINARY);
+#endif
+	return out;
+}
+
+//Next to the directory: <dir><extension>, MAX_PATH+1 bytes at most.
+//. or .. would put the file in the directory.
+static int NameAfterDir(const char *dir, const char *extension, char *fileName)
+{
+	const char *dirName = NULL;
+	size_t l;
+
+	strncpy(fileName, dir, MAX_PATH);
+	fileName[MAX_PATH] = '\0';
+	for (l = strlen(fileName) ; l > 1 && (fileName[l-1] == '/' || fileName[l-1] == '\\') ; l--)
+		fileName[l-1] = '\0';
+	dirName = GetFileNameFromAddr(fileName);
+	if (!strcmp(dirName, ".") || !strcmp(dirName, ".."))
+	{
+		printf("The %s file is named after the directory, please give its name rather than %s.\n", extension, dir);
+		return 0;
+	}
+	snprintf(fileName + l, MAX_PATH+1 - l, "%s", extension);
+	return 1;
+}
+
+//Into <dir>.crar. The files are only deleted once the index of the archive is written.
+static int PackDirectory(IdeaContext *ctx, const char *dir, int recursive, int autoDelete)
+{
+	char fileOut[MAX_PATH+1] = "", name[MAX_PATH+1] = "";
+	const char *fileIn = NULL;
+	const ArenaPath **packed = NULL, **p;
+	PathArena paths;
+	DirWalker walker;
+	Archive ar;
+	Sint64 totalSize;
+	size_t l, rootLength;
+	int count = 0, nbFails = 0, nbPacked = 0, maxPacked = 0, err = 0, i, r;
+	clock_t t = clock();
+
+	if (!NameAfterDir(dir, ".crar", fileOut))
+		return 0;
+	rootLength = strlen(dir);
+
+	if (!OpenArchive(&ar, ctx, fileOut, 1))
+		return 0;
+	if (!StartDirWalker(&walker, dir, recursive, 0))
+	{
+		CloseArchive(&ar);
+		return 0;
+	}
+	InitPathArena(&paths);
+
+	printf("Packing into %s...\n\n", fileOut);
+	while ((fileIn = GetNextWalkedFile(&walker, &err)))
+	{
+		count++;
+		if (err)
+		{
+			printf("Unable to list the directory %s: %s\n", fileIn, strerror(err));
+			nbFails++;
+			continue;
+		}
+
+		//Relative to the directory, with '/' on all the systems
+		for (l = rootLength ; fileIn[l] == '/' || fileIn[l] == '\\' ; l++);
+		strncpy(name, fileIn + l, MAX_PATH);
+		for (i=0 ; name[i] ; i++)
+		{
+			if (name[i] == '\\')
+				name[i] = '/';
+		}
+
+		if (!AddArchiveFile(&ar, fileIn, name))
+		{
+			nbFails++;
+			continue;
+		}
+		if (!autoDelete)
+			continue;
+		if (nbPacked == maxPacked)
+		{
+			maxPacked = maxPacked ? maxPacked * 2 : 1024;
+			if (!(p = realloc(packed, sizeof(ArenaPath*) * maxPacked)))
+			{
+				printf("Unable to allocate memory to remember the file %s, it will not be deleted.\n", fileIn);
+				maxPacked = nbPacked;
+				continue;
+			}
+			packed = p;
+		}
+		if ((packed[nbPacked] = StoreArenaPath(&paths, fileIn, 0)))
+			nbPacked++;
+	}
+
+	r = CloseArchive(&ar);
+	totalSize = walker.totalSize;
+	StopDirWalker(&walker);
+	for (i=0 ; r && i < nbPacked ; i++)
+	{
+		GetArenaPath(packed[i], name, MAX_PATH+1);
+		remove(name);
+	}
+	free(packed);
+	FreePathArena(&paths);
+
+	if (!r)
+		printf("\nThe archive %s could not be written.\n", fileOut);
+	PrintSummary(count, r ? nbFails : count, totalSize, t);
+	return r;
+}
+
+//Into the directory named like the archive without .crar. With member, only this one.
+static int ExtractArchive(IdeaContext *ctx, const char *fileIn, const char *member)
+{
+	char dirOut[MAX_PATH+1] = "", fileOut[2*MAX_PATH+2] = "";
+	char *p;
+	Archive ar;
+	Sint64 first, totalSize = 0;
+	Uint64 i, last;
+	int count = 0, nbFails = 0;
+	clock_t t = clock();
+
+	strncpy(dirOut, fileIn, MAX_PATH);
+	if ((p = strrchr(dirOut, '.')) && !strcmp(p, ".crar"))
+		*p = '\0';
+	else
+		snprintf(dirOut + strlen(dirOut), MAX_PATH+1 - strlen(dirOut), ".files");
+
+	if (!OpenArchive(&ar, ctx, fileIn, 0))
+		return 0;
+	first = 0;
+	last = ar.nbMembers;
+	if (member)
+	{
+		if ((first = FindArchiveMember(&ar, member)) < 0)
+		{
+			printf("There is no %s in %s.\n", member, fileIn);
+			CloseArchive(&ar);
+			return 0;
+		}
+		last = first + 1;
+	}
+
+	printf("Extracting to %s...\n\n", dirOut);
+	for (i=first ; i < last ; i++)
+	{
+		//A member added again replaces the one before
+		if (FindArchiveMember(&ar, ar.members[i].name) != (Sint64)i)
+			continue;
+
+		count++;
+		if (!IsSafeMemberName(ar.members[i].name))
+		{
+			printf("The name %s goes out of the directory, it is not extracted.\n", ar.members[i].name);
+			nbFails++;
+			continue;
+		}
+		snprintf(fileOut, sizeof(fileOut), "%s/%s", dirOut, ar.members[i].name);
+		MakeParentDirs(fileOut);
+		if (ExtractArchiveMember(&ar, i, fileOut))
+			totalSize += ar.members[i].size;
+		else
+			nbFails++;
+	}
+	CloseArchive(&ar);
+
+	PrintSummary(count, nbFails, totalSize, t);
+	return !nbFails;
+}
+
+//Relative, and staying below the directory
+static int IsSafeMemberName(const char *name)
+{
+	const char *p;
+
+	if (*name == '/' || strchr(name, '\\') || strchr(name, ':'))
+		return 0;
+	for (p = name ; p ; p = strchr(p, '/') ? strchr(p, '/') + 1 : NULL)
+	{
+		if (!strncmp(p, "..", 2) && (p[2] == '/' || !p[2]))
+			return 0;
+	}
+
+	return 1;
+}
+
+//The directories that already exist are left alone, the others show when the file is created
+static void MakeParentDirs(char *path)
+{
+	char *p, c;
+
+	for (p = path+1 ; *p ; p++)
+	{
+		if (*p != '/' && *p != '\\')
+			continue;
+		c = *p;
+		*p = '\0';
+		MakeDir(path);
+		*p = c;
+	}
+}
+
+static void PrintSummary(int count, int nbFails, Sint64 totalSize, clock_t t)
+{
+	double delay = (clock() - t) / (double)CLOCKS_PER_SEC;
+
+	printf("\nAll done.\n%d file(s) processed, %d error(s).\n", count-nbFails, nbFails);
+	printf("Total time: %.1f sec\n", delay);
+	if (delay > 0)
+		printf("%.2f files / sec, %.2f MB / sec.\n", count / delay, totalSize / (pow(2,20) * delay));
+	printf("\n");
+}
+
 static int CheckDirOrFile(const char *fullAddr)
 {
 	struct _stati64 s;
@@ -314,59 +910,6 @@ static Sint64 GetFileSize(const char *fullAddr)
 	return (_stati64(fullAddr, &s) < 0 || S_ISDIR(s.st_mode)) ? 0 : s.st_size;
 }
 
-static int ListDirectory(const char *dirAddr, int listSubDirs, char **addrLists, int max, Sint64 *size)
-{
-	DIR *dp;
-	struct dirent *ep;
-	int i, r=0;
-	char curAddr[MAX_PATH+1] = "";
-
-	dp = opendir(dirAddr);
-	if (dp != NULL)
-	{
-		for (i=0 ; i < max && (ep = readdir (dp)) ; i++)
-		{
-			if (!strcmp(ep->d_name, "..") || !strcmp(ep->d_name, "."))
-				i--;
-			else
-			{
-				snprintf(curAddr, MAX_PATH, "%s/%s", dirAddr, ep->d_name);
-				r = CheckDirOrFile(curAddr);
-				if (r == 1 && listSubDirs)
-				{
-					Sint64 s = 0;
-					r = ListDirectory(curAddr, 1, &(addrLists[i]), max-i, size ? &s : NULL);
-					if (size)
-						*size = (*size) + s;
-					if (r >= 0)
-						i += r-1;
-					else
-						return -1;
-				}
-				else if (r == 2)
-				{
-					addrLists[i] = malloc(sizeof(char) * (MAX_PATH+1));
-					if (addrLists[i])
-					{
-						strcpy(addrLists[i], curAddr);
-						if (size)
-							*size = (*size) + GetFileSize(curAddr);
-					}
-					else
-						i--;
-				}
-				else
-					i--;
-			}
-
-		}
-		closedir(dp);
-		return i;
-	}
-	else
-		return -1;
-}
-
 char* GetFileNameFromAddr(char *fileAddr)
 {
 	char *p1 = strrchr(fileAddr, '/');
@@ -401,17 +944,6 @@ FILE* Fopen_Ex(const char *fileName, const char *mode)
 }
 
 
-static void FreeStrTab(char **strTab, int num)
-{
-	int i;
-	for (i=0 ; i < num ; i++)
-	{
-		if (strTab[i])
-			free(strTab[i]);
-		strTab[i] = NULL;
-	}
-}
-
 static void Wait()
 {
 	printf("Please press a key to continue.\n");
@@ -0,0 +1,514 @@
+/**** LICENSE INFORMATION ****
+IDEA - manifest.c
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* The nightly runs over big trees encrypt again mostly files that have not changed.
+ * The manifest remembers, for each file of the directory, what stat told about it
+ * when it was encrypted, and the checksum of its plain data: a file with the same
+ * stamp is skipped at the cost of a stat. A file with a new time but the same size,
+ * restored or touched, is hashed before being encrypted again: reading it once is
+ * still cheaper than reading and writing it. The entries are kept in memory with a
+ * hash table on the names, like the index of an archive, and written back at the end
+ * of the run, only for the files that were found again. */
+
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "manifest.h"
+
+#define MIN_MANIFEST_ENTRIES	256
+
+static int ReadManifestEntries(Manifest *mf, FILE *file, Uint64 fileSize);
+static int GetManifestName(const Manifest *mf, const char *fileName, char *name);
+static Sint64 FindManifestEntry(const Manifest *mf, const char *name);
+static int RecordManifestFile(Manifest *mf, const char *name, const FileStamp *stamp, const Uint16 *checkSum, int unchanged);
+static int AddManifestEntry(Manifest *mf, const ManifestEntry *entry, const char *name);
+static void InsertManifestName(Manifest *mf, Uint64 i);
+static Uint64 HashName(const char *name);
+
+
+int OpenManifest(Manifest *mf, IdeaContext *ctx, const char *fileName, const char *root, Uint8 options)
+{
+	FILE *file = NULL;
+	Sint64 size;
+	int r;
+
+	memset(mf, 0, sizeof(Manifest));
+	mf->ctx = ctx;
+	mf->options = options;
+	mf->rootLength = strlen(root);
+	mf->started = (Sint64)time(NULL) * 1000000000;
+	pthread_mutex_init(&mf->mutex, NULL);
+	InitPathArena(&mf->names);
+	if (!(mf->fileName = StoreArenaString(&mf->names, fileName, 0)))
+	{
+		LogMessage(ctx, "Unable to allocate the manifest %s.\n", fileName);
+		CloseManifest(mf);
+		return 0;
+	}
+
+	//The first run has no manifest yet
+	if (!(file = fopen(fileName, "rb")))
+	{
+		if (errno == ENOENT)
+			return 1;
+		LogMessage(ctx, "Unable to open the manifest %s: %s\n", fileName, strerror(errno));
+		CloseManifest(mf);
+		return 0;
+	}
+	if (SetFilePosition(file, 0, SEEK_END) || (size = GetFilePosition(file)) < 0)
+	{
+		LogMessage(ctx, "Unable to get the size of the manifest %s: %s\n", fileName, strerror(errno));
+		fclose(file);
+		CloseManifest(mf);
+		return 0;
+	}
+	rewind(file);
+
+	r = ReadManifestEntries(mf, file, (Uint64)size);
+	fclose(file);
+	if (r < 0)
+	{
+		CloseManifest(mf);
+		return 0;
+	}
+	if (!r)
+	{
+		mf->nbEntries = 0;
+		if (mf->table)
+			memset(mf->table, 0, (size_t)mf->tableSize * sizeof(Uint64));
+		LogMessage(ctx, "All the files will be encrypted again.\n");
+	}
+	return 1;
+}
+
+//To a new file first, so that the manifest before is only lost once the new one is written
+int SaveManifest(Manifest *mf)
+{
+	IdeaContext *ctx = mf->ctx;
+	ManifestEntry *entry;
+	FILE *file = NULL;
+	char tmpName[MAX_PATH+8];
+	Uint64 entriesSize = 0, nbEntries = 0, nonce, k, p;
+	Uint16 md5[8], l;
+	Uint8 *entries = NULL, version = MANIFEST_VERSION;
+	int r;
+
+	for (k=0 ; k < mf->nbEntries ; k++)
+	{
+		if (mf->entries[k].seen)
+		{
+			entriesSize += MANIFEST_ENTRY_SIZE + strlen(mf->entries[k].name);
+			nbEntries++;
+		}
+	}
+	if (!(entries = calloc((size_t)(entriesSize+7)/8 * 8 + 8, 1)))
+	{
+		LogMessage(ctx, "Unable to allocate the manifest %s.\n", mf->fileName);
+		return 0;
+	}
+
+	for (k=0, p=0 ; k < mf->nbEntries ; k++)
+	{
+		entry = &(mf->entries[k]);
+		if (!entry->seen)
+			continue;
+		l = (Uint16)strlen(entry->name);
+		memcpy(entries + p, &entry->stamp.size, 8);
+		memcpy(entries + p + 8, &entry->stamp.modified, 8);
+		memcpy(entries + p + 16, &entry->stamp.inode, 8);
+		memcpy(entries + p + 24, entry->checkSum, 16);
+		memcpy(entries + p + 40, &l, 2);
+		memcpy(entries + p + MANIFEST_ENTRY_SIZE, entry->name, l);
+		p += MANIFEST_ENTRY_SIZE + l;
+	}
+
+	r = ComputeMD5((char*)entries, md5, (size_t)entriesSize) && GenerateNonce(ctx, &nonce)
+			&& ProcessCTR_MT(ctx, (Uint16*)entries, (Uint16*)entries, (size_t)(entriesSize+7)/8 * 8, nonce, 0);
+	if (!r)
+	{
+		free(entries);
+		return 0;
+	}
+
+	snprintf(tmpName, MAX_PATH+8, "%s.tmp", mf->fileName);
+	if (!(file = fopen(tmpName, "wb")))
+	{
+		LogMessage(ctx, "Unable to create the manifest %s: %s\n", tmpName, strerror(errno));
+		free(entries);
+		return 0;
+	}
+	if (fwrite(ctx->keySha, 1, 32, file) != 32 || fwrite(MANIFEST_MAGIC, 1, 8, file) != 8
+			|| fwrite(&version, 1, 1, file) != 1 || fwrite(&mf->options, 1, 1, file) != 1
+			|| fwrite(&mf->started, 8, 1, file) != 1 || fwrite(&nonce, 8, 1, file) != 1
+			|| fwrite(&nbEntries, 8, 1, file) != 1 || fwrite(md5, 1, 16, file) != 16
+			|| fwrite(entries, 1, (size_t)entriesSize, file) != entriesSize)
+	{
+		LogMessage(ctx, "An error occurred during writing the manifest %s: %s\n", tmpName, strerror(ferror(file)));
+		r = 0;
+	}
+	free(entries);
+	if (fclose(file) && r)
+	{
+		LogMessage(ctx, "An error occurred during writing the manifest %s: %s\n", tmpName, strerror(errno));
+		r = 0;
+	}
+
+	//rename does not replace a file on Windows
+	if (r && ((remove(mf->fileName) && errno != ENOENT) || rename(tmpName, mf->fileName)))
+	{
+		LogMessage(ctx, "Unable to replace the manifest %s: %s\n", mf->fileName, strerror(errno));
+		r = 0;
+	}
+	if (!r)
+		remove(tmpName);
+	return r;
+}
+
+void CloseManifest(Manifest *mf)
+{
+	free(mf->entries);
+	free(mf->table);
+	FreePathArena(&mf->names);
+	pthread_mutex_destroy(&mf->mutex);
+	memset(mf, 0, sizeof(Manifest));
+}
+
+int GetFileStamp(const char *fileName, FileStamp *stamp)
+{
+#ifdef WIN32
+	struct _stati64 s;
+
+	if (_stati64(fileName, &s) || S_ISDIR(s.st_mode))
+		return 0;
+	stamp->modified = (Sint64)s.st_mtime * 1000000000;
+#else
+	struct stat s;
+
+	if (stat(fileName, &s) || S_ISDIR(s.st_mode))
+		return 0;
+#ifdef __linux__
+	stamp->modified = (Sint64)s.st_mtim.tv_sec * 1000000000 + s.st_mtim.tv_nsec;
+#else
+	stamp->modified = (Sint64)s.st_mtime * 1000000000;
+#endif
+#endif
+	stamp->size = s.st_size;
+	stamp->inode = s.st_ino;
+	return 1;
+}
+
+int CheckManifestFile(Manifest *mf, const char *fileName, const FileStamp *stamp, int outputFound)
+{
+	char name[MAX_PATH+1];
+	ManifestEntry *entry;
+	Sint64 i;
+	int r = 0;
+
+	if (!GetManifestName(mf, fileName, name))
+		return 0;
+
+	pthread_mutex_lock(&mf->mutex);
+	if ((i = FindManifestEntry(mf, name)) >= 0)
+	{
+		entry = &(mf->entries[i]);
+		r = 1;
+		if (outputFound && entry->stamp.size == stamp->size && entry->stamp.modified == stamp->modified
+				&& entry->stamp.inode == stamp->inode && entry->stamp.modified < mf->recorded)
+		{
+			entry->seen = 1;
+			mf->nbUnchanged++;
+			r = 2;
+		}
+	}
+	pthread_mutex_unlock(&mf->mutex);
+
+	return r;
+}
+
+int EncryptManifestFile(Manifest *mf, IdeaContext *ctx, const char *fileNameIn, const char *fileNameOut)
+{
+	char name[MAX_PATH+1];
+	FileStamp stamp, outStamp;
+	ManifestEntry entry;
+	Uint16 checkSum[8];
+	FILE *file = NULL;
+	Sint64 i = -1;
+	int named, r;
+
+	//Taken before reading: a change made meanwhile gives a newer stamp, seen by the next run
+	if (!GetFileStamp(fileNameIn, &stamp))
+	{
+		LogMessage(ctx, "Unable to get the status of the input file %s: %s\n", fileNameIn, strerror(errno));
+		return 0;
+	}
+
+	if ((named = GetManifestName(mf, fileNameIn, name)))
+	{
+		pthread_mutex_lock(&mf->mutex);
+		if ((i = FindManifestEntry(mf, name)) >= 0)
+			entry = mf->entries[i];
+		pthread_mutex_unlock(&mf->mutex);
+	}
+
+	//Touched only: reading it costs less than writing it again
+	if (i >= 0 && entry.stamp.size == stamp.size && GetFileStamp(fileNameOut, &outStamp) && (file = fopen(fileNameIn, "rb")))
+	{
+		if (mf->options & (FILE_FLAG_TREE_HASH | FILE_FLAG_CHUNKED))
+			r = ComputeFileTreeChecksum(ctx, file, checkSum);
+		else
+			r = ComputeFileMD5Checksum(ctx, file, checkSum);
+		fclose(file);
+		file = NULL;
+		if (r && !memcmp(checkSum, entry.checkSum, 16))
+		{
+			LogMessage(ctx, "Same content as when it was last encrypted, skipped.\n");
+			if (!RecordManifestFile(mf, name, &stamp, checkSum, 1))
+				LogMessage(ctx, "Unable to record the file %s in the manifest, it will be checked again next time.\n", fileNameIn);
+			return 1;
+		}
+	}
+
+	if (!EncryptFile(ctx, fileNameIn, fileNameOut))
+		return 0;
+	if (!named)
+		return 1;
+
+	//The checksum of the plain data is in the header of the output
+	r = (file = fopen(fileNameOut, "rb")) && !fseek(file, 32, SEEK_SET) && fread(checkSum, 1, 16, file) == 16;
+	if (file)
+		fclose(file);
+	if (!r || !RecordManifestFile(mf, name, &stamp, checkSum, 0))
+		LogMessage(ctx, "Unable to record the file %s in the manifest, it will be encrypted again next time.\n", fileNameIn);
+	return 1;
+}
+
+
+//Returns -1 if the file cannot be read, 0 if it is not a manifest of this key and these options
+static int ReadManifestEntries(Manifest *mf, FILE *file, Uint64 fileSize)
+{
+	IdeaContext *ctx = mf->ctx;
+	ManifestEntry entry;
+	Uint64 entriesSize, nbEntries = 0, nonce = 0, k, p;
+	Uint16 keySha[16], md5[8], checkSum[8], l;
+	char magic[8], name[MAX_PATH+1];
+	Uint8 *entries = NULL, version = 0, options = 0;
+	int valid;
+
+	if (fileSize < MANIFEST_HEADER_SIZE || fread(keySha, 1, 32, file) != 32 || fread(magic, 1, 8, file) != 8
+			|| fread(&version, 1, 1, file) != 1 || fread(&options, 1, 1, file) != 1
+			|| fread(&mf->recorded, 8, 1, file) != 1 || fread(&nonce, 8, 1, file) != 1
+			|| fread(&nbEntries, 8, 1, file) != 1 || fread(checkSum, 1, 16, file) != 16
+			|| memcmp(magic, MANIFEST_MAGIC, 8))
+	{
+		LogMessage(ctx, "%s is not a valid manifest.\n", mf->fileName);
+		return 0;
+	}
+	if (memcmp(keySha, ctx->keySha, 32))
+	{
+		LogMessage(ctx, "The manifest %s was written with another password.\n", mf->fileName);
+		return 0;
+	}
+	if (version != MANIFEST_VERSION)
+	{
+		LogMessage(ctx, "%s uses options that this version does not support.\n", mf->fileName);
+		return 0;
+	}
+	if (options != mf->options)
+	{
+		LogMessage(ctx, "The manifest %s was written with other encryption options.\n", mf->fileName);
+		return 0;
+	}
+
+	//Whole blocks for the cipher
+	entriesSize = fileSize - MANIFEST_HEADER_SIZE;
+	if (nbEntries > entriesSize / MANIFEST_ENTRY_SIZE)
+	{
+		LogMessage(ctx, "The manifest %s is corrupted.\n", mf->fileName);
+		return 0;
+	}
+	if (!(entries = malloc((size_t)(entriesSize+7)/8 * 8 + 8)))
+	{
+		LogMessage(ctx, "Unable to allocate the manifest %s.\n", mf->fileName);
+		return -1;
+	}
+	if (fread(entries, 1, (size_t)entriesSize, file) != entriesSize)
+	{
+		LogMessage(ctx, "An error occurred during reading the manifest %s: %s\n", mf->fileName, strerror(ferror(file)));
+		free(entries);
+		return -1;
+	}
+	if (!ProcessCTR_MT(ctx, (Uint16*)entries, (Uint16*)entries, (size_t)(entriesSize+7)/8 * 8, nonce, 0)
+			|| !ComputeMD5((char*)entries, md5, (size_t)entriesSize))
+	{
+		free(entries);
+		return -1;
+	}
+	if (memcmp(md5, checkSum, 16))
+	{
+		LogMessage(ctx, "The manifest %s is corrupted.\n", mf->fileName);
+		free(entries);
+		return 0;
+	}
+
+	memset(&entry, 0, sizeof(ManifestEntry));
+	for (k=0, p=0, valid=1 ; k < nbEntries && valid ; k++, p += MANIFEST_ENTRY_SIZE + l)
+	{
+		valid = 0;
+		if (entriesSize - p < MANIFEST_ENTRY_SIZE)
+			break;
+		memcpy(&entry.stamp.size, entries + p, 8);
+		memcpy(&entry.stamp.modified, entries + p + 8, 8);
+		memcpy(&entry.stamp.inode, entries + p + 16, 8);
+		memcpy(entry.checkSum, entries + p + 24, 16);
+		memcpy(&l, entries + p + 40, 2);
+		if (!l || l > MAX_PATH || entriesSize - p - MANIFEST_ENTRY_SIZE < l)
+			break;
+		memcpy(name, entries + p + MANIFEST_ENTRY_SIZE, l);
+		name[l] = '\0';
+		if (!AddManifestEntry(mf, &entry, name))
+		{
+			LogMessage(ctx, "Unable to allocate the manifest %s.\n", mf->fileName);
+			free(entries);
+			return -1;
+		}
+		valid = 1;
+	}
+	free(entries);
+	if (!valid || p != entriesSize)
+	{
+		LogMessage(ctx, "The manifest %s is corrupted.\n", mf->fileName);
+		return 0;
+	}
+
+	return 1;
+}
+
+//Relative to the directory, with '/' on all the systems
+static int GetManifestName(const Manifest *mf, const char *fileName, char *name)
+{
+	size_t l;
+	int i;
+
+	for (l = mf->rootLength ; fileName[l] == '/' || fileName[l] == '\\' ; l++);
+	if (!fileName[l] || strlen(fileName + l) > MAX_PATH)
+		return 0;
+	strcpy(name, fileName + l);
+	for (i=0 ; name[i] ; i++)
+	{
+		if (name[i] == '\\')
+			name[i] = '/';
+	}
+	return 1;
+}
+
+//Linear probing from the hash of the name. Called with the mutex locked.
+static Sint64 FindManifestEntry(const Manifest *mf, const char *name)
+{
+	Uint64 slot, mask = mf->tableSize - 1;
+
+	if (!mf->tableSize)
+		return -1;
+	for (slot = HashName(name) & mask ; mf->table[slot] ; slot = (slot+1) & mask)
+	{
+		if (!strcmp(mf->entries[mf->table[slot]-1].name, name))
+			return (Sint64)(mf->table[slot]-1);
+	}
+
+	return -1;
+}
+
+static int RecordManifestFile(Manifest *mf, const char *name, const FileStamp *stamp, const Uint16 *checkSum, int unchanged)
+{
+	ManifestEntry entry;
+	Sint64 i;
+	int r = 1;
+
+	entry.stamp = *stamp;
+	memcpy(entry.checkSum, checkSum, 16);
+	entry.seen = 1;
+
+	pthread_mutex_lock(&mf->mutex);
+	if ((i = FindManifestEntry(mf, name)) >= 0)
+	{
+		entry.name = mf->entries[i].name;
+		mf->entries[i] = entry;
+	}
+	else
+		r = AddManifestEntry(mf, &entry, name);
+	if (unchanged)
+		mf->nbUnchanged++;
+	pthread_mutex_unlock(&mf->mutex);
+
+	return r;
+}
+
+//The name must not be recorded yet. The table is rebuilt twice as big when it is half full.
+static int AddManifestEntry(Manifest *mf, const ManifestEntry *entry, const char *name)
+{
+	ManifestEntry *entries;
+	Uint64 *table, i;
+
+	if (mf->nbEntries == mf->maxEntries)
+	{
+		i = mf->maxEntries ? mf->maxEntries * 2 : MIN_MANIFEST_ENTRIES;
+		if (!(entries = realloc(mf->entries, (size_t)i * sizeof(ManifestEntry))))
+			return 0;
+		mf->entries = entries;
+		mf->maxEntries = i;
+	}
+	if ((mf->nbEntries+1) * 2 > mf->tableSize)
+	{
+		i = mf->tableSize ? mf->tableSize * 2 : MIN_MANIFEST_ENTRIES * 2;
+		if (!(table = calloc((size_t)i, sizeof(Uint64))))
+			return 0;
+		free(mf->table);
+		mf->table = table;
+		mf->tableSize = i;
+		for (i=0 ; i < mf->nbEntries ; i++)
+			InsertManifestName(mf, i);
+	}
+
+	mf->entries[mf->nbEntries] = *entry;
+	if (!(mf->entries[mf->nbEntries].name = StoreArenaString(&mf->names, name, 0)))
+		return 0;
+	InsertManifestName(mf, mf->nbEntries);
+	mf->nbEntries++;
+	return 1;
+}
+
+static void InsertManifestName(Manifest *mf, Uint64 i)
+{
+	Uint64 slot, mask = mf->tableSize - 1;
+
+	for (slot = HashName(mf->entries[i].name) & mask ; mf->table[slot] ; slot = (slot+1) & mask);
+	mf->table[slot] = i+1;
+}
+
+//FNV-1a
+static Uint64 HashName(const char *name)
+{
+	Uint64 hash = 14695981039346656037ULL;
+
+	for ( ; *name ; name++)
+		hash = (hash ^ (Uint8)*name) * 1099511628211ULL;
+	return hash;
+}
@@ -0,0 +1,98 @@
+/**** LICENSE INFORMATION ****
+IDEA - manifest.h
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MANIFEST_H_
+#define MANIFEST_H_
+
+#include "idea.h"
+#include "patharena.h"
+
+//A manifest records the files of a directory as they were when they were last encrypted,
+//so that the next run only encrypts the files changed since. It starts with the SHA-256
+//of the key (32 bytes), MANIFEST_MAGIC, the version and the options of the run (1 byte each),
+//the time of the run (8 bytes), the nonce of the entries, their number (8 bytes each) and
+//their MD5 (16 bytes). The entries follow, encrypted in counter mode.
+//An entry holds the stamp of a file: its size, its modification time in nanoseconds and its
+//inode (8 bytes each), then the checksum of its plain data as written in its header (16 bytes),
+//the length of its name (2 bytes) and its name, relative to the directory with '/' as separator.
+#define MANIFEST_MAGIC			"IDEA.MAN"
+#define MANIFEST_VERSION		1
+#define MANIFEST_HEADER_SIZE	82
+#define MANIFEST_ENTRY_SIZE		42		//Without the name
+#define MANIFEST_ENCRYPTED_NAMES	0x01	//With the FILE_FLAG_xxx of the files in the options
+
+//What stat tells about a file, enough to know that it has not changed
+typedef struct
+{
+	Uint64 size;
+	Sint64 modified;				//Nanoseconds since 1970, to the precision of the file system
+	Uint64 inode;					//0 on Windows
+} FileStamp;
+
+typedef struct
+{
+	FileStamp stamp;
+	Uint16 checkSum[8];
+	const char *name;				//In the arena of the manifest
+	int seen;						//Found again by this run: only those are written back
+} ManifestEntry;
+
+//Used by the main thread and by the workers of a batch at the same time
+typedef struct
+{
+	IdeaContext *ctx;
+	const char *fileName;
+	size_t rootLength;				//Of the directory, stripped from the paths given
+	Uint8 options;					//Flags of the files, and whether their names are encrypted
+	Sint64 recorded;				//Start of the run that wrote the manifest
+	Sint64 started;					//Start of this run
+	ManifestEntry *entries;
+	Uint64 nbEntries, maxEntries;
+	Uint64 *table;					//Index + 1 of the entry of each name, by the hash of the name
+	Uint64 tableSize;				//Power of 2, at least twice nbEntries
+	Uint64 nbUnchanged;				//Files skipped by this run
+	PathArena names;
+	pthread_mutex_t mutex;
+} Manifest;
+
+//Reads fileName if it exists. A manifest written with another key or other options is
+//ignored, with a message: all the files are encrypted again, as on the first run.
+//The paths given to the other functions start with root.
+int OpenManifest(Manifest *mf, IdeaContext *ctx, const char *fileName, const char *root, Uint8 options);
+
+//Writes the entries of the files found by this run, over the manifest before.
+//Returns 0 if it could not be written.
+int SaveManifest(Manifest *mf);
+void CloseManifest(Manifest *mf);
+
+int GetFileStamp(const char *fileName, FileStamp *stamp);
+
+//Returns 1 if fileName is recorded, and 2 if it has not changed since and its output is
+//there: then it is counted as found by this run, and skipped. A file changed during the
+//second that the manifest was recorded in may not have a newer time, it is never taken
+//as unchanged.
+int CheckManifestFile(Manifest *mf, const char *fileName, const FileStamp *stamp, int outputFound);
+
+//Encrypts fileNameIn, then records its stamp and its checksum. A recorded file that was
+//only touched, with the same size and an output already there, is hashed instead: it is
+//not encrypted again if its checksum has not changed.
+int EncryptManifestFile(Manifest *mf, IdeaContext *ctx, const char *fileNameIn, const char *fileNameOut);
+
+#endif /* MANIFEST_H_ */
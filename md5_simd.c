@@ -0,0 +1,423 @@
+/**** LICENSE INFORMATION ****
+IDEA - md5_simd.c
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Multi-buffer MD5: 4 (SSE2), 8 (AVX2) or 16 (AVX-512) independent messages
+ * are hashed at once, one 32-bit lane per message. MD5 cannot be vectorized
+ * inside one message, but the leaves of a tree checksum, or a batch of small
+ * files, are as many independent messages.
+ *
+ * The kernels only see whole blocks. The scheduler feeds each lane with the
+ * whole blocks of its message, then with its padded last one or two blocks,
+ * and gives the lane the next message as soon as it is done. */
+
+#include "md5_simd.h"
+#include "idea_simd.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define MD5_SIMD_X86
+#include <immintrin.h>
+#if __GNUC__ >= 5
+#define MD5_SIMD_AVX512
+#endif
+#define MD5_TARGET(t)		__attribute__((target(t)))
+#endif
+
+#define MAX_MD5_LANES		16
+
+//state holds the 4 words of every lane, word after word: state[w*width + lane].
+//Hashes nbBlocks blocks per lane; the block of a lane is read at p[lane],
+//which then moves forward by strides[lane] (0 for the unused lanes).
+typedef void (*MD5Kernel)(Uint32 *state, const unsigned char **p, const size_t *strides, size_t nbBlocks);
+
+typedef struct
+{
+	const char *name;
+	int width;			//Messages per pass
+	unsigned int cpuFeatures;
+	MD5Kernel kernel;
+} MD5KernelDesc;
+
+typedef struct
+{
+	MD5Stream *stream;
+	Uint64 blocksLeft;			//In the current part: whole blocks, then padded tail
+	int inTail;
+	unsigned char tail[128];
+} MD5Lane;
+
+static void SelectMD5Kernel(void);
+static int CompareStreamSizes(const void *a, const void *b);
+static int StartLane(MD5Lane *lane, MD5Stream *stream, Uint32 *state, int width, int l,
+		const unsigned char **p, size_t *strides);
+static void StartLaneTail(MD5Lane *lane, const unsigned char **p);
+static void FinishLaneScalar(MD5Lane *lane, Uint32 *state, int width, int l, const unsigned char *p);
+static void ComputeStreamMD5(MD5Stream *stream);
+
+static const unsigned char zeroBlock[64] = {0};
+
+
+#ifdef MD5_SIMD_X86
+
+/* The 64 steps of MD5 (see Transform in Md5.c), OPS being the prefix of the vector operations */
+#define MD5_STEP(OPS, FN, a, b, c, d, k, s, t) \
+  { \
+	a = OPS##_ADD(a, OPS##_ADD(OPS##_ADD(OPS##_##FN(b, c, d), x[k]), OPS##_SET1(t))); \
+	a = OPS##_ADD(b, OPS##_ROTL(a, s)); \
+  }
+
+#define MD5_STEPS(OPS) \
+  { \
+	MD5_STEP(OPS, F, a, b, c, d,  0,  7, 0xd76aa478) MD5_STEP(OPS, F, d, a, b, c,  1, 12, 0xe8c7b756) \
+	MD5_STEP(OPS, F, c, d, a, b,  2, 17, 0x242070db) MD5_STEP(OPS, F, b, c, d, a,  3, 22, 0xc1bdceee) \
+	MD5_STEP(OPS, F, a, b, c, d,  4,  7, 0xf57c0faf) MD5_STEP(OPS, F, d, a, b, c,  5, 12, 0x4787c62a) \
+	MD5_STEP(OPS, F, c, d, a, b,  6, 17, 0xa8304613) MD5_STEP(OPS, F, b, c, d, a,  7, 22, 0xfd469501) \
+	MD5_STEP(OPS, F, a, b, c, d,  8,  7, 0x698098d8) MD5_STEP(OPS, F, d, a, b, c,  9, 12, 0x8b44f7af) \
+	MD5_STEP(OPS, F, c, d, a, b, 10, 17, 0xffff5bb1) MD5_STEP(OPS, F, b, c, d, a, 11, 22, 0x895cd7be) \
+	MD5_STEP(OPS, F, a, b, c, d, 12,  7, 0x6b901122) MD5_STEP(OPS, F, d, a, b, c, 13, 12, 0xfd987193) \
+	MD5_STEP(OPS, F, c, d, a, b, 14, 17, 0xa679438e) MD5_STEP(OPS, F, b, c, d, a, 15, 22, 0x49b40821) \
+	MD5_STEP(OPS, G, a, b, c, d,  1,  5, 0xf61e2562) MD5_STEP(OPS, G, d, a, b, c,  6,  9, 0xc040b340) \
+	MD5_STEP(OPS, G, c, d, a, b, 11, 14, 0x265e5a51) MD5_STEP(OPS, G, b, c, d, a,  0, 20, 0xe9b6c7aa) \
+	MD5_STEP(OPS, G, a, b, c, d,  5,  5, 0xd62f105d) MD5_STEP(OPS, G, d, a, b, c, 10,  9, 0x02441453) \
+	MD5_STEP(OPS, G, c, d, a, b, 15, 14, 0xd8a1e681) MD5_STEP(OPS, G, b, c, d, a,  4, 20, 0xe7d3fbc8) \
+	MD5_STEP(OPS, G, a, b, c, d,  9,  5, 0x21e1cde6) MD5_STEP(OPS, G, d, a, b, c, 14,  9, 0xc33707d6) \
+	MD5_STEP(OPS, G, c, d, a, b,  3, 14, 0xf4d50d87) MD5_STEP(OPS, G, b, c, d, a,  8, 20, 0x455a14ed) \
+	MD5_STEP(OPS, G, a, b, c, d, 13,  5, 0xa9e3e905) MD5_STEP(OPS, G, d, a, b, c,  2,  9, 0xfcefa3f8) \
+	MD5_STEP(OPS, G, c, d, a, b,  7, 14, 0x676f02d9) MD5_STEP(OPS, G, b, c, d, a, 12, 20, 0x8d2a4c8a) \
+	MD5_STEP(OPS, H, a, b, c, d,  5,  4, 0xfffa3942) MD5_STEP(OPS, H, d, a, b, c,  8, 11, 0x8771f681) \
+	MD5_STEP(OPS, H, c, d, a, b, 11, 16, 0x6d9d6122) MD5_STEP(OPS, H, b, c, d, a, 14, 23, 0xfde5380c) \
+	MD5_STEP(OPS, H, a, b, c, d,  1,  4, 0xa4beea44) MD5_STEP(OPS, H, d, a, b, c,  4, 11, 0x4bdecfa9) \
+	MD5_STEP(OPS, H, c, d, a, b,  7, 16, 0xf6bb4b60) MD5_STEP(OPS, H, b, c, d, a, 10, 23, 0xbebfbc70) \
+	MD5_STEP(OPS, H, a, b, c, d, 13,  4, 0x289b7ec6) MD5_STEP(OPS, H, d, a, b, c,  0, 11, 0xeaa127fa) \
+	MD5_STEP(OPS, H, c, d, a, b,  3, 16, 0xd4ef3085) MD5_STEP(OPS, H, b, c, d, a,  6, 23, 0x04881d05) \
+	MD5_STEP(OPS, H, a, b, c, d,  9,  4, 0xd9d4d039) MD5_STEP(OPS, H, d, a, b, c, 12, 11, 0xe6db99e5) \
+	MD5_STEP(OPS, H, c, d, a, b, 15, 16, 0x1fa27cf8) MD5_STEP(OPS, H, b, c, d, a,  2, 23, 0xc4ac5665) \
+	MD5_STEP(OPS, I, a, b, c, d,  0,  6, 0xf4292244) MD5_STEP(OPS, I, d, a, b, c,  7, 10, 0x432aff97) \
+	MD5_STEP(OPS, I, c, d, a, b, 14, 15, 0xab9423a7) MD5_STEP(OPS, I, b, c, d, a,  5, 21, 0xfc93a039) \
+	MD5_STEP(OPS, I, a, b, c, d, 12,  6, 0x655b59c3) MD5_STEP(OPS, I, d, a, b, c,  3, 10, 0x8f0ccc92) \
+	MD5_STEP(OPS, I, c, d, a, b, 10, 15, 0xffeff47d) MD5_STEP(OPS, I, b, c, d, a,  1, 21, 0x85845dd1) \
+	MD5_STEP(OPS, I, a, b, c, d,  8,  6, 0x6fa87e4f) MD5_STEP(OPS, I, d, a, b, c, 15, 10, 0xfe2ce6e0) \
+	MD5_STEP(OPS, I, c, d, a, b,  6, 15, 0xa3014314) MD5_STEP(OPS, I, b, c, d, a, 13, 21, 0x4e0811a1) \
+	MD5_STEP(OPS, I, a, b, c, d,  4,  6, 0xf7537e82) MD5_STEP(OPS, I, d, a, b, c, 11, 10, 0xbd3af235) \
+	MD5_STEP(OPS, I, c, d, a, b,  2, 15, 0x2ad7d2bb) MD5_STEP(OPS, I, b, c, d, a,  9, 21, 0xeb86d391) \
+  }
+
+/* Transposes 4x4 words inside each 128-bit lane: r0..r3 hold 16 bytes of 4 messages,
+ * x[0..3] get the word 0..3 of each of them */
+#define MD5_TRANSPOSE(P, x, r0, r1, r2, r3) \
+  { \
+	t0 = P##_unpacklo_epi32(r0, r1); \
+	t1 = P##_unpacklo_epi32(r2, r3); \
+	t2 = P##_unpackhi_epi32(r0, r1); \
+	t3 = P##_unpackhi_epi32(r2, r3); \
+	(x)[0] = P##_unpacklo_epi64(t0, t1); \
+	(x)[1] = P##_unpackhi_epi64(t0, t1); \
+	(x)[2] = P##_unpacklo_epi64(t2, t3); \
+	(x)[3] = P##_unpackhi_epi64(t2, t3); \
+  }
+
+/* Defines a kernel for one vector type. LOAD(p, k, off) gathers 16 bytes at offset off
+ * of the messages k, k+4, k+8... in the successive 128-bit lanes of a vector. */
+#define MD5_DEFINE_KERNEL(NAME, TARGET, VEC, P, SI, OPS, LOAD) \
+MD5_TARGET(TARGET) \
+static void NAME(Uint32 *state, const unsigned char **p, const size_t *strides, size_t nbBlocks) \
+{ \
+	const int width = sizeof(VEC) / 4; \
+	VEC a, b, c, d, aa, bb, cc, dd, x[16], r0, r1, r2, r3, t0, t1, t2, t3; \
+	size_t n; \
+	int q, l; \
+	\
+	a = P##_loadu_##SI((const VEC*)&(state[0*width])); \
+	b = P##_loadu_##SI((const VEC*)&(state[1*width])); \
+	c = P##_loadu_##SI((const VEC*)&(state[2*width])); \
+	d = P##_loadu_##SI((const VEC*)&(state[3*width])); \
+	\
+	for (n=0 ; n < nbBlocks ; n++) \
+	{ \
+		for (q=0 ; q < 4 ; q++) \
+		{ \
+			r0 = LOAD(p, 0, 16*q); \
+			r1 = LOAD(p, 1, 16*q); \
+			r2 = LOAD(p, 2, 16*q); \
+			r3 = LOAD(p, 3, 16*q); \
+			MD5_TRANSPOSE(P, &(x[4*q]), r0, r1, r2, r3); \
+		} \
+		for (l=0 ; l < width ; l++) \
+			p[l] += strides[l]; \
+		\
+		aa = a; bb = b; cc = c; dd = d; \
+		MD5_STEPS(OPS); \
+		a = P##_add_epi32(a, aa); \
+		b = P##_add_epi32(b, bb); \
+		c = P##_add_epi32(c, cc); \
+		d = P##_add_epi32(d, dd); \
+	} \
+	\
+	P##_storeu_##SI((VEC*)&(state[0*width]), a); \
+	P##_storeu_##SI((VEC*)&(state[1*width]), b); \
+	P##_storeu_##SI((VEC*)&(state[2*width]), c); \
+	P##_storeu_##SI((VEC*)&(state[3*width]), d); \
+}
+
+#define LOAD128(p, k, off)		_mm_loadu_si128((const __m128i*)((p)[k] + (off)))
+
+#define SSE2_ADD(x, y)			_mm_add_epi32(x, y)
+#define SSE2_SET1(t)			_mm_set1_epi32((int)(t))
+#define SSE2_ROTL(x, s)			_mm_or_si128(_mm_slli_epi32(x, s), _mm_srli_epi32(x, 32-(s)))
+#define SSE2_F(x, y, z)			_mm_xor_si128(z, _mm_and_si128(x, _mm_xor_si128(y, z)))
+#define SSE2_G(x, y, z)			_mm_xor_si128(y, _mm_and_si128(z, _mm_xor_si128(x, y)))
+#define SSE2_H(x, y, z)			_mm_xor_si128(_mm_xor_si128(x, y), z)
+#define SSE2_I(x, y, z)			_mm_xor_si128(y, _mm_or_si128(x, _mm_xor_si128(z, _mm_set1_epi32(-1))))
+#define SSE2_LOAD(p, k, off)	LOAD128(p, k, off)
+
+MD5_DEFINE_KERNEL(HashBlocks_SSE2, "sse2", __m128i, _mm, si128, SSE2, SSE2_LOAD)
+
+#define AVX2_ADD(x, y)			_mm256_add_epi32(x, y)
+#define AVX2_SET1(t)			_mm256_set1_epi32((int)(t))
+#define AVX2_ROTL(x, s)			_mm256_or_si256(_mm256_slli_epi32(x, s), _mm256_srli_epi32(x, 32-(s)))
+#define AVX2_F(x, y, z)			_mm256_xor_si256(z, _mm256_and_si256(x, _mm256_xor_si256(y, z)))
+#define AVX2_G(x, y, z)			_mm256_xor_si256(y, _mm256_and_si256(z, _mm256_xor_si256(x, y)))
+#define AVX2_H(x, y, z)			_mm256_xor_si256(_mm256_xor_si256(x, y), z)
+#define AVX2_I(x, y, z)			_mm256_xor_si256(y, _mm256_or_si256(x, _mm256_xor_si256(z, _mm256_set1_epi32(-1))))
+#define AVX2_LOAD(p, k, off)	_mm256_inserti128_si256(_mm256_castsi128_si256(LOAD128(p, k, off)), LOAD128(p, (k)+4, off), 1)
+
+MD5_DEFINE_KERNEL(HashBlocks_AVX2, "avx2", __m256i, _mm256, si256, AVX2, AVX2_LOAD)
+
+#ifdef MD5_SIMD_AVX512
+
+//The boolean functions are single ternary logic instructions, with their truth table as immediate
+#define AVX512_ADD(x, y)		_mm512_add_epi32(x, y)
+#define AVX512_SET1(t)			_mm512_set1_epi32((int)(t))
+#define AVX512_ROTL(x, s)		_mm512_rol_epi32(x, s)
+#define AVX512_F(x, y, z)		_mm512_ternarylogic_epi32(x, y, z, 0xCA)
+#define AVX512_G(x, y, z)		_mm512_ternarylogic_epi32(x, y, z, 0xE4)
+#define AVX512_H(x, y, z)		_mm512_ternarylogic_epi32(x, y, z, 0x96)
+#define AVX512_I(x, y, z)		_mm512_ternarylogic_epi32(x, y, z, 0x39)
+#define AVX512_LOAD(p, k, off) \
+	_mm512_inserti32x4(_mm512_inserti32x4(_mm512_inserti32x4(_mm512_castsi128_si512(LOAD128(p, k, off)), \
+		LOAD128(p, (k)+4, off), 1), LOAD128(p, (k)+8, off), 2), LOAD128(p, (k)+12, off), 3)
+
+MD5_DEFINE_KERNEL(HashBlocks_AVX512, "avx512f", __m512i, _mm512, si512, AVX512, AVX512_LOAD)
+
+#endif	//MD5_SIMD_AVX512
+
+#endif	//MD5_SIMD_X86
+
+
+//Best first
+static const MD5KernelDesc md5Kernels[] =
+{
+#ifdef MD5_SIMD_X86
+#ifdef MD5_SIMD_AVX512
+	{"avx512", 16, CPU_AVX512BW, HashBlocks_AVX512},
+#endif
+	{"avx2", 8, CPU_AVX2, HashBlocks_AVX2},
+	{"sse2", 4, CPU_SSE2, HashBlocks_SSE2},
+#endif
+	{"scalar", 1, 0, NULL}
+};
+
+static const MD5KernelDesc *selectedKernel = NULL;
+static pthread_once_t selectedKernelOnce = PTHREAD_ONCE_INIT;
+
+
+void ComputeMD5Streams(MD5Stream *streams, size_t nbStreams)
+{
+	MD5Lane lanes[MAX_MD5_LANES];
+	Uint32 state[4*MAX_MD5_LANES];
+	const unsigned char *p[MAX_MD5_LANES];
+	size_t strides[MAX_MD5_LANES], i, next = 0;
+	MD5Stream **order;
+	Uint64 nbBlocks;
+	int width, l, active = 0;
+
+	pthread_once(&selectedKernelOnce, SelectMD5Kernel);
+	width = selectedKernel->width;
+	if (!selectedKernel->kernel || nbStreams < 2)
+	{
+		for (i=0 ; i < nbStreams ; i++)
+			ComputeStreamMD5(&(streams[i]));
+		return;
+	}
+
+	//Longest first, so that the lanes run out of messages at about the same time
+	if (!(order = malloc(sizeof(MD5Stream*) * nbStreams)))
+	{
+		for (i=0 ; i < nbStreams ; i++)
+			ComputeStreamMD5(&(streams[i]));
+		return;
+	}
+	for (i=0 ; i < nbStreams ; i++)
+		order[i] = &(streams[i]);
+	qsort(order, nbStreams, sizeof(MD5Stream*), CompareStreamSizes);
+
+	for (l=0 ; l < width ; l++)
+		active += StartLane(&(lanes[l]), next < nbStreams ? order[next++] : NULL, state, width, l, p, strides);
+
+	while (active > 0)
+	{
+		//A message left alone is not worth the whole vector
+		if (active == 1)
+		{
+			for (l=0 ; !lanes[l].stream ; l++);
+			if (!lanes[l].inTail)
+			{
+				FinishLaneScalar(&(lanes[l]), state, width, l, p[l]);
+				break;
+			}
+		}
+
+		//Runs until the first lane reaches the end of its part
+		nbBlocks = 0;
+		for (l=0 ; l < width ; l++)
+		{
+			if (lanes[l].stream && (!nbBlocks || lanes[l].blocksLeft < nbBlocks))
+				nbBlocks = lanes[l].blocksLeft;
+		}
+		selectedKernel->kernel(state, p, strides, (size_t)nbBlocks);
+
+		for (l=0 ; l < width ; l++)
+		{
+			if (!lanes[l].stream || (lanes[l].blocksLeft -= nbBlocks) > 0)
+				continue;
+			if (!lanes[l].inTail)
+				StartLaneTail(&(lanes[l]), &(p[l]));
+			else
+			{
+				for (i=0 ; i < 16 ; i++)
+					lanes[l].stream->digest[i] = (unsigned char)(state[(i/4)*width + l] >> (8*(i%4)));
+				if (!StartLane(&(lanes[l]), next < nbStreams ? order[next++] : NULL, state, width, l, p, strides))
+					active--;
+			}
+		}
+	}
+
+	free(order);
+}
+
+const char* GetMD5KernelName(void)
+{
+	pthread_once(&selectedKernelOnce, SelectMD5Kernel);
+	return selectedKernel->name;
+}
+
+int GetMD5KernelWidth(void)
+{
+	pthread_once(&selectedKernelOnce, SelectMD5Kernel);
+	return selectedKernel->width;
+}
+
+static void SelectMD5Kernel(void)
+{
+	unsigned int features = GetCpuFeatures();
+	const char *forced = getenv("MD5_KERNEL");
+	int i, n = sizeof(md5Kernels) / sizeof(md5Kernels[0]);
+
+	selectedKernel = &(md5Kernels[n-1]);
+	for (i=0 ; i < n ; i++)
+	{
+		if ((md5Kernels[i].cpuFeatures & features) != md5Kernels[i].cpuFeatures)
+			continue;
+		if (!forced || !strcmp(forced, md5Kernels[i].name))
+		{
+			selectedKernel = &(md5Kernels[i]);
+			break;
+		}
+	}
+}
+
+static int CompareStreamSizes(const void *a, const void *b)
+{
+	Uint64 sa = (*(MD5Stream* const*)a)->size, sb = (*(MD5Stream* const*)b)->size;
+	return sa < sb ? 1 : (sa > sb ? -1 : 0);
+}
+
+//Gives the lane l its message, or leaves it idle on a zero block if stream is NULL.
+//Returns 1 if the lane has a message.
+static int StartLane(MD5Lane *lane, MD5Stream *stream, Uint32 *state, int width, int l,
+		const unsigned char **p, size_t *strides)
+{
+	lane->stream = stream;
+	if (!stream)
+	{
+		p[l] = zeroBlock;
+		strides[l] = 0;
+		return 0;
+	}
+
+	state[0*width + l] = 0x67452301;
+	state[1*width + l] = 0xefcdab89;
+	state[2*width + l] = 0x98badcfe;
+	state[3*width + l] = 0x10325476;
+	strides[l] = 64;
+
+	lane->inTail = 0;
+	lane->blocksLeft = stream->size / 64;
+	p[l] = stream->data;
+	if (!lane->blocksLeft)
+		StartLaneTail(lane, &(p[l]));
+	return 1;
+}
+
+//The bytes after the whole blocks, the 0x80 byte, zeroes and the size in bits: 1 or 2 blocks.
+//*p is the block pointer of the lane.
+static void StartLaneTail(MD5Lane *lane, const unsigned char **p)
+{
+	MD5Stream *stream = lane->stream;
+	size_t rest = (size_t)(stream->size % 64), i;
+	Uint64 nbBits = stream->size << 3;
+
+	lane->inTail = 1;
+	lane->blocksLeft = rest < 56 ? 1 : 2;
+	memset(lane->tail, 0, sizeof(lane->tail));
+	memcpy(lane->tail, stream->data + (stream->size - rest), rest);
+	lane->tail[rest] = 0x80;
+	for (i=0 ; i < 8 ; i++)
+		lane->tail[lane->blocksLeft*64 - 8 + i] = (unsigned char)(nbBits >> (8*i));
+
+	*p = lane->tail;
+}
+
+//Finishes the message of the lane l with Md5.c, from the state of the lane.
+//p points to the first block that the lane has not hashed yet.
+static void FinishLaneScalar(MD5Lane *lane, Uint32 *state, int width, int l, const unsigned char *p)
+{
+	MD5_CTX mdContext;
+	MD5Stream *stream = lane->stream;
+	int w;
+
+	memset(&mdContext, 0, sizeof(MD5_CTX));
+	for (w=0 ; w < 4 ; w++)
+		mdContext.buf[w] = state[w*width + l];
+	mdContext.count = (Uint64)(p - stream->data);
+
+	MD5Update(&mdContext, p, stream->size - mdContext.count);
+	MD5Final(&mdContext);
+	memcpy(stream->digest, mdContext.digest, 16);
+}
+
+static void ComputeStreamMD5(MD5Stream *stream)
+{
+	MD5_CTX mdContext;
+
+	MD5Init(&mdContext);
+	MD5Update(&mdContext, stream->data, stream->size);
+	MD5Final(&mdContext);
+	memcpy(stream->digest, mdContext.digest, 16);
+}
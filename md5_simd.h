@@ -0,0 +1,43 @@
+/**** LICENSE INFORMATION ****
+IDEA - md5_simd.h
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MD5_SIMD_H_
+#define MD5_SIMD_H_
+
+#include "idea.h"
+
+//One message to hash with ComputeMD5Streams
+typedef struct
+{
+	const unsigned char *data;
+	Uint64 size;
+	unsigned char digest[16];
+} MD5Stream;
+
+//Computes the MD5 of each stream. The streams are independent and are hashed
+//several at a time, one per lane of the selected kernel: a lane takes the next
+//stream as soon as its own is done, so streams of any sizes can be mixed.
+void ComputeMD5Streams(MD5Stream *streams, size_t nbStreams);
+
+//Kernel chosen at startup (CPUID, or the MD5_KERNEL environment variable)
+const char* GetMD5KernelName(void);
+int GetMD5KernelWidth(void);
+
+#endif /* MD5_SIMD_H_ */
@@ -0,0 +1,154 @@
+/**** LICENSE INFORMATION ****
+IDEA - patharena.c
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* A list of millions of files holds mostly the same directories over and over, and
+ * a small allocation per path costs more than the path itself. The paths are copied
+ * back to back into chunks instead, and the directory of a path is not copied again
+ * while the paths stored after it are in the same directory, as a listing gives them.
+ * A path never refers to another chunk, since a directory that cannot be shared is
+ * copied in the same allocation as the name, so the chunks can be freed in order once
+ * the paths they hold have been used. */
+
+#include "patharena.h"
+
+#define ARENA_CHUNK_SIZE	(256*1024)
+
+static void* AllocArena(PathArena *arena, size_t size, size_t align, int mark);
+
+
+void InitPathArena(PathArena *arena)
+{
+	memset(arena, 0, sizeof(PathArena));
+}
+
+const ArenaPath* StoreArenaPath(PathArena *arena, const char *path, int mark)
+{
+	const char *name = path, *p;
+	size_t dirLength, nameLength;
+	ArenaChunk *tail = arena->tail;
+	ArenaPath *stored;
+	char *dir = NULL;
+
+	for (p = path ; *p ; p++)
+	{
+		if (*p == '/' || *p == '\\')
+			name = p+1;
+	}
+	dirLength = name - path;
+	nameLength = strlen(name);
+
+	//The directory of the path before can be shared only if the path fits in the same chunk.
+	//Otherwise the directory is copied right after the name, in the same allocation.
+	if (dirLength && !(arena->lastDir && arena->lastDirLength == dirLength && !memcmp(arena->lastDir, path, dirLength)
+			&& tail->size - tail->used >= sizeof(ArenaPath) + sizeof(void*) + nameLength + 1))
+	{
+		if (!(stored = AllocArena(arena, sizeof(ArenaPath) + nameLength+1 + dirLength+1, sizeof(void*), mark)))
+			return NULL;
+		dir = stored->name + nameLength+1;
+		memcpy(dir, path, dirLength);
+		dir[dirLength] = '\0';
+		arena->lastDir = dir;
+		arena->lastDirLength = dirLength;
+	}
+	else if (!(stored = AllocArena(arena, sizeof(ArenaPath) + nameLength + 1, sizeof(void*), mark)))
+		return NULL;
+
+	stored->dir = dir ? dir : dirLength ? arena->lastDir : NULL;
+	memcpy(stored->name, name, nameLength+1);
+	return stored;
+}
+
+const char* StoreArenaString(PathArena *arena, const char *str, int mark)
+{
+	size_t length = strlen(str);
+	char *stored = AllocArena(arena, length+1, 1, mark);
+
+	if (stored)
+		memcpy(stored, str, length+1);
+	return stored;
+}
+
+size_t GetArenaPath(const ArenaPath *path, char *buffer, size_t size)
+{
+	size_t dirLength = path->dir ? strlen(path->dir) : 0, nameLength = strlen(path->name);
+
+	if (dirLength + nameLength < size)
+	{
+		if (dirLength)
+			memcpy(buffer, path->dir, dirLength);
+		memcpy(buffer+dirLength, path->name, nameLength+1);
+	}
+	return dirLength + nameLength;
+}
+
+//The tail chunk is kept, the next strings go there
+void ReleasePathArena(PathArena *arena, int mark)
+{
+	ArenaChunk *chunk;
+
+	while ((chunk = arena->head) && chunk != arena->tail && chunk->lastMark < mark)
+	{
+		arena->head = chunk->next;
+		free(chunk);
+	}
+}
+
+void FreePathArena(PathArena *arena)
+{
+	ArenaChunk *chunk;
+
+	while ((chunk = arena->head))
+	{
+		arena->head = chunk->next;
+		free(chunk);
+	}
+	InitPathArena(arena);
+}
+
+
+//A new chunk, when the tail one is full, starts without any directory to share
+static void* AllocArena(PathArena *arena, size_t size, size_t align, int mark)
+{
+	ArenaChunk *chunk = arena->tail;
+	size_t offset = 0;
+
+	if (chunk)
+		offset = (((size_t)(chunk->data + chunk->used) + align-1) & ~(align-1)) - (size_t)chunk->data;
+
+	if (!chunk || offset + size > chunk->size)
+	{
+		//malloc aligns the chunk for anything, the data comes at an offset
+		if (!(chunk = malloc(sizeof(ArenaChunk) + align + (size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE))))
+			return NULL;
+		chunk->next = NULL;
+		chunk->size = align + (size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE);
+		offset = (((size_t)chunk->data + align-1) & ~(align-1)) - (size_t)chunk->data;
+		if (arena->tail)
+			arena->tail->next = chunk;
+		else
+			arena->head = chunk;
+		arena->tail = chunk;
+		arena->lastDir = NULL;
+	}
+
+	chunk->used = offset + size;
+	chunk->lastMark = mark;
+	return chunk->data + offset;
+}
@@ -0,0 +1,65 @@
+/**** LICENSE INFORMATION ****
+IDEA - patharena.h
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef PATHARENA_H_
+#define PATHARENA_H_
+
+#include "idea.h"
+
+//A path stored in an arena. The directory part, up to the last separator included,
+//is stored once for the paths stored one after the other in the same directory.
+typedef struct
+{
+	const char *dir;				//NULL if the path has no directory part
+	char name[];
+} ArenaPath;
+
+typedef struct ArenaChunk
+{
+	struct ArenaChunk *next;
+	size_t size, used;
+	int lastMark;					//Mark of the last string stored in the chunk
+	char data[];
+} ArenaChunk;
+
+//Strings stored back to back in big chunks, freed all together once they are not used anymore.
+//Each string stored is tagged with a mark, increasing, like the index of a file in a list.
+typedef struct
+{
+	ArenaChunk *head, *tail;
+	const char *lastDir;			//In the tail chunk
+	size_t lastDirLength;
+} PathArena;
+
+void InitPathArena(PathArena *arena);
+
+//Returns NULL if the memory is lacking
+const ArenaPath* StoreArenaPath(PathArena *arena, const char *path, int mark);
+const char* StoreArenaString(PathArena *arena, const char *str, int mark);
+
+//Writes the whole path to buffer, if it fits.
+//Returns the length of the path, which does not fit if it is size or more.
+size_t GetArenaPath(const ArenaPath *path, char *buffer, size_t size);
+
+//Frees the chunks holding only strings marked before mark
+void ReleasePathArena(PathArena *arena, int mark);
+void FreePathArena(PathArena *arena);
+
+#endif /* PATHARENA_H_ */
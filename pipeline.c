@@ -0,0 +1,926 @@
+/**** LICENSE INFORMATION ****
+IDEA - pipeline.c
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Three stages over a ring of buffers: a reader thread fills the free buffers,
+ * the calling thread encrypts them (spreading each one over the thread pool),
+ * and a writer thread empties them in order. Each buffer goes through
+ * FREE -> READ -> PROCESSED -> FREE, so at most one stage owns it at a time.
+ *
+ * The plain data is hashed by the stage that sees it in order: the reader when
+ * encrypting, the writer when decrypting. The leaves of a tree hash are computed
+ * in parallel by the crypto stage instead, right before or after the cipher,
+ * several at a time in the lanes of the multi-buffer MD5.
+ *
+ * Big files bypass stdio when possible. With io_uring, the calling thread keeps
+ * up to the queue depth of reads and writes in flight and encrypts the buffers
+ * in order as their reads complete, so the device works during the cipher.
+ * Otherwise they are memory-mapped: there is no I/O stage to overlap then, the
+ * page faults do the reading and the cipher writes straight into the pages of
+ * the output file.
+ *
+ * The direct engine, only used when asked for, reads and writes the big files around
+ * the system cache, so that they do not evict what the other programs keep there.
+ * It keeps the reader and writer threads; they copy the data between the slots and
+ * their own sector-aligned buffers, since the data does not start on a sector
+ * boundary in the files, with the header before it. */
+
+#include "pipeline.h"
+#include "threadpool.h"
+#include "md5_simd.h"
+#include "filemap.h"
+#include "uring.h"
+#include "bufpool.h"
+#include "directio.h"
+
+#define MAX_PIPELINE_SLOTS	16
+#define MAX_QUEUE_DEPTH		256
+#define MAP_WINDOW_SIZE		(sizeof(void*) >= 8 ? 1073741824 : 67108864)	//Rounded down to whole buffers by RunMapped
+
+#define SLOT_FREE			0
+#define SLOT_READ			1
+#define SLOT_PROCESSED		2
+#define SLOT_READING		3	//Only with io_uring, request in flight
+#define SLOT_WRITING		4
+
+typedef struct
+{
+	Uint16 *data;
+	size_t size;		//Bytes read, 0 marks the end of the input
+	int state;
+} PipelineSlot;
+
+//A buffer of the io_uring queue
+typedef struct
+{
+	Uint64 offset;		//Of its chunk, in the input data and in the output data
+	size_t size;		//Bytes to read, then to write
+	size_t done;		//Bytes of the request in flight already transferred
+	int state;
+} QueuedSlot;
+
+//The direct transfers of the reader and writer threads
+typedef struct
+{
+	DirectFile in, out;
+	Uint8 *inBuf, *outBuf;		//dataBufSize + DIRECT_IO_ALIGNMENT bytes each
+	Uint64 inOffset;			//Of the next read, aligned
+	size_t inSkip;				//Where the data starts in the first sector, and where the bytes read
+								//past a chunk are carried over in inBuf, until the next read
+	Uint64 inputLeft;
+	Uint64 outOffset;			//Of outBuf, aligned
+	size_t outSkip;				//Bytes of the first sector before the data, not ours to write
+	size_t outUsed;				//Bytes in outBuf, outSkip included
+} DirectStreams;
+
+typedef struct
+{
+	MD5Stream *leaves;
+	size_t nbLeaves;
+} LeafGroupStruct;
+
+typedef struct
+{
+	IdeaContext *ctx;
+	FILE *fileIn, *fileOut;
+	int encrypt;
+	int cipherMode;
+	Uint64 nonce;
+	Uint64 position;			//Bytes already through the crypto stage
+	Uint64 inputLeft;			//Bytes left to read, the input stops there and not at the end of the file
+	Uint64 outputLeft;
+	Uint64 plainLeft;			//Same as outputLeft, for the crypto stage
+	Uint64 skipLeft;			//Plain bytes to drop before the output, when decrypting a range
+	int hashMode;
+	MD5_CTX md5;
+	MD5Stream *leaves;			//One buffer worth of leaves
+	LeafGroupStruct *leafGroups;
+	PoolJob *leafJobs;
+	Uint16 *chunkTags;
+	size_t leavesPerChunk;
+	Uint64 nbLeavesHashed;
+	MD5_CTX chunkMd5;			//Of the chunk of the next leaf
+	PipelineSlot slots[MAX_PIPELINE_SLOTS];
+	int nbSlots;
+	DirectStreams *direct;		//Used by ReadSlot and WriteSlot instead of the streams if set
+	Uint8 *trailer;				//Decrypting a stream: gets its trailer, once the reader reaches it
+	Uint8 held[FILE_TRAILER_SIZE+1];	//Read past the data of the slot before, may be the trailer
+	size_t nbHeld;
+	int inputEnded;
+	Uint64 nbRead;				//Plain bytes read so far, in the reader
+	int error;
+	pthread_mutex_t mutex;
+	pthread_cond_t stateChanged;
+} Pipeline;
+
+static int RunPipeline(Pipeline *pl, Uint64 inputSize, int bypass, Uint16 *checkSum);
+static void* ReaderMain(void *data);
+static void* WriterMain(void *data);
+static void RunThreaded(Pipeline *pl);
+static void RunSerial(Pipeline *pl);
+static int RunBypassingStdio(Pipeline *pl, Uint64 inputSize, Uint64 outputSize);
+static int RunQueued(Pipeline *pl, Uint64 inputSize, Uint64 outputSize);
+static void QueueSlotRequest(IoRing *ring, QueuedSlot *slot, int i, int fd, Uint64 fileOffset);
+static int RunMapped(Pipeline *pl, Uint64 inputSize, Uint64 outputSize);
+static int RunDirect(Pipeline *pl, Uint64 inputSize, Uint64 outputSize);
+static void RunCryptoStage(Pipeline *pl, pthread_t reader, pthread_t writer);
+
+static int ReadSlot(Pipeline *pl, PipelineSlot *slot);
+static int ProcessSlot(Pipeline *pl, PipelineSlot *slot);
+static int ProcessData(Pipeline *pl, const Uint16 *in, Uint16 *out, size_t size);
+static void ZeroPadding(Uint8 *data, size_t size);
+static int WriteSlot(Pipeline *pl, PipelineSlot *slot);
+static Sint64 ReadDirectData(DirectStreams *ds, Uint8 *data, size_t size);
+static Sint64 ReadStreamData(Pipeline *pl, Uint8 *data, size_t size);
+static int WriteDirectData(DirectStreams *ds, const Uint8 *data, size_t size);
+static void HashTreeLeaves(Pipeline *pl, const Uint16 *data, size_t size);
+static void* HashTreeLeafGroup(void *data);
+static void AddChunkLeaf(Pipeline *pl, const unsigned char *digest);
+static void EndChunkTag(Pipeline *pl);
+
+static int WaitSlotState(Pipeline *pl, PipelineSlot *slot, int state);
+static void SetSlotState(Pipeline *pl, PipelineSlot *slot, int state);
+static void SetPipelineError(Pipeline *pl, int error);
+
+
+int RunFilePipeline(IdeaContext *ctx, FILE *fileIn, FILE *fileOut, int encrypt, int cipherMode, Uint64 nonce,
+		Uint64 inputSize, Uint64 outputSize, int hashMode, Uint16 *checkSum, size_t chunkSize, Uint16 *chunkTags)
+{
+	Pipeline pl;
+
+	memset(&pl, 0, sizeof(Pipeline));
+	pl.ctx = ctx;
+	pl.fileIn = fileIn;
+	pl.fileOut = fileOut;
+	pl.encrypt = encrypt;
+	pl.cipherMode = cipherMode;
+	pl.nonce = nonce;
+	pl.outputLeft = pl.plainLeft = outputSize;
+	pl.hashMode = hashMode;
+	pl.chunkTags = hashMode == HASH_TREE ? chunkTags : NULL;
+	pl.leavesPerChunk = chunkSize / TREE_HASH_LEAF_SIZE;
+
+	return RunPipeline(&pl, inputSize, 1, checkSum);
+}
+
+int RunRangePipeline(IdeaContext *ctx, FILE *fileIn, FILE *fileOut, int cipherMode, Uint64 nonce, Uint64 position,
+		Uint64 inputSize, Uint64 plainSize, Uint64 skip, Uint64 outputSize, size_t chunkSize, Uint16 *chunkTags)
+{
+	Pipeline pl;
+
+	memset(&pl, 0, sizeof(Pipeline));
+	pl.ctx = ctx;
+	pl.fileIn = fileIn;
+	pl.fileOut = fileOut;
+	pl.cipherMode = cipherMode;
+	pl.nonce = nonce;
+	pl.position = position;
+	pl.plainLeft = plainSize;
+	pl.skipLeft = skip;
+	pl.outputLeft = outputSize;
+	pl.hashMode = chunkTags ? HASH_TREE : HASH_NONE;
+	pl.chunkTags = chunkTags;
+	pl.leavesPerChunk = chunkSize / TREE_HASH_LEAF_SIZE;
+	pl.nbLeavesHashed = chunkTags ? position / TREE_HASH_LEAF_SIZE : 0;
+
+	//The engines that bypass stdio write all the data they process
+	return RunPipeline(&pl, inputSize, !skip, NULL);
+}
+
+int RunStreamPipeline(IdeaContext *ctx, FILE *fileIn, FILE *fileOut, int encrypt, int cipherMode, Uint64 nonce,
+		int hashMode, Uint16 *checkSum, Uint64 *plainSize, Uint8 *trailer)
+{
+	Pipeline pl;
+	int r;
+
+	memset(&pl, 0, sizeof(Pipeline));
+	pl.ctx = ctx;
+	pl.fileIn = fileIn;
+	pl.fileOut = fileOut;
+	pl.encrypt = encrypt;
+	pl.cipherMode = cipherMode;
+	pl.nonce = nonce;
+	pl.outputLeft = pl.plainLeft = (Uint64)-1;
+	pl.hashMode = hashMode;
+	pl.trailer = encrypt ? NULL : trailer;
+
+	//Neither the size nor the offsets are known, only the reader and writer threads can go through
+	r = RunPipeline(&pl, (Uint64)-1, 0, checkSum);
+	*plainSize = pl.nbRead;
+	return r;
+}
+
+//The fields of pl describing the work are set
+static int RunPipeline(Pipeline *pl, Uint64 inputSize, int bypass, Uint16 *checkSum)
+{
+	IdeaContext *ctx = pl->ctx;
+	int i;
+
+	pl->nbSlots = ctx->nbDataBufs < MAX_PIPELINE_SLOTS ? ctx->nbDataBufs : MAX_PIPELINE_SLOTS;
+	for (i=0 ; i < pl->nbSlots ; i++)
+		pl->slots[i].data = &(ctx->dataBuf[i * (ctx->dataBufSize / sizeof(Uint16))]);
+
+	if (pl->hashMode == HASH_TREE)
+	{
+		i = (ctx->dataBufSize + TREE_HASH_LEAF_SIZE-1) / TREE_HASH_LEAF_SIZE;
+		pl->leaves = malloc(sizeof(MD5Stream) * i);
+		pl->leafGroups = malloc(sizeof(LeafGroupStruct) * i);
+		pl->leafJobs = malloc(sizeof(PoolJob) * i);
+		if (!pl->leaves || !pl->leafGroups || !pl->leafJobs)
+		{
+			LogMessage(ctx, "Unable to allocate the tree hash buffers.\n");
+			free(pl->leaves);
+			free(pl->leafGroups);
+			free(pl->leafJobs);
+			return PIPELINE_MEMORY_ERROR;
+		}
+	}
+
+	pl->inputLeft = inputSize;
+	MD5Init(&pl->md5);
+	pthread_mutex_init(&pl->mutex, NULL);
+	pthread_cond_init(&pl->stateChanged, NULL);
+
+	//Nothing to overlap with a single buffer of data, and bypassing stdio is only worth it for big files
+	if (inputSize <= ctx->dataBufSize || pl->nbSlots < 2)
+		RunSerial(pl);
+	else if (inputSize <= ctx->dataBufSize * pl->nbSlots || !bypass || !RunBypassingStdio(pl, inputSize, pl->outputLeft))
+		RunThreaded(pl);
+
+	pthread_mutex_destroy(&pl->mutex);
+	pthread_cond_destroy(&pl->stateChanged);
+	free(pl->leaves);
+	free(pl->leafGroups);
+	free(pl->leafJobs);
+
+	//The last chunk may have fewer leaves
+	if (!pl->error && pl->chunkTags && pl->nbLeavesHashed % pl->leavesPerChunk)
+		EndChunkTag(pl);
+	if (!pl->error && checkSum)
+	{
+		MD5Final(&pl->md5);
+		memcpy(checkSum, pl->md5.digest, sizeof(char)*16);
+	}
+
+	return pl->error;
+}
+
+static void RunThreaded(Pipeline *pl)
+{
+	pthread_t reader, writer;
+	int rc;
+
+	if ((rc = pthread_create(&reader, NULL, ReaderMain, pl)))
+	{
+		LogMessage(pl->ctx, "Unable to create the reader thread: return code from pthread_create() is %d\n", rc);
+		SetPipelineError(pl, PIPELINE_THREAD_ERROR);
+	}
+	else if ((rc = pthread_create(&writer, NULL, WriterMain, pl)))
+	{
+		LogMessage(pl->ctx, "Unable to create the writer thread: return code from pthread_create() is %d\n", rc);
+		SetPipelineError(pl, PIPELINE_THREAD_ERROR);
+		pthread_join(reader, NULL);
+	}
+	else
+		RunCryptoStage(pl, reader, writer);
+}
+
+static void RunCryptoStage(Pipeline *pl, pthread_t reader, pthread_t writer)
+{
+	PipelineSlot *slot;
+	int i, end;
+
+	for (i=0 ; ; i = (i+1) % pl->nbSlots)
+	{
+		slot = &(pl->slots[i]);
+		if (!WaitSlotState(pl, slot, SLOT_READ))
+			break;
+		//The end marker goes through to the writer as it is.
+		//The slot may be refilled as soon as it is handed over, so its size is checked before.
+		end = !slot->size;
+		if (!end && !ProcessSlot(pl, slot))
+			break;
+		SetSlotState(pl, slot, SLOT_PROCESSED);
+		if (end)
+			break;
+	}
+
+	pthread_join(reader, NULL);
+	pthread_join(writer, NULL);
+}
+
+
+static void* ReaderMain(void *data)
+{
+	Pipeline *pl = (Pipeline*)data;
+	PipelineSlot *slot;
+	int i;
+
+	for (i=0 ; ; i = (i+1) % pl->nbSlots)
+	{
+		slot = &(pl->slots[i]);
+		if (!WaitSlotState(pl, slot, SLOT_FREE))
+			break;
+		if (!ReadSlot(pl, slot))
+			break;
+		SetSlotState(pl, slot, SLOT_READ);
+		if (!slot->size)
+			break;
+	}
+
+	return NULL;
+}
+
+static void* WriterMain(void *data)
+{
+	Pipeline *pl = (Pipeline*)data;
+	PipelineSlot *slot;
+	int i;
+
+	for (i=0 ; ; i = (i+1) % pl->nbSlots)
+	{
+		slot = &(pl->slots[i]);
+		if (!WaitSlotState(pl, slot, SLOT_PROCESSED) || !slot->size)
+			break;
+		if (!WriteSlot(pl, slot))
+			break;
+		SetSlotState(pl, slot, SLOT_FREE);
+	}
+
+	return NULL;
+}
+
+static void RunSerial(Pipeline *pl)
+{
+	PipelineSlot *slot = &(pl->slots[0]);
+
+	while (ReadSlot(pl, slot) && slot->size)
+	{
+		if (!ProcessSlot(pl, slot) || !WriteSlot(pl, slot))
+			break;
+	}
+}
+
+//The I/O engines that bypass stdio, in order of preference, or only the one asked for.
+//Returns 0 if none of them can handle the files.
+static int RunBypassingStdio(Pipeline *pl, Uint64 inputSize, Uint64 outputSize)
+{
+	int engine = pl->ctx->ioEngine;
+
+	if (engine == IO_ENGINE_DIRECT)
+		return RunDirect(pl, inputSize, outputSize);
+	if ((engine == IO_ENGINE_AUTO || engine == IO_ENGINE_URING) && RunQueued(pl, inputSize, outputSize))
+		return 1;
+	return (engine == IO_ENGINE_AUTO || engine == IO_ENGINE_MMAP) && RunMapped(pl, inputSize, outputSize);
+}
+
+//Chunk k of the data goes through buffer k % nbBufs, once chunk k - nbBufs has been written.
+//Reads and writes complete in any order, the cipher still goes through the chunks in order.
+//Returns 0 if io_uring is not available, so that the caller uses something else.
+static int RunQueued(Pipeline *pl, Uint64 inputSize, Uint64 outputSize)
+{
+	IoRing ring;
+	QueuedSlot *slots, *slot;
+	Uint8 **bufs;
+	size_t bufSize = pl->ctx->dataBufSize, n;
+	Uint64 nextRead = 0, nextCrypto = 0, nbWritten = 0, nbChunks = (inputSize + bufSize-1) / bufSize, tag;
+	Sint64 inOffset = GetFilePosition(pl->fileIn), outOffset = GetFilePosition(pl->fileOut);
+	int fdIn = fileno(pl->fileIn), fdOut = fileno(pl->fileOut), nbBufs = pl->ctx->queueDepth, i, result, completed;
+
+	if (nbBufs > MAX_QUEUE_DEPTH)
+		nbBufs = MAX_QUEUE_DEPTH;
+	if (nbBufs < 2)
+		nbBufs = 2;
+
+	//The streams are left alone until the end, what the output one still buffers goes first
+	if (inOffset < 0 || outOffset < 0 || fdIn < 0 || fdOut < 0 || fflush(pl->fileOut) || !OpenIoRing(&ring, nbBufs))
+		return 0;
+
+	slots = calloc(nbBufs, sizeof(QueuedSlot));
+	bufs = calloc(nbBufs, sizeof(Uint8*));
+	for (i=0 ; slots && bufs && i < nbBufs && (bufs[i] = TakeBuffer(bufSize)) ; i++);
+	if (!slots || !bufs || i < nbBufs || !RegisterIoBuffers(&ring, bufs, nbBufs, bufSize))
+	{
+		LogMessage(pl->ctx, "Unable to allocate the I/O queue buffers.\n");
+		SetPipelineError(pl, PIPELINE_MEMORY_ERROR);
+	}
+
+	while (nbWritten < nbChunks && !pl->error)
+	{
+		//Every free buffer gets the next chunk to read
+		for ( ; nextRead < nbChunks && slots[nextRead % nbBufs].state == SLOT_FREE ; nextRead++)
+		{
+			slot = &(slots[nextRead % nbBufs]);
+			slot->offset = nextRead * bufSize;
+			slot->size = inputSize - slot->offset < bufSize ? (size_t)(inputSize - slot->offset) : bufSize;
+			slot->done = 0;
+			slot->state = SLOT_READING;
+			QueueSlotRequest(&ring, slot, nextRead % nbBufs, fdIn, (Uint64)inOffset);
+		}
+
+		//The cipher runs on the pool while the kernel goes on with the requests in flight,
+		//but the completions already there come first, to keep the queue full
+		i = nextCrypto % nbBufs;
+		completed = GetIoCompletion(&ring, 0, &tag, &result);
+		if (!completed && nextCrypto < nbChunks && slots[i].state == SLOT_READ)
+		{
+			slot = &(slots[i]);
+			n = (slot->size+7)/8 * 8;
+			ZeroPadding(bufs[i], slot->size);
+			if (pl->hashMode == HASH_MD5 && pl->encrypt)
+				MD5Update(&pl->md5, bufs[i], slot->size);
+			if (!ProcessData(pl, (const Uint16*)bufs[i], (Uint16*)bufs[i], slot->size))
+				break;
+
+			//The output may end before the last block: counter mode, padding removed
+			if (n > pl->outputLeft)
+				n = pl->outputLeft;
+			if (pl->hashMode == HASH_MD5 && !pl->encrypt)
+				MD5Update(&pl->md5, bufs[i], n);
+			pl->outputLeft -= n;
+
+			slot->size = n;
+			slot->done = 0;
+			slot->state = SLOT_WRITING;
+			QueueSlotRequest(&ring, slot, i, fdOut, (Uint64)outOffset);
+			nextCrypto++;
+			continue;
+		}
+		if (!completed && !GetIoCompletion(&ring, 1, &tag, &result))
+		{
+			SetPipelineError(pl, PIPELINE_READ_ERROR);
+			break;
+		}
+
+		slot = &(slots[tag]);
+		if (result <= 0)
+			SetPipelineError(pl, slot->state == SLOT_READING ? PIPELINE_READ_ERROR : PIPELINE_WRITE_ERROR);
+		//A short transfer goes on from where it stopped
+		else if ((slot->done += result) < slot->size)
+			QueueSlotRequest(&ring, slot, (int)tag, slot->state == SLOT_READING ? fdIn : fdOut,
+					(Uint64)(slot->state == SLOT_READING ? inOffset : outOffset));
+		else if (slot->state == SLOT_READING)
+			slot->state = SLOT_READ;
+		else
+		{
+			slot->state = SLOT_FREE;
+			nbWritten++;
+		}
+	}
+
+	//The kernel may still be using the buffers
+	while (GetIoCompletion(&ring, 1, &tag, &result));
+	CloseIoRing(&ring);
+	for (i=0 ; bufs && i < nbBufs ; i++)
+		GiveBackBuffer(bufs[i], bufSize);
+	free(bufs);
+	free(slots);
+
+	//The streams go on from the end of the data, as if it had been read and written
+	SetFilePosition(pl->fileIn, inOffset + inputSize, SEEK_SET);
+	SetFilePosition(pl->fileOut, outOffset + outputSize, SEEK_SET);
+	return 1;
+}
+
+//Queues what is left to transfer of the chunk in buffer i, the file data starting at fileOffset
+static void QueueSlotRequest(IoRing *ring, QueuedSlot *slot, int i, int fd, Uint64 fileOffset)
+{
+	QueueIoRequest(ring, slot->state == SLOT_WRITING, fd, i, slot->done, slot->size - slot->done,
+			fileOffset + slot->offset + slot->done, (Uint64)i);
+}
+
+//The cipher reads the input pages and writes the output pages directly, without stdio.
+//The whole buffers are processed in place in the mapped windows; the rest, where
+//the input or output ends mid-block, goes through the first buffer.
+//Returns 0 if the files cannot be mapped, so that the caller uses stdio instead.
+static int RunMapped(Pipeline *pl, Uint64 inputSize, Uint64 outputSize)
+{
+	MappedFile in, out;
+	Sint64 inOffset = GetFilePosition(pl->fileIn), outOffset = GetFilePosition(pl->fileOut);
+	Uint64 direct = (inputSize < outputSize ? inputSize : outputSize), w;
+	size_t bufSize = pl->ctx->dataBufSize, windowSize, maxWindowSize, i;
+	const Uint8 *pIn = NULL;
+	Uint8 *pOut = NULL, *buf = (Uint8*)pl->slots[0].data;
+
+	//The buffers are tuned and need not divide the window: it only holds whole ones
+	maxWindowSize = MAP_WINDOW_SIZE < bufSize ? bufSize : MAP_WINDOW_SIZE - MAP_WINDOW_SIZE % bufSize;
+
+	if (inOffset < 0 || outOffset < 0 || !OpenMappedFile(&in, pl->fileIn, inOffset + inputSize, 0))
+		return 0;
+	if (!OpenMappedFile(&out, pl->fileOut, outOffset + outputSize, 1))
+	{
+		CloseMappedFile(&in);
+		return 0;
+	}
+
+	direct -= direct % bufSize;
+	for (w=0 ; w < direct && !pl->error ; w += windowSize)
+	{
+		windowSize = direct - w < maxWindowSize ? (size_t)(direct - w) : maxWindowSize;
+		if (!(pIn = MapFileWindow(&in, inOffset + w, windowSize)))
+			SetPipelineError(pl, PIPELINE_READ_ERROR);
+		else if (!(pOut = MapFileWindow(&out, outOffset + w, windowSize)))
+			SetPipelineError(pl, PIPELINE_WRITE_ERROR);
+
+		for (i=0 ; i < windowSize && !pl->error ; i += bufSize)
+		{
+			if (pl->hashMode == HASH_MD5 && pl->encrypt)
+				MD5Update(&pl->md5, pIn + i, bufSize);
+			ProcessData(pl, (const Uint16*)(pIn + i), (Uint16*)(pOut + i), bufSize);
+			if (pl->hashMode == HASH_MD5 && !pl->encrypt)
+				MD5Update(&pl->md5, pOut + i, bufSize);
+		}
+	}
+
+	if (!pl->error && inputSize > direct)
+	{
+		if (!(pIn = MapFileWindow(&in, inOffset + direct, (size_t)(inputSize - direct))))
+			SetPipelineError(pl, PIPELINE_READ_ERROR);
+		else
+		{
+			//Like the stdio path, the checksum covers the input without the padding when
+			//encrypting, and the output without it when decrypting
+			memcpy(buf, pIn, (size_t)(inputSize - direct));
+			ZeroPadding(buf, (size_t)(inputSize - direct));
+			if (pl->hashMode == HASH_MD5 && pl->encrypt)
+				MD5Update(&pl->md5, buf, inputSize - direct);
+			if (ProcessData(pl, (Uint16*)buf, (Uint16*)buf, (size_t)(inputSize - direct)))
+			{
+				if (pl->hashMode == HASH_MD5 && !pl->encrypt)
+					MD5Update(&pl->md5, buf, outputSize - direct);
+				if (outputSize > direct && !(pOut = MapFileWindow(&out, outOffset + direct, (size_t)(outputSize - direct))))
+					SetPipelineError(pl, PIPELINE_WRITE_ERROR);
+				else if (outputSize > direct)
+					memcpy(pOut, buf, (size_t)(outputSize - direct));
+			}
+		}
+	}
+
+	CloseMappedFile(&in);
+	CloseMappedFile(&out);
+
+	//The streams go on from the end of the data, as if it had been read and written
+	SetFilePosition(pl->fileIn, inOffset + inputSize, SEEK_SET);
+	SetFilePosition(pl->fileOut, outOffset + outputSize, SEEK_SET);
+	return 1;
+}
+
+//The threaded pipeline, with the reads and writes of the slots going around the system cache.
+//Only the sectors that the data shares with the header, or that it does not fill at the end
+//of the output, are written through the cache.
+//Returns 0 if the files cannot bypass it, so that the caller uses stdio instead.
+static int RunDirect(Pipeline *pl, Uint64 inputSize, Uint64 outputSize)
+{
+	DirectStreams ds;
+	Sint64 inOffset = GetFilePosition(pl->fileIn), outOffset = GetFilePosition(pl->fileOut);
+	size_t bufSize = pl->ctx->dataBufSize;
+	int r = 1;
+
+	memset(&ds, 0, sizeof(DirectStreams));
+	if (inOffset < 0 || outOffset < 0 || !OpenDirectFile(&ds.in, pl->fileIn, 0))
+		return 0;
+	if (!OpenDirectFile(&ds.out, pl->fileOut, 1))
+	{
+		CloseDirectFile(&ds.in);
+		return 0;
+	}
+
+	ds.inSkip = (size_t)(inOffset % DIRECT_IO_ALIGNMENT);
+	ds.inOffset = inOffset - ds.inSkip + DIRECT_IO_ALIGNMENT;
+	ds.inputLeft = inputSize;
+	ds.outSkip = ds.outUsed = (size_t)(outOffset % DIRECT_IO_ALIGNMENT);
+	ds.outOffset = outOffset - ds.outSkip;
+	ds.inBuf = TakeBuffer(bufSize + DIRECT_IO_ALIGNMENT);
+	ds.outBuf = TakeBuffer(bufSize + DIRECT_IO_ALIGNMENT);
+
+	if (!ds.inBuf || !ds.outBuf)
+	{
+		LogMessage(pl->ctx, "Unable to allocate the direct I/O buffers.\n");
+		SetPipelineError(pl, PIPELINE_MEMORY_ERROR);
+	}
+	//Nothing has been done yet if the first sector cannot be read: the file system
+	//may accept the direct handles but not the transfers, stdio is used then
+	else if (ReadDirectFile(&ds.in, ds.inBuf, DIRECT_IO_ALIGNMENT, ds.inOffset - DIRECT_IO_ALIGNMENT) != DIRECT_IO_ALIGNMENT)
+		r = 0;
+	else
+	{
+		pl->direct = &ds;
+		RunThreaded(pl);
+		pl->direct = NULL;
+
+		if (!pl->error && ds.outUsed > ds.outSkip
+				&& !WriteCachedFile(&ds.out, ds.outBuf + ds.outSkip, ds.outUsed - ds.outSkip, ds.outOffset + ds.outSkip))
+			SetPipelineError(pl, PIPELINE_WRITE_ERROR);
+	}
+
+	GiveBackBuffer(ds.inBuf, bufSize + DIRECT_IO_ALIGNMENT);
+	GiveBackBuffer(ds.outBuf, bufSize + DIRECT_IO_ALIGNMENT);
+	CloseDirectFile(&ds.in);
+	CloseDirectFile(&ds.out);
+
+	//The streams go on from the end of the data, as if it had been read and written
+	if (r)
+	{
+		SetFilePosition(pl->fileIn, inOffset + inputSize, SEEK_SET);
+		SetFilePosition(pl->fileOut, outOffset + outputSize, SEEK_SET);
+	}
+	return r;
+}
+
+
+//Fills the buffer, the bytes after the end of the input are zeroed up to the end of the block.
+//The input may be followed by other data in the file (an index, the next member of an archive...).
+static int ReadSlot(Pipeline *pl, PipelineSlot *slot)
+{
+	size_t size = pl->inputLeft < pl->ctx->dataBufSize ? (size_t)pl->inputLeft : pl->ctx->dataBufSize;
+	Sint64 n;
+
+	if (!size)
+		n = 0;
+	else if (pl->direct)
+		n = ReadDirectData(pl->direct, (Uint8*)slot->data, size);
+	else if (pl->trailer)
+		n = ReadStreamData(pl, (Uint8*)slot->data, size);
+	else if (!(n = fread(slot->data, 1, size, pl->fileIn)) && !feof(pl->fileIn))
+		n = -1;
+	if (n < 0)
+	{
+		SetPipelineError(pl, PIPELINE_READ_ERROR);
+		return 0;
+	}
+	slot->size = (size_t)n;
+	pl->inputLeft -= slot->size;
+	pl->nbRead += slot->size;
+	//The blocks of a stream are whole, the last one ends with the padding that it drops
+	if (!pl->trailer)
+		ZeroPadding((Uint8*)slot->data, slot->size);
+
+	if (pl->hashMode == HASH_MD5 && pl->encrypt)
+		MD5Update(&pl->md5, (const unsigned char*)slot->data, slot->size);
+
+	return 1;
+}
+
+//The end of the last block, after size bytes of data: the rest of the buffer is never used
+static void ZeroPadding(Uint8 *data, size_t size)
+{
+	memset(data + size, 0, (size+7)/8 * 8 - size);
+}
+
+static int ProcessSlot(Pipeline *pl, PipelineSlot *slot)
+{
+	return ProcessData(pl, slot->data, slot->data, slot->size);
+}
+
+//size bytes of input, rounded up to whole blocks, which in and out must hold
+static int ProcessData(Pipeline *pl, const Uint16 *in, Uint16 *out, size_t size)
+{
+	size_t plainSize = size < pl->plainLeft ? size : pl->plainLeft;
+	int r;
+
+	if (pl->hashMode == HASH_TREE && pl->encrypt)
+		HashTreeLeaves(pl, in, plainSize);
+
+	//Only the last buffer of the input may end mid-block, so position stays on a block boundary
+	if (pl->cipherMode == CIPHER_CTR)
+		r = ProcessCTR_MT(pl->ctx, in, out, (size+7)/8 * 8, pl->nonce, pl->position / 8);
+	else if (pl->cipherMode == CIPHER_CBC)
+		r = ProcessCBC_MT(pl->ctx, in, out, (size+7)/8 * 8, pl->nonce, pl->position / 8, pl->encrypt);
+	else
+		r = Process_MT(pl->ctx, in, out, (size+7)/8 * 8, pl->encrypt);
+	if (!r)
+	{
+		SetPipelineError(pl, PIPELINE_THREAD_ERROR);
+		return 0;
+	}
+
+	if (pl->hashMode == HASH_TREE && !pl->encrypt)
+		HashTreeLeaves(pl, out, plainSize);
+
+	pl->plainLeft -= plainSize;
+	pl->position += size;
+	return 1;
+}
+
+static int WriteSlot(Pipeline *pl, PipelineSlot *slot)
+{
+	const Uint8 *data = (const Uint8*)slot->data;
+	size_t n = pl->trailer ? slot->size : (slot->size+7)/8 * 8, skip;
+
+	if (n > pl->skipLeft + pl->outputLeft)
+		n = pl->skipLeft + pl->outputLeft;
+
+	if (pl->hashMode == HASH_MD5 && !pl->encrypt)
+		MD5Update(&pl->md5, data, n);
+
+	skip = pl->skipLeft < n ? (size_t)pl->skipLeft : n;
+	pl->skipLeft -= skip;
+	n -= skip;
+	if (pl->direct ? !WriteDirectData(pl->direct, data + skip, n) : fwrite(data + skip, 1, n, pl->fileOut) != n)
+	{
+		SetPipelineError(pl, PIPELINE_WRITE_ERROR);
+		return 0;
+	}
+
+	pl->outputLeft -= n;
+	return 1;
+}
+
+//The next size bytes of data at most. The chunks are a whole buffer but the last one,
+//so the bytes read past one, up to the end of its last sector, are carried over to the next.
+//Returns the bytes copied, 0 at the end of the input, or -1 on failure.
+static Sint64 ReadDirectData(DirectStreams *ds, Uint8 *data, size_t size)
+{
+	size_t carried = DIRECT_IO_ALIGNMENT - ds->inSkip, n = ds->inputLeft < size ? (size_t)ds->inputLeft : size, r;
+
+	//The sectors are read right after the carried bytes, all of them but for the last chunk,
+	//so that the first sector of the next one is there
+	if (n > carried)
+	{
+		r = ds->inputLeft > n ? size : (n - carried + DIRECT_IO_ALIGNMENT-1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+		if (ReadDirectFile(&ds->in, ds->inBuf + DIRECT_IO_ALIGNMENT, r, ds->inOffset) < (Sint64)(n - carried))
+			return -1;
+		ds->inOffset += r;
+	}
+
+	memcpy(data, ds->inBuf + ds->inSkip, n);
+	ds->inputLeft -= n;
+	if (ds->inputLeft)
+		memmove(ds->inBuf + ds->inSkip, ds->inBuf + ds->inSkip + n, carried);
+	return (Sint64)n;
+}
+
+//The input of a stream is read FILE_TRAILER_SIZE+1 bytes ahead: a slot is known to be the last
+//one when it is read, and its end to be the trailer. Returns the plain bytes read, without the
+//padding at the end, or -1 on failure.
+static Sint64 ReadStreamData(Pipeline *pl, Uint8 *data, size_t size)
+{
+	size_t n = pl->nbHeld, tail;
+	Uint64 dataSize, plainSize;
+
+	if (pl->inputEnded)
+		return 0;
+
+	memcpy(data, pl->held, n);
+	n += fread(data + n, 1, size - n, pl->fileIn);
+	pl->nbHeld = n == size ? fread(pl->held, 1, sizeof(pl->held), pl->fileIn) : 0;
+	if (ferror(pl->fileIn))
+		return -1;
+	if (pl->nbHeld == sizeof(pl->held))
+		return (Sint64)n;
+
+	//The end: the trailer is the last bytes, those held and the end of the data before
+	pl->inputEnded = 1;
+	tail = FILE_TRAILER_SIZE - pl->nbHeld;
+	if (n < tail)
+	{
+		SetPipelineError(pl, PIPELINE_FORMAT_ERROR);
+		return -1;
+	}
+	n -= tail;
+	memcpy(pl->trailer, data + n, tail);
+	memcpy(pl->trailer + tail, pl->held, pl->nbHeld);
+	memcpy(&plainSize, pl->trailer, 8);
+
+	//Whole blocks, the last one with less than a block of padding
+	dataSize = pl->nbRead + n;
+	if (dataSize % 8 || plainSize > dataSize || dataSize - plainSize >= 8 || dataSize - plainSize > n)
+	{
+		SetPipelineError(pl, PIPELINE_FORMAT_ERROR);
+		return -1;
+	}
+	return (Sint64)(n - (size_t)(dataSize - plainSize));
+}
+
+//Appends the data to the output buffer, and writes its whole sectors. The first one
+//goes through the cache: the sector also holds the end of the header.
+static int WriteDirectData(DirectStreams *ds, const Uint8 *data, size_t size)
+{
+	size_t full, start = ds->outSkip ? DIRECT_IO_ALIGNMENT : 0;
+
+	memcpy(ds->outBuf + ds->outUsed, data, size);
+	ds->outUsed += size;
+	full = ds->outUsed - ds->outUsed % DIRECT_IO_ALIGNMENT;
+	if (!full)
+		return 1;
+
+	if (ds->outSkip && !WriteCachedFile(&ds->out, ds->outBuf + ds->outSkip, DIRECT_IO_ALIGNMENT - ds->outSkip,
+			ds->outOffset + ds->outSkip))
+		return 0;
+	if (full > start && !WriteDirectFile(&ds->out, ds->outBuf + start, full - start, ds->outOffset + start))
+		return 0;
+
+	ds->outSkip = 0;
+	memmove(ds->outBuf, ds->outBuf + full, ds->outUsed - full);
+	ds->outOffset += full;
+	ds->outUsed -= full;
+	return 1;
+}
+
+
+//The buffers are a multiple of the leaf size, so the leaves do not depend on them.
+//Each job hashes as many leaves as the MD5 kernel has lanes.
+static void HashTreeLeaves(Pipeline *pl, const Uint16 *data, size_t size)
+{
+	JobGroup group = {0};
+	size_t i, n = (size + TREE_HASH_LEAF_SIZE-1) / TREE_HASH_LEAF_SIZE, width = GetMD5KernelWidth(), nbGroups = 0;
+
+	for (i=0 ; i < n ; i++)
+	{
+		pl->leaves[i].data = (const unsigned char*)data + i * TREE_HASH_LEAF_SIZE;
+		pl->leaves[i].size = (i == n-1) ? size - i * TREE_HASH_LEAF_SIZE : TREE_HASH_LEAF_SIZE;
+	}
+	for (i=0 ; i < n ; i += width, nbGroups++)
+	{
+		pl->leafGroups[nbGroups].leaves = &(pl->leaves[i]);
+		pl->leafGroups[nbGroups].nbLeaves = n-i < width ? n-i : width;
+		SubmitJob(&group, &(pl->leafJobs[nbGroups]), HashTreeLeafGroup, &(pl->leafGroups[nbGroups]));
+	}
+	WaitJobGroup(&group);
+
+	for (i=0 ; i < n ; i++)
+	{
+		MD5Update(&pl->md5, pl->leaves[i].digest, 16);
+		if (pl->chunkTags)
+			AddChunkLeaf(pl, pl->leaves[i].digest);
+	}
+}
+
+static void* HashTreeLeafGroup(void *data)
+{
+	LeafGroupStruct *lgs = (LeafGroupStruct*)data;
+	ComputeMD5Streams(lgs->leaves, lgs->nbLeaves);
+	return NULL;
+}
+
+//The tag of a chunk hashes its number, then the digests of its leaves
+static void AddChunkLeaf(Pipeline *pl, const unsigned char *digest)
+{
+	Uint64 chunk = pl->nbLeavesHashed / pl->leavesPerChunk;
+
+	if (!(pl->nbLeavesHashed % pl->leavesPerChunk))
+	{
+		MD5Init(&pl->chunkMd5);
+		MD5Update(&pl->chunkMd5, (const unsigned char*)&chunk, 8);
+	}
+	MD5Update(&pl->chunkMd5, digest, 16);
+	if (!(++pl->nbLeavesHashed % pl->leavesPerChunk))
+		EndChunkTag(pl);
+}
+
+static void EndChunkTag(Pipeline *pl)
+{
+	Uint64 chunk = (pl->nbLeavesHashed-1) / pl->leavesPerChunk;
+
+	MD5Final(&pl->chunkMd5);
+	memcpy(&(pl->chunkTags[chunk * 8]), pl->chunkMd5.digest, 16);
+}
+
+
+//Returns 0 if the pipeline was stopped by an error
+static int WaitSlotState(Pipeline *pl, PipelineSlot *slot, int state)
+{
+	int r;
+
+	pthread_mutex_lock(&pl->mutex);
+	while (slot->state != state && !pl->error)
+		pthread_cond_wait(&pl->stateChanged, &pl->mutex);
+	r = !pl->error;
+	pthread_mutex_unlock(&pl->mutex);
+
+	return r;
+}
+
+static void SetSlotState(Pipeline *pl, PipelineSlot *slot, int state)
+{
+	pthread_mutex_lock(&pl->mutex);
+	slot->state = state;
+	pthread_cond_broadcast(&pl->stateChanged);
+	pthread_mutex_unlock(&pl->mutex);
+}
+
+//The first error wins, and wakes up every stage so that they stop
+static void SetPipelineError(Pipeline *pl, int error)
+{
+	pthread_mutex_lock(&pl->mutex);
+	if (!pl->error)
+		pl->error = error;
+	pthread_cond_broadcast(&pl->stateChanged);
+	pthread_mutex_unlock(&pl->mutex);
+}
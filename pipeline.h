@@ -0,0 +1,71 @@
+/**** LICENSE INFORMATION ****
+IDEA - pipeline.h
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include "idea.h"
+
+#define PIPELINE_OK				0
+#define PIPELINE_READ_ERROR		1
+#define PIPELINE_WRITE_ERROR	2
+#define PIPELINE_THREAD_ERROR	3
+#define PIPELINE_MEMORY_ERROR	4
+#define PIPELINE_FORMAT_ERROR	5	//A stream does not end with a valid trailer
+
+#define CIPHER_ECB				0	//Each block on its own, the data is padded to whole blocks
+#define CIPHER_CTR				1	//Keystream of the encrypted counters, any size
+#define CIPHER_CBC				2	//Chained blocks, by segments of CBC_SEGMENT_SIZE bytes
+
+#define HASH_NONE				0
+#define HASH_MD5				1	//MD5 of the whole plain data
+#define HASH_TREE				2	//MD5 of the MD5s of each TREE_HASH_LEAF_SIZE bytes, computed in parallel
+
+//Reads inputSize bytes of fileIn from its current position, encrypts or decrypts them
+//and writes the result to fileOut, with reading, processing and writing overlapped
+//over the buffers of the context. What follows them in fileIn (an index, the next
+//member of an archive) is not read.
+//cipherMode is CIPHER_xxx, nonce is used by the CTR and CBC modes.
+//outputSize is the number of bytes to write: the whole blocks when encrypting,
+//the blocks minus the padding when decrypting, inputSize in counter mode.
+//The checksum of the plain data (16 bytes) is computed according to hashMode,
+//on the buffers that the cipher touches, while they are still in cache.
+//With HASH_TREE, chunkTags (if not NULL) gets the tag of each chunkSize bytes of plain data
+//(8 words per chunk, not encrypted), chunkSize being a multiple of TREE_HASH_LEAF_SIZE.
+int RunFilePipeline(IdeaContext *ctx, FILE *fileIn, FILE *fileOut, int encrypt, int cipherMode, Uint64 nonce,
+		Uint64 inputSize, Uint64 outputSize, int hashMode, Uint16 *checkSum, size_t chunkSize, Uint16 *chunkTags);
+
+//Decrypts inputSize bytes of fileIn from its current position, which are at position in
+//the whole encrypted data: a multiple of CBC_SEGMENT_SIZE, and of chunkSize with chunkTags.
+//plainSize of them are plain data, the rest being the padding. The first skip bytes
+//of plain data are dropped, the outputSize next ones written to fileOut.
+//chunkTags gets the tags of the chunks decrypted, at the index of each in the file.
+int RunRangePipeline(IdeaContext *ctx, FILE *fileIn, FILE *fileOut, int cipherMode, Uint64 nonce, Uint64 position,
+		Uint64 inputSize, Uint64 plainSize, Uint64 skip, Uint64 outputSize, size_t chunkSize, Uint16 *chunkTags);
+
+//Streams, whose size is only known at their end: fileIn is read up to its end, and neither
+//file needs to be seekable. The data is padded to whole blocks in all the modes.
+//When encrypting, *plainSize gets the bytes read. When decrypting, the last FILE_TRAILER_SIZE
+//bytes of fileIn are copied to trailer instead, and *plainSize gets the size that it holds,
+//so that the padding is dropped.
+int RunStreamPipeline(IdeaContext *ctx, FILE *fileIn, FILE *fileOut, int encrypt, int cipherMode, Uint64 nonce,
+		int hashMode, Uint16 *checkSum, Uint64 *plainSize, Uint8 *trailer);
+
+#endif /* PIPELINE_H_ */
@@ -184,7 +184,7 @@ void sha256_process( sha256_context *ctx, uint8 data[64] )
     ctx->state[7] += H;
 }
 
-void sha256_update( sha256_context *ctx, uint8 *input, uint32 length )
+void sha256_update( sha256_context *ctx, uint8 *input, size_t length )
 {
     uint32 left, fill;
 
@@ -193,12 +193,15 @@ void sha256_update( sha256_context *ctx, uint8 *input, uint32 length )
     left = ctx->total[0] & 0x3F;
     fill = 64 - left;
 
-    ctx->total[0] += length;
+    /* the byte count is kept on 64 bits, length may be bigger than 32 */
+    ctx->total[0] += (uint32) length;
     ctx->total[0] &= 0xFFFFFFFF;
 
-    if( ctx->total[0] < length )
+    if( ctx->total[0] < ( (uint32) length & 0xFFFFFFFF ) )
         ctx->total[1]++;
 
+    ctx->total[1] += (uint32) ( ( length >> 16 ) >> 16 );
+
     if( left && length >= fill )
     {
         memcpy( (void *) (ctx->buffer + left),
@@ -1,6 +1,8 @@
 #ifndef _SHA256_H
 #define _SHA256_H
 
+#include <stddef.h>
+
 #ifndef uint8
 #define uint8  unsigned char
 #endif
@@ -18,7 +20,7 @@ typedef struct
 sha256_context;
 
 void sha256_starts( sha256_context *ctx );
-void sha256_update( sha256_context *ctx, uint8 *input, uint32 length );
+void sha256_update( sha256_context *ctx, uint8 *input, size_t length );
 void sha256_finish( sha256_context *ctx, uint8 digest[32] );
 
 #endif /* sha256.h */
@@ -0,0 +1,351 @@
+/**** LICENSE INFORMATION ****
+IDEA - threadpool.c
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Worker threads started once for the whole run, scheduling the jobs by work stealing.
+ * Each worker has its own deque of jobs: the jobs it submits go at the back, and it
+ * takes them back from there, the most recent first, while they are still in cache.
+ * A worker with nothing left steals from the front of the other deques, the oldest
+ * jobs first, which are usually the biggest pieces of work left. The other threads
+ * share one more deque. A thread waiting for its group runs jobs too instead of
+ * sleeping, so the pool works even with no worker at all.
+ *
+ * Each deque has its own lock, so that the workers do not contend on their own jobs.
+ * The pool lock is only taken to sleep and to be woken up. */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		//sched_getaffinity
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "threadpool.h"
+
+#define MAX_POOL_THREADS	256
+#define OUTSIDE_DEQUE		MAX_POOL_THREADS	//Shared by the threads that are not workers
+
+typedef struct
+{
+	pthread_mutex_t mutex;
+	PoolJob *head, *tail;		//Stolen from the head, taken back by the owner from the tail
+} JobDeque;
+
+typedef struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t jobAvailable;
+	pthread_cond_t jobDone;
+	JobDeque deques[MAX_POOL_THREADS+1];
+	pthread_t threads[MAX_POOL_THREADS];
+	int nbThreads;
+	int nbQueued;				//Jobs in the deques, read and written atomically
+	int nbSleeping;				//Same
+	int stop;
+	pthread_key_t workerKey;	//Index of the deque of the thread, plus one
+} ThreadPool;
+
+static ThreadPool pool;
+static pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
+
+static void InitThreadPool(void);
+static void* WorkerMain(void *data);
+static void PushJob(PoolJob *job);
+static PoolJob* FindJob(int self, JobGroup *waited);
+static PoolJob* TakeJob(JobDeque *deque, int fromTail, JobGroup *waited);
+static int GetDequeIndex(void);
+static void RunJob(PoolJob *job);
+
+
+//nbThreads <= 0: one worker per online processor
+int StartThreadPool(int nbThreads)
+{
+	int rc, t;
+
+	if (nbThreads <= 0)
+		nbThreads = GetCpuCount();
+	if (nbThreads > MAX_POOL_THREADS)
+		nbThreads = MAX_POOL_THREADS;
+
+	pthread_once(&poolOnce, InitThreadPool);
+	pool.stop = 0;
+	for (t=0 ; t < nbThreads ; t++)
+	{
+		rc = pthread_create(&(pool.threads[t]), NULL, WorkerMain, (void*)(size_t)(t+1));
+		if (rc)
+		{
+			printf("Unable to create worker thread: return code from pthread_create() is %d\n", rc);
+			break;
+		}
+		pool.nbThreads++;
+	}
+
+	return pool.nbThreads > 0;
+}
+
+//Runs the jobs still queued, then joins the workers
+void StopThreadPool(void)
+{
+	int t;
+
+	pthread_mutex_lock(&pool.mutex);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.jobAvailable);
+	pthread_mutex_unlock(&pool.mutex);
+
+	for (t=0 ; t < pool.nbThreads ; t++)
+		pthread_join(pool.threads[t], NULL);
+	pool.nbThreads = 0;
+}
+
+int GetThreadPoolSize(void)
+{
+	return pool.nbThreads;
+}
+
+//The processors that the process may run on, which can be fewer than those of the machine
+int GetCpuCount(void)
+{
+#ifdef WIN32
+	DWORD_PTR processMask, systemMask;
+	SYSTEM_INFO sysInfo;
+	int n = 0;
+
+	if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+	{
+		for ( ; processMask ; processMask &= processMask-1)
+			n++;
+	}
+	if (n > 0)
+		return n;
+	GetSystemInfo(&sysInfo);
+	return sysInfo.dwNumberOfProcessors > 0 ? (int)sysInfo.dwNumberOfProcessors : 1;
+#else
+	long n;
+#ifdef __linux__
+	cpu_set_t set;
+
+	if (!sched_getaffinity(0, sizeof(set), &set) && CPU_COUNT(&set) > 0)
+		return CPU_COUNT(&set);
+#endif
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+#endif
+}
+
+void SubmitJob(JobGroup *group, PoolJob *job, void* (*func)(void*), void *data)
+{
+	job->func = func;
+	job->data = data;
+	job->group = group;
+	job->isLong = 0;
+	PushJob(job);
+}
+
+void SubmitLongJob(JobGroup *group, PoolJob *job, void* (*func)(void*), void *data)
+{
+	job->func = func;
+	job->data = data;
+	job->group = group;
+	job->isLong = 1;
+	PushJob(job);
+}
+
+void WaitJobGroup(JobGroup *group)
+{
+	int self = GetDequeIndex();
+	PoolJob *job;
+
+	while (__atomic_load_n(&group->pending, __ATOMIC_SEQ_CST) > 0)
+	{
+		if ((job = FindJob(self, group)))
+		{
+			RunJob(job);
+			continue;
+		}
+
+		//The jobs left are running on other threads: the last one to finish wakes this one up
+		pthread_mutex_lock(&pool.mutex);
+		if (__atomic_load_n(&group->pending, __ATOMIC_SEQ_CST) > 0)
+			pthread_cond_wait(&pool.jobDone, &pool.mutex);
+		pthread_mutex_unlock(&pool.mutex);
+	}
+}
+
+
+//The deques are also used without workers, by the threads waiting for their jobs.
+//The pool is only locked once a job has been pushed or the workers started, both of which come here first.
+static void InitThreadPool(void)
+{
+	int t;
+
+	pthread_mutex_init(&pool.mutex, NULL);
+	pthread_cond_init(&pool.jobAvailable, NULL);
+	pthread_cond_init(&pool.jobDone, NULL);
+	for (t=0 ; t <= MAX_POOL_THREADS ; t++)
+		pthread_mutex_init(&(pool.deques[t].mutex), NULL);
+	pthread_key_create(&pool.workerKey, NULL);
+}
+
+static void* WorkerMain(void *data)
+{
+	int self = (int)(size_t)data - 1;
+	PoolJob *job;
+
+	pthread_setspecific(pool.workerKey, data);
+	while (1)
+	{
+		if ((job = FindJob(self, NULL)))
+		{
+			RunJob(job);
+			continue;
+		}
+
+		//Counted as sleeping before checking the queue, so that a job pushed meanwhile
+		//either is seen here or sees this thread asleep and wakes it up
+		pthread_mutex_lock(&pool.mutex);
+		__atomic_add_fetch(&pool.nbSleeping, 1, __ATOMIC_SEQ_CST);
+		while (!__atomic_load_n(&pool.nbQueued, __ATOMIC_SEQ_CST) && !pool.stop)
+			pthread_cond_wait(&pool.jobAvailable, &pool.mutex);
+		__atomic_sub_fetch(&pool.nbSleeping, 1, __ATOMIC_SEQ_CST);
+		if (pool.stop && !__atomic_load_n(&pool.nbQueued, __ATOMIC_SEQ_CST))
+		{
+			pthread_mutex_unlock(&pool.mutex);
+			break;
+		}
+		pthread_mutex_unlock(&pool.mutex);
+	}
+
+	return NULL;
+}
+
+//At the tail of the deque of the calling thread
+static void PushJob(PoolJob *job)
+{
+	JobDeque *deque = &(pool.deques[GetDequeIndex()]);
+
+	__atomic_add_fetch(&job->group->pending, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&deque->mutex);
+	job->next = NULL;
+	job->prev = deque->tail;
+	if (deque->tail)
+		deque->tail->next = job;
+	else
+		deque->head = job;
+	deque->tail = job;
+	pthread_mutex_unlock(&deque->mutex);
+
+	__atomic_add_fetch(&pool.nbQueued, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pool.nbSleeping, __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock(&pool.mutex);
+		pthread_cond_signal(&pool.jobAvailable);
+		pthread_mutex_unlock(&pool.mutex);
+	}
+}
+
+//The most recent job of the thread's own deque, or else the oldest one of another deque.
+//While waiting for a group, only its jobs and the short ones are taken.
+static PoolJob* FindJob(int self, JobGroup *waited)
+{
+	PoolJob *job;
+	int i, n = pool.nbThreads + 1, me = self == OUTSIDE_DEQUE ? pool.nbThreads : self, victim;
+
+	if (!__atomic_load_n(&pool.nbQueued, __ATOMIC_SEQ_CST))
+		return NULL;
+	if ((job = TakeJob(&(pool.deques[self]), 1, waited)))
+		return job;
+
+	//The victims are tried in turn from the next one, so that the thieves spread out.
+	//The outside deque comes after the workers.
+	for (i=1 ; i < n ; i++)
+	{
+		victim = (me + i) % n;
+		if ((job = TakeJob(&(pool.deques[victim == pool.nbThreads ? OUTSIDE_DEQUE : victim]), 0, waited)))
+			return job;
+	}
+
+	return NULL;
+}
+
+static PoolJob* TakeJob(JobDeque *deque, int fromTail, JobGroup *waited)
+{
+	PoolJob *job;
+
+	if (!__atomic_load_n(&deque->head, __ATOMIC_RELAXED))
+		return NULL;
+
+	pthread_mutex_lock(&deque->mutex);
+	for (job = fromTail ? deque->tail : deque->head ; job ; job = fromTail ? job->prev : job->next)
+	{
+		if (!waited || !job->isLong || job->group == waited)
+			break;
+	}
+
+	if (job)
+	{
+		if (job->prev)
+			job->prev->next = job->next;
+		else
+			deque->head = job->next;
+		if (job->next)
+			job->next->prev = job->prev;
+		else
+			deque->tail = job->prev;
+		__atomic_sub_fetch(&pool.nbQueued, 1, __ATOMIC_SEQ_CST);
+	}
+	pthread_mutex_unlock(&deque->mutex);
+
+	return job;
+}
+
+static int GetDequeIndex(void)
+{
+	size_t index;
+
+	pthread_once(&poolOnce, InitThreadPool);
+	index = (size_t)pthread_getspecific(pool.workerKey);
+	return index ? (int)index - 1 : OUTSIDE_DEQUE;
+}
+
+//The job belongs to its submitter again as soon as the group counter drops
+static void RunJob(PoolJob *job)
+{
+	JobGroup *group = job->group;
+
+	job->func(job->data);
+
+	if (__atomic_sub_fetch(&group->pending, 1, __ATOMIC_SEQ_CST) == 0)
+	{
+		pthread_mutex_lock(&pool.mutex);
+		pthread_cond_broadcast(&pool.jobDone);
+		pthread_mutex_unlock(&pool.mutex);
+	}
+}
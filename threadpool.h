@@ -0,0 +1,55 @@
+/**** LICENSE INFORMATION ****
+IDEA - threadpool.h
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+#include <pthread.h>
+
+//Jobs submitted together, waited for together
+typedef struct
+{
+	int pending;
+} JobGroup;
+
+//Provided by the caller, must stay valid until the group has been waited for
+typedef struct PoolJob
+{
+	void* (*func)(void *data);
+	void *data;
+	JobGroup *group;
+	int isLong;
+	struct PoolJob *prev, *next;
+} PoolJob;
+
+int StartThreadPool(int nbThreads);
+void StopThreadPool(void);
+int GetThreadPoolSize(void);
+int GetCpuCount(void);
+
+//A job that does not wait for other jobs: a slice of a buffer, a few hashes...
+void SubmitJob(JobGroup *group, PoolJob *job, void* (*func)(void*), void *data);
+//A job that submits and waits for jobs itself, like a whole file.
+//A thread waiting for another group never starts one, so that it gets back to its work quickly.
+void SubmitLongJob(JobGroup *group, PoolJob *job, void* (*func)(void*), void *data);
+//Runs the jobs of the group, and short jobs of others, until the group is done
+void WaitJobGroup(JobGroup *group);
+
+#endif /* THREADPOOL_H_ */
@@ -0,0 +1,287 @@
+/**** LICENSE INFORMATION ****
+IDEA - tuning.c
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* The same settings do not suit a 2-core VM and a 64-core server. The processors
+ * available, the cache and the memory are read from the system, then the cipher
+ * and the thread pool are timed for a few milliseconds:
+ * - a slice of a buffer given to a thread must last long enough for the cost of
+ *   the job to be small in comparison: that gives the split threshold;
+ * - a buffer must hold enough slices for all the threads, each slice fitting in
+ *   the cache of its core: that gives the buffer size, within what the memory allows
+ *   for the contexts of the files processed at the same time. */
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <time.h>
+#endif
+
+#include "tuning.h"
+#include "threadpool.h"
+
+#define CALIBRATION_SIZE		65536		//Bytes encrypted at a time to time the cipher
+#define CALIBRATION_TIME		2e6			//Nanoseconds of each measure, at least
+#define CALIBRATION_JOBS		64
+#define JOB_COST_RATIO			20			//Slices last this many times the cost of their job
+#define MIN_JOB_BLOCKS			64
+#define MAX_JOB_BLOCKS			65536
+#define DEFAULT_CACHE_SIZE		262144
+#define MIN_TUNED_BUF_SIZE		(512*1024)
+#define MAX_TUNED_BUF_SIZE		(16*1024*1024)
+#define MEMORY_SHARE			8			//The buffers of all the contexts take this part of the memory at most
+
+static int ParseTuningValue(const char *name, const char *value, int isSize, size_t *out);
+static size_t GetCacheSize(void);
+static Uint64 GetMemorySize(void);
+static double GetTime(void);
+static void* EmptyJob(void *data);
+
+
+int ReadTuningOptions(Tuning *tuning, int argc, char *argv[])
+{
+	const char *names[3] = {"threads", "buffer-size", "split-blocks"};
+	const char *envNames[3] = {"IDEA_THREADS", "IDEA_BUFFER_SIZE", "IDEA_SPLIT_BLOCKS"};
+	size_t values[3] = {0}, l;
+	int i, k;
+
+	memset(tuning, 0, sizeof(Tuning));
+	for (k=0 ; k < 3 ; k++)
+	{
+		if (getenv(envNames[k]) && !ParseTuningValue(envNames[k], getenv(envNames[k]), k == 1, &values[k]))
+			return 0;
+	}
+
+	for (i=1 ; i < argc ; i++)
+	{
+		for (k=0 ; k < 3 ; k++)
+		{
+			l = strlen(names[k]);
+			if (!strncmp(argv[i], "--", 2) && !strncmp(argv[i]+2, names[k], l) && argv[i][l+2] == '=')
+				break;
+		}
+		if (k == 3)
+		{
+			printf("Unknown option %s.\nOptions: --threads=N --buffer-size=N[K|M] --split-blocks=N --range=START-END --member=NAME\n"
+					"         --stream=encrypt|decrypt (standard input to standard output, password in IDEA_PASSWORD)\n"
+					"         --self-test\n", argv[i]);
+			return 0;
+		}
+		if (!ParseTuningValue(names[k], argv[i] + strlen(names[k]) + 3, k == 1, &values[k]))
+			return 0;
+	}
+
+	tuning->nbThreads = (int)values[0];
+	tuning->dataBufSize = values[1];
+	tuning->minJobBlocks = values[2];
+	return 1;
+}
+
+void DetectHardware(Tuning *tuning)
+{
+	if (!tuning->nbThreads)
+		tuning->nbThreads = GetCpuCount();
+	if (!tuning->cacheSize)
+		tuning->cacheSize = GetCacheSize();
+	if (!tuning->memorySize)
+		tuning->memorySize = GetMemorySize();
+}
+
+int TuneIdeaContext(Tuning *tuning, IdeaContext *ctx)
+{
+	PoolJob jobs[CALIBRATION_JOBS];
+	JobGroup group = {0};
+	Uint16 *buf = ctx->dataBuf;
+	size_t n, slice, maxSize, nbSlices = (GetThreadPoolSize() + 1) * SLICES_PER_THREAD;
+	double t;
+	int i;
+
+	//The cipher on one thread: the buffer is not split
+	memset(buf, 0, CALIBRATION_SIZE);
+	ctx->minJobBlocks = (size_t)-1;
+	t = GetTime();
+	for (n=0 ; n == 0 || GetTime() - t < CALIBRATION_TIME ; n++)
+		Process_MT(ctx, buf, buf, CALIBRATION_SIZE, 1);
+	tuning->blockTime = (GetTime() - t) / (n * (CALIBRATION_SIZE/8));
+
+	//Empty jobs, submitted, stolen and waited for like the slices
+	t = GetTime();
+	for (n=0 ; n == 0 || GetTime() - t < CALIBRATION_TIME ; n++)
+	{
+		for (i=0 ; i < CALIBRATION_JOBS ; i++)
+			SubmitJob(&group, &(jobs[i]), EmptyJob, NULL);
+		WaitJobGroup(&group);
+	}
+	tuning->jobTime = (GetTime() - t) / (n * CALIBRATION_JOBS);
+
+	if (!tuning->minJobBlocks)
+	{
+		tuning->minJobBlocks = (size_t)(tuning->jobTime * JOB_COST_RATIO / tuning->blockTime);
+		if (tuning->minJobBlocks < MIN_JOB_BLOCKS)
+			tuning->minJobBlocks = MIN_JOB_BLOCKS;
+		if (tuning->minJobBlocks > MAX_JOB_BLOCKS)
+			tuning->minJobBlocks = MAX_JOB_BLOCKS;
+	}
+	ctx->minJobBlocks = tuning->minJobBlocks;
+
+	//The data is processed in place: half the cache for a slice leaves room for the rest.
+	//A context per processor, for the files processed at the same time.
+	if (!tuning->dataBufSize)
+	{
+		slice = (tuning->cacheSize ? tuning->cacheSize : DEFAULT_CACHE_SIZE) / 2;
+		if (slice < tuning->minJobBlocks * 8)
+			slice = tuning->minJobBlocks * 8;
+		tuning->dataBufSize = nbSlices * slice;
+
+		maxSize = MAX_TUNED_BUF_SIZE;
+		if (tuning->memorySize && tuning->memorySize / MEMORY_SHARE / ((tuning->nbThreads + 1) * ctx->nbDataBufs) < maxSize)
+			maxSize = tuning->memorySize / MEMORY_SHARE / ((tuning->nbThreads + 1) * ctx->nbDataBufs);
+		if (tuning->dataBufSize > maxSize)
+			tuning->dataBufSize = maxSize;
+		if (tuning->dataBufSize < MIN_TUNED_BUF_SIZE)
+			tuning->dataBufSize = MIN_TUNED_BUF_SIZE;
+		tuning->dataBufSize = (tuning->dataBufSize + TREE_HASH_LEAF_SIZE-1) / TREE_HASH_LEAF_SIZE * TREE_HASH_LEAF_SIZE;
+	}
+
+	return tuning->dataBufSize == ctx->dataBufSize || SetIdeaBufferSize(ctx, tuning->dataBufSize);
+}
+
+
+//A positive number, with K or M for the sizes
+static int ParseTuningValue(const char *name, const char *value, int isSize, size_t *out)
+{
+	char *end = NULL;
+	long n = strtol(value, &end, 10);
+
+	if (isSize && (*end == 'K' || *end == 'k'))
+	{
+		n *= 1024;
+		end++;
+	}
+	else if (isSize && (*end == 'M' || *end == 'm'))
+	{
+		n *= 1024*1024;
+		end++;
+	}
+
+	if (end == value || *end || n <= 0)
+	{
+		printf("Wrong value for %s: %s\n", name, value);
+		return 0;
+	}
+	*out = (size_t)n;
+	return 1;
+}
+
+//Of the level 2, data or unified, 0 if unknown
+static size_t GetCacheSize(void)
+{
+#ifdef WIN32
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION *info;
+	DWORD size = 0, i;
+	size_t cacheSize = 0;
+
+	GetLogicalProcessorInformation(NULL, &size);
+	if (!size || !(info = malloc(size)))
+		return 0;
+	if (GetLogicalProcessorInformation(info, &size))
+	{
+		for (i=0 ; i < size / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION) && !cacheSize ; i++)
+		{
+			if (info[i].Relationship == RelationCache && info[i].Cache.Level == 2 && info[i].Cache.Type != CacheInstruction)
+				cacheSize = info[i].Cache.Size;
+		}
+	}
+	free(info);
+	return cacheSize;
+#else
+	char path[100], buf[32];
+	FILE *file;
+	long n = 0;
+	int i, level;
+
+#ifdef _SC_LEVEL2_CACHE_SIZE
+	if ((n = sysconf(_SC_LEVEL2_CACHE_SIZE)) > 0)
+		return (size_t)n;
+#endif
+	//Linux describes the caches of each processor in sysfs, the size in KB
+	for (i=0, n=0 ; i < 10 && n <= 0 ; i++)
+	{
+		level = 0;
+		sprintf(path, "/sys/devices/system/cpu/cpu0/cache/index%d/level", i);
+		if (!(file = fopen(path, "r")))
+			break;
+		if (fscanf(file, "%d", &level) != 1)
+			level = 0;
+		fclose(file);
+
+		sprintf(path, "/sys/devices/system/cpu/cpu0/cache/index%d/type", i);
+		if (level != 2 || !(file = fopen(path, "r")))
+			continue;
+		if (!fgets(buf, sizeof(buf), file) || !strncmp(buf, "Instruction", 11))
+			level = 0;
+		fclose(file);
+
+		sprintf(path, "/sys/devices/system/cpu/cpu0/cache/index%d/size", i);
+		if (level != 2 || !(file = fopen(path, "r")))
+			continue;
+		if (fscanf(file, "%ld", &n) == 1)
+			n *= 1024;
+		fclose(file);
+	}
+	return n > 0 ? (size_t)n : 0;
+#endif
+}
+
+static Uint64 GetMemorySize(void)
+{
+#ifdef WIN32
+	MEMORYSTATUSEX status;
+
+	status.dwLength = sizeof(status);
+	return GlobalMemoryStatusEx(&status) ? status.ullTotalPhys : 0;
+#else
+	long nbPages = sysconf(_SC_PHYS_PAGES), pageSize = sysconf(_SC_PAGESIZE);
+
+	return nbPages > 0 && pageSize > 0 ? (Uint64)nbPages * pageSize : 0;
+#endif
+}
+
+//In nanoseconds, from an arbitrary origin
+static double GetTime(void)
+{
+#ifdef WIN32
+	LARGE_INTEGER counter, frequency;
+
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return counter.QuadPart * 1e9 / frequency.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+#endif
+}
+
+static void* EmptyJob(void *data)
+{
+	return data;
+}
@@ -0,0 +1,51 @@
+/**** LICENSE INFORMATION ****
+IDEA - tuning.h
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TUNING_H_
+#define TUNING_H_
+
+#include "idea.h"
+
+//Parameters of the parallel processing, chosen at startup for the machine.
+//0 stands for a value to detect or to compute.
+typedef struct
+{
+	int nbThreads;					//Workers of the pool
+	size_t dataBufSize;				//Bytes per buffer of the file pipeline
+	size_t minJobBlocks;			//Blocks per slice of a buffer, at least
+	size_t cacheSize;				//Level 2 data cache per core, in bytes
+	Uint64 memorySize;				//Physical memory, in bytes
+	double blockTime;				//Nanoseconds to encrypt a block on one thread
+	double jobTime;					//Nanoseconds to run an empty job on the pool
+} Tuning;
+
+//From the environment: IDEA_THREADS, IDEA_BUFFER_SIZE and IDEA_SPLIT_BLOCKS, overridden
+//by the options --threads=N, --buffer-size=N[K|M] and --split-blocks=N.
+//Returns 0 on an unknown option or a wrong value, after printing why.
+int ReadTuningOptions(Tuning *tuning, int argc, char *argv[]);
+
+//Fills what is still 0 among the number of threads, the cache size and the memory size
+void DetectHardware(Tuning *tuning);
+
+//Once the pool is started: measures the cipher and the pool, computes the sizes
+//still 0 and applies them to ctx
+int TuneIdeaContext(Tuning *tuning, IdeaContext *ctx);
+
+#endif /* TUNING_H_ */
@@ -0,0 +1,246 @@
+/**** LICENSE INFORMATION ****
+IDEA - uring.c
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Raw io_uring system calls, so that no library is needed. The submission queue
+ * and the completion queue are rings shared with the kernel: requests are added
+ * at the tail of the first one, completions taken from the head of the second one,
+ * with the memory ordering the kernel expects on the indexes.
+ * At most depth requests are pending, so the completion queue (twice as big)
+ * cannot overflow. */
+
+#include <errno.h>
+
+#include "uring.h"
+
+#ifdef __linux__
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup		425
+#define __NR_io_uring_enter		426
+#define __NR_io_uring_register	427
+#endif
+
+static int SubmitIoRequests(IoRing *ring, int wait);
+
+
+int OpenIoRing(IoRing *ring, unsigned int depth)
+{
+	struct io_uring_params params;
+
+	memset(ring, 0, sizeof(IoRing));
+	memset(&params, 0, sizeof(params));
+	if ((ring->fd = (int)syscall(__NR_io_uring_setup, depth, &params)) < 0)
+		return 0;
+	ring->depth = depth;
+
+	ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	//Both rings in one mapping since Linux 5.4
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring->cqRingSize > ring->sqRingSize)
+			ring->sqRingSize = ring->cqRingSize;
+		ring->cqRingSize = 0;
+	}
+
+	ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sqRing == MAP_FAILED)
+		ring->sqRing = NULL;
+	if (ring->sqRing && ring->cqRingSize)
+	{
+		ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cqRing == MAP_FAILED)
+			ring->cqRing = NULL;
+	}
+	else
+		ring->cqRing = ring->sqRing;
+	if (ring->cqRing)
+	{
+		ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+		if (ring->sqes == MAP_FAILED)
+			ring->sqes = NULL;
+	}
+	if (!ring->sqes)
+	{
+		CloseIoRing(ring);
+		return 0;
+	}
+
+	ring->sqTail = (unsigned int*)((Uint8*)ring->sqRing + params.sq_off.tail);
+	ring->sqMask = (unsigned int*)((Uint8*)ring->sqRing + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned int*)((Uint8*)ring->sqRing + params.sq_off.array);
+	ring->cqHead = (unsigned int*)((Uint8*)ring->cqRing + params.cq_off.head);
+	ring->cqTail = (unsigned int*)((Uint8*)ring->cqRing + params.cq_off.tail);
+	ring->cqMask = (unsigned int*)((Uint8*)ring->cqRing + params.cq_off.ring_mask);
+	ring->cqes = (Uint8*)ring->cqRing + params.cq_off.cqes;
+
+	return 1;
+}
+
+int RegisterIoBuffers(IoRing *ring, Uint8 **bufs, int nbBufs, size_t size)
+{
+	struct iovec *iovecs;
+	int i;
+
+	if (!(iovecs = malloc(sizeof(struct iovec) * nbBufs)))
+		return 0;
+	for (i=0 ; i < nbBufs ; i++)
+	{
+		iovecs[i].iov_base = bufs[i];
+		iovecs[i].iov_len = size;
+	}
+
+	ring->bufs = bufs;
+	ring->iovecs = iovecs;
+	ring->fixedBuffers = !syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iovecs, nbBufs);
+	return 1;
+}
+
+int QueueIoRequest(IoRing *ring, int write, int fd, int bufIndex, size_t start, size_t size, Uint64 offset, Uint64 tag)
+{
+	unsigned int tail = *ring->sqTail, index = tail & *ring->sqMask;
+	struct io_uring_sqe *sqe = &((struct io_uring_sqe*)ring->sqes)[index];
+	struct iovec *iov = &((struct iovec*)ring->iovecs)[bufIndex];
+
+	if (ring->queued + ring->inFlight >= ring->depth)
+		return 0;
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->user_data = tag;
+	if (ring->fixedBuffers)
+	{
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->addr = (unsigned long)(ring->bufs[bufIndex] + start);
+		sqe->len = (unsigned int)size;
+		sqe->buf_index = (unsigned short)bufIndex;
+	}
+	else
+	{
+		//Plain reads and writes only exist since Linux 5.6, the vectored ones since the beginning
+		sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+		iov->iov_base = ring->bufs[bufIndex] + start;
+		iov->iov_len = size;
+		sqe->addr = (unsigned long)iov;
+		sqe->len = 1;
+	}
+
+	ring->sqArray[index] = index;
+	__atomic_store_n(ring->sqTail, tail+1, __ATOMIC_RELEASE);
+	ring->queued++;
+	return 1;
+}
+
+int GetIoCompletion(IoRing *ring, int wait, Uint64 *tag, int *result)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+
+	if (ring->queued && !SubmitIoRequests(ring, 0))
+		return 0;
+
+	while (1)
+	{
+		head = *ring->cqHead;
+		if (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+		{
+			cqe = &((struct io_uring_cqe*)ring->cqes)[head & *ring->cqMask];
+			*tag = cqe->user_data;
+			*result = cqe->res;
+			__atomic_store_n(ring->cqHead, head+1, __ATOMIC_RELEASE);
+			ring->inFlight--;
+			return 1;
+		}
+
+		if (!wait || !ring->inFlight || !SubmitIoRequests(ring, 1))
+			return 0;
+	}
+}
+
+void CloseIoRing(IoRing *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqesSize);
+	if (ring->cqRing && ring->cqRing != ring->sqRing)
+		munmap(ring->cqRing, ring->cqRingSize);
+	if (ring->sqRing)
+		munmap(ring->sqRing, ring->sqRingSize);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	free(ring->iovecs);
+	memset(ring, 0, sizeof(IoRing));
+	ring->fd = -1;
+}
+
+//Hands the queued requests to the kernel, and waits for a completion if wait is set
+static int SubmitIoRequests(IoRing *ring, int wait)
+{
+	int r;
+
+	do
+	{
+		r = (int)syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (r < 0 && errno == EINTR);
+
+	if (r < 0)
+		return 0;
+	ring->queued -= r;
+	ring->inFlight += r;
+	return 1;
+}
+
+#else	//__linux__
+
+int OpenIoRing(IoRing *ring, unsigned int depth)
+{
+	memset(ring, 0, sizeof(IoRing));
+	ring->fd = -1;
+	return 0;
+}
+
+int RegisterIoBuffers(IoRing *ring, Uint8 **bufs, int nbBufs, size_t size)
+{
+	return 0;
+}
+
+int QueueIoRequest(IoRing *ring, int write, int fd, int bufIndex, size_t start, size_t size, Uint64 offset, Uint64 tag)
+{
+	return 0;
+}
+
+int GetIoCompletion(IoRing *ring, int wait, Uint64 *tag, int *result)
+{
+	return 0;
+}
+
+void CloseIoRing(IoRing *ring)
+{
+}
+
+#endif	//__linux__
@@ -0,0 +1,65 @@
+/**** LICENSE INFORMATION ****
+IDEA - uring.h
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef URING_H_
+#define URING_H_
+
+#include "idea.h"
+
+//Reads and writes queued to the kernel and completed in any order (io_uring).
+//Only available on Linux: elsewhere OpenIoRing fails, and the callers use stdio.
+typedef struct
+{
+	int fd;
+	unsigned int depth;				//Requests in flight at most
+	unsigned int queued;			//Requests in the submission queue, not yet seen by the kernel
+	unsigned int inFlight;			//Requests submitted and not yet completed
+	void *sqRing, *cqRing, *sqes;
+	size_t sqRingSize, cqRingSize, sqesSize;
+	unsigned int *sqTail, *sqMask, *sqArray;
+	unsigned int *cqHead, *cqTail, *cqMask;
+	void *cqes;
+	Uint8 **bufs;					//Registered by RegisterIoBuffers, owned by the caller
+	void *iovecs;					//One per buffer, for the kernels without registered buffers
+	int fixedBuffers;				//The buffers are registered with the kernel
+} IoRing;
+
+//Returns 0 if io_uring is not supported, without printing anything
+int OpenIoRing(IoRing *ring, unsigned int depth);
+
+//The buffers that the requests will use, identified by their index.
+//Registering them spares the kernel from mapping them again for each request;
+//if that is not possible (locked memory limit...), they are passed one by one.
+//bufs must stay valid until CloseIoRing.
+int RegisterIoBuffers(IoRing *ring, Uint8 **bufs, int nbBufs, size_t size);
+
+//Queues a read or a write of size bytes at offset, starting size bytes into buffer bufIndex.
+//tag comes back with the completion. Returns 0 if depth requests are already pending.
+int QueueIoRequest(IoRing *ring, int write, int fd, int bufIndex, size_t start, size_t size, Uint64 offset, Uint64 tag);
+
+//Submits the queued requests, then returns the next completion: its tag, and
+//its result (bytes transferred or -errno). Waits for one if wait is set.
+//Returns 0 if there is no completion, or nothing left to wait for.
+int GetIoCompletion(IoRing *ring, int wait, Uint64 *tag, int *result);
+
+//The requests in flight must have completed
+void CloseIoRing(IoRing *ring);
+
+#endif /* URING_H_ */
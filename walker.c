@@ -0,0 +1,377 @@
+/**** LICENSE INFORMATION ****
+IDEA - walker.c
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* The threads share a stack of directories to read. Each one reads a directory,
+ * pushes its subdirectories on the stack for any thread to take, and queues its
+ * files for the caller, which processes them while the listing goes on. The queue
+ * is bounded, so the walker does not run far ahead of the processing.
+ *
+ * The files of a directory are queued only once it has been read to the end: the
+ * processing creates and deletes files next to them, and the entries of a directory
+ * changed while it is being read may be skipped or given twice.
+ *
+ * Windows: FindFirstFile gives the type and the size of the entries with their names.
+ * Elsewhere: d_type gives the type without a stat, and the size of the files comes
+ * from fstatat relative to the directory, without resolving the whole path again. */
+
+#include <errno.h>
+
+#include "walker.h"
+#include "threadpool.h"
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#define MAX_WALKER_THREADS		16
+#define WALKER_QUEUE_SIZE		4096	//Files found and not yet taken, at most, plus the last directory read
+
+//The files of the directory being read
+typedef struct
+{
+	WalkedEntry *head, *tail;
+	int nbFiles;
+	Uint64 totalSize;
+} WalkedFiles;
+
+static void* WalkerMain(void *data);
+static void ReadDirectory(DirWalker *walker, WalkedEntry *dir);
+static WalkedEntry* NewEntry(const char *dirPath, const char *name);
+static void AddEntry(DirWalker *walker, WalkedFiles *found, const char *dirPath, const char *name, int isDir, Uint64 size);
+static void QueueEntry(DirWalker *walker, WalkedEntry *entry, int error, int isDir);
+static void QueueFiles(DirWalker *walker, WalkedFiles *found);
+
+
+int StartDirWalker(DirWalker *walker, const char *root, int recursive, int nbThreads)
+{
+	WalkedEntry *entry;
+	int rc, t;
+
+	memset(walker, 0, sizeof(DirWalker));
+	walker->recursive = recursive;
+	pthread_mutex_init(&walker->mutex, NULL);
+	pthread_cond_init(&walker->dirAvailable, NULL);
+	pthread_cond_init(&walker->fileAvailable, NULL);
+	pthread_cond_init(&walker->spaceAvailable, NULL);
+
+	//Listing is mostly waiting for the disk, a few threads are enough to keep it busy
+	if (nbThreads <= 0)
+		nbThreads = GetCpuCount() < 4 ? 4 : GetCpuCount();
+	if (nbThreads > MAX_WALKER_THREADS)
+		nbThreads = MAX_WALKER_THREADS;
+	if (!recursive)
+		nbThreads = 1;
+
+	if (!(entry = NewEntry(root, NULL)) || !(walker->threads = malloc(sizeof(pthread_t) * nbThreads)))
+	{
+		printf("Unable to allocate memory for the listing.\n");
+		free(entry);
+		StopDirWalker(walker);
+		return 0;
+	}
+	QueueEntry(walker, entry, 0, 1);
+
+	for (t=0 ; t < nbThreads ; t++)
+	{
+		if ((rc = pthread_create(&(walker->threads[t]), NULL, WalkerMain, walker)))
+		{
+			printf("Unable to create listing thread: return code from pthread_create() is %d\n", rc);
+			break;
+		}
+		walker->nbThreads++;
+	}
+
+	if (!walker->nbThreads)
+	{
+		StopDirWalker(walker);
+		return 0;
+	}
+	return 1;
+}
+
+const char* GetNextWalkedFile(DirWalker *walker, int *error)
+{
+	WalkedEntry *entry;
+	const char *path = NULL;
+
+	free(walker->taken);
+	walker->taken = NULL;
+
+	pthread_mutex_lock(&walker->mutex);
+	while (!walker->head && !walker->done)
+		pthread_cond_wait(&walker->fileAvailable, &walker->mutex);
+
+	if ((entry = walker->head))
+	{
+		walker->head = entry->next;
+		if (!walker->head)
+			walker->tail = NULL;
+		walker->nbQueued--;
+		pthread_cond_signal(&walker->spaceAvailable);
+
+		path = entry->path;
+		*error = entry->error;
+		walker->taken = entry;
+	}
+	pthread_mutex_unlock(&walker->mutex);
+
+	return path;
+}
+
+//The files and directories not taken yet are dropped
+void StopDirWalker(DirWalker *walker)
+{
+	WalkedEntry *entry;
+	int t;
+
+	pthread_mutex_lock(&walker->mutex);
+	walker->stop = 1;
+	pthread_cond_broadcast(&walker->dirAvailable);
+	pthread_cond_broadcast(&walker->spaceAvailable);
+	pthread_mutex_unlock(&walker->mutex);
+
+	for (t=0 ; t < walker->nbThreads ; t++)
+		pthread_join(walker->threads[t], NULL);
+	free(walker->threads);
+	walker->threads = NULL;
+	walker->nbThreads = 0;
+
+	while ((entry = walker->dirs) || (entry = walker->head))
+	{
+		if (entry == walker->dirs)
+			walker->dirs = entry->next;
+		else
+			walker->head = entry->next;
+		free(entry);
+	}
+	walker->tail = NULL;
+	free(walker->taken);
+	walker->taken = NULL;
+
+	pthread_mutex_destroy(&walker->mutex);
+	pthread_cond_destroy(&walker->dirAvailable);
+	pthread_cond_destroy(&walker->fileAvailable);
+	pthread_cond_destroy(&walker->spaceAvailable);
+}
+
+
+//The listing is over when no directory is left and no thread is reading one
+static void* WalkerMain(void *data)
+{
+	DirWalker *walker = (DirWalker*)data;
+	WalkedEntry *entry;
+
+	pthread_mutex_lock(&walker->mutex);
+	while (!walker->stop)
+	{
+		if ((entry = walker->dirs))
+		{
+			walker->dirs = entry->next;
+			walker->nbBusy++;
+			pthread_mutex_unlock(&walker->mutex);
+
+			ReadDirectory(walker, entry);
+
+			pthread_mutex_lock(&walker->mutex);
+			walker->nbBusy--;
+		}
+		else if (!walker->nbBusy)
+			break;
+		else
+			pthread_cond_wait(&walker->dirAvailable, &walker->mutex);
+	}
+
+	walker->done = 1;
+	pthread_cond_broadcast(&walker->dirAvailable);
+	pthread_cond_broadcast(&walker->fileAvailable);
+	pthread_mutex_unlock(&walker->mutex);
+
+	return NULL;
+}
+
+//Takes dir, which goes to the caller if the directory cannot be read
+static void ReadDirectory(DirWalker *walker, WalkedEntry *dir)
+{
+	const char *path = dir->path;
+#ifdef WIN32
+	WalkedFiles found = {NULL, NULL, 0, 0};
+	WIN32_FIND_DATAA data;
+	HANDLE handle;
+	char *pattern = malloc(strlen(path)+3);
+	DWORD err;
+
+	if (!pattern)
+	{
+		QueueEntry(walker, dir, ENOMEM, 0);
+		return;
+	}
+	sprintf(pattern, "%s/*", path);
+	handle = FindFirstFileA(pattern, &data);
+	free(pattern);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		err = GetLastError();
+		if (err == ERROR_FILE_NOT_FOUND)
+			free(dir);
+		else
+			QueueEntry(walker, dir, err == ERROR_PATH_NOT_FOUND ? ENOENT : EACCES, 0);
+		return;
+	}
+
+	do
+	{
+		if (strcmp(data.cFileName, ".") && strcmp(data.cFileName, ".."))
+			AddEntry(walker, &found, path, data.cFileName, (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0,
+					((Uint64)data.nFileSizeHigh << 32) | data.nFileSizeLow);
+	} while (!walker->stop && FindNextFileA(handle, &data));
+
+	FindClose(handle);
+	QueueFiles(walker, &found);
+	free(dir);
+#else
+	WalkedFiles found = {NULL, NULL, 0, 0};
+	struct dirent *ep;
+	struct stat s;
+	DIR *dp;
+	int fd = open(path, O_RDONLY | O_DIRECTORY), isDir, known;
+
+	if (fd < 0 || !(dp = fdopendir(fd)))
+	{
+		QueueEntry(walker, dir, errno, 0);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	while (!walker->stop && (ep = readdir(dp)))
+	{
+		if (!strcmp(ep->d_name, ".") || !strcmp(ep->d_name, ".."))
+			continue;
+
+		//Links are followed, as with stat; some file systems do not give the type at all
+#ifdef DT_UNKNOWN
+		known = ep->d_type == DT_DIR || ep->d_type == DT_REG;
+		isDir = ep->d_type == DT_DIR;
+#else
+		known = isDir = 0;
+#endif
+		if (known && isDir)
+			AddEntry(walker, &found, path, ep->d_name, 1, 0);
+		else if (!fstatat(fd, ep->d_name, &s, 0) && (known || S_ISDIR(s.st_mode) || S_ISREG(s.st_mode)))
+			AddEntry(walker, &found, path, ep->d_name, S_ISDIR(s.st_mode), (Uint64)s.st_size);
+	}
+
+	closedir(dp);
+	QueueFiles(walker, &found);
+	free(dir);
+#endif
+}
+
+//The subdirectories go on the stack at once, the files wait for the end of the directory
+static void AddEntry(DirWalker *walker, WalkedFiles *found, const char *dirPath, const char *name, int isDir, Uint64 size)
+{
+	WalkedEntry *entry;
+
+	if ((isDir && !walker->recursive) || !(entry = NewEntry(dirPath, name)))
+		return;
+	if (isDir)
+	{
+		QueueEntry(walker, entry, 0, 1);
+		return;
+	}
+
+	if (found->tail)
+		found->tail->next = entry;
+	else
+		found->head = entry;
+	found->tail = entry;
+	found->nbFiles++;
+	found->totalSize += size;
+}
+
+//dirPath/name, or dirPath alone
+static WalkedEntry* NewEntry(const char *dirPath, const char *name)
+{
+	WalkedEntry *entry = malloc(sizeof(WalkedEntry) + strlen(dirPath) + (name ? strlen(name)+1 : 0) + 1);
+
+	if (!entry)
+		return NULL;
+	entry->next = NULL;
+	entry->error = 0;
+	if (name)
+		sprintf(entry->path, "%s/%s", dirPath, name);
+	else
+		strcpy(entry->path, dirPath);
+	return entry;
+}
+
+//A directory to read, or a directory that could not be read for the caller, which may have to make room first
+static void QueueEntry(DirWalker *walker, WalkedEntry *entry, int error, int isDir)
+{
+	entry->error = error;
+	entry->next = NULL;
+
+	pthread_mutex_lock(&walker->mutex);
+	if (isDir)
+	{
+		entry->next = walker->dirs;
+		walker->dirs = entry;
+		pthread_cond_signal(&walker->dirAvailable);
+	}
+	else
+	{
+		while (walker->nbQueued >= WALKER_QUEUE_SIZE && !walker->stop)
+			pthread_cond_wait(&walker->spaceAvailable, &walker->mutex);
+		if (walker->tail)
+			walker->tail->next = entry;
+		else
+			walker->head = entry;
+		walker->tail = entry;
+		walker->nbQueued++;
+		pthread_cond_signal(&walker->fileAvailable);
+	}
+	pthread_mutex_unlock(&walker->mutex);
+}
+
+//All the files of a directory at once, when the caller has made room
+static void QueueFiles(DirWalker *walker, WalkedFiles *found)
+{
+	if (!found->head)
+		return;
+
+	pthread_mutex_lock(&walker->mutex);
+	while (walker->nbQueued >= WALKER_QUEUE_SIZE && !walker->stop)
+		pthread_cond_wait(&walker->spaceAvailable, &walker->mutex);
+	if (walker->tail)
+		walker->tail->next = found->head;
+	else
+		walker->head = found->head;
+	walker->tail = found->tail;
+	walker->nbQueued += found->nbFiles;
+	walker->nbFiles += found->nbFiles;
+	walker->totalSize += found->totalSize;
+	pthread_cond_signal(&walker->fileAvailable);
+	pthread_mutex_unlock(&walker->mutex);
+}
@@ -0,0 +1,64 @@
+/**** LICENSE INFORMATION ****
+IDEA - walker.h
+Data encryption program
+Copyright (C) 2015  Quoc-Nam Dessoulles
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef WALKER_H_
+#define WALKER_H_
+
+#include "idea.h"
+
+//Allocated with its path in one piece
+typedef struct WalkedEntry
+{
+	struct WalkedEntry *next;
+	int error;						//errno of a directory that could not be listed
+	char path[];
+} WalkedEntry;
+
+//Lists a tree of directories on several threads, giving the files as they are found
+typedef struct
+{
+	int recursive;
+	WalkedEntry *dirs;				//Directories left to read
+	WalkedEntry *head, *tail;		//Files found, not yet taken
+	WalkedEntry *taken;				//Last one given to the caller
+	int nbQueued;
+	int nbBusy;						//Threads reading a directory
+	int done;
+	int stop;
+	Uint64 nbFiles, totalSize;		//Found so far
+	pthread_t *threads;
+	int nbThreads;
+	pthread_mutex_t mutex;
+	pthread_cond_t dirAvailable;
+	pthread_cond_t fileAvailable;
+	pthread_cond_t spaceAvailable;
+} DirWalker;
+
+//nbThreads <= 0: a default depending on the number of processors
+int StartDirWalker(DirWalker *walker, const char *root, int recursive, int nbThreads);
+
+//The next file found, valid until the next call, or NULL once the whole tree has been listed.
+//If error is not 0 on return, the path is a directory that could not be listed.
+//The files come in no particular order.
+const char* GetNextWalkedFile(DirWalker *walker, int *error);
+
+void StopDirWalker(DirWalker *walker);
+
+#endif /* WALKER_H_ */